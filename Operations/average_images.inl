@@ -5,151 +5,267 @@ namespace DCM
 namespace Operations
 {
 
-template <> struct Operation<OperationType::AverageImages> 
+/// <summary>
+/// Sums of a run of consecutive images of the average. The buffers are sized
+/// by the first image and reused for every image after it.
+/// With trimming, the TrimCount lowest and highest values of every pixel are
+/// kept sorted as well, so that they can be taken out of the sum at the end.
+/// </summary>
+struct PartialAverage
+{
+    std::vector<float> Image;
+    std::vector<double> Sums;
+    double WeightSum = 0;
+    unsigned Count = 0;
+
+    // TrimCount values per pixel, ascending in Lowest and descending in Highest
+    unsigned TrimCount = 0;
+    std::vector<float> Lowest;
+    std::vector<float> Highest;
+
+    void Initialize(size_t nValues, unsigned trimCount)
+    {
+        TrimCount = trimCount;
+        Sums.assign(nValues, 0.);
+        Lowest.resize(nValues * trimCount);
+        Highest.resize(nValues * trimCount);
+    }
+
+    void Accumulate(double weight)
+    {
+        auto pValues = Image.data();
+        auto pSums = Sums.data();
+        auto nValues = Sums.size();
+        for (size_t i = 0; i < nValues; i++)
+        {
+            pSums[i] += weight * pValues[i];
+        }
+
+        if (TrimCount != 0)
+        {
+            for (size_t i = 0; i < nValues; i++)
+            {
+                Insert(&Lowest[i * TrimCount], Count, pValues[i], std::less<float>());
+                Insert(&Highest[i * TrimCount], Count, pValues[i], std::greater<float>());
+            }
+        }
+
+        WeightSum += weight;
+        Count++;
+    }
+
+    // Merges the values [begin, end) of other into this one, which holds the
+    // trimmed values of nSeen images so far
+    void Merge(const PartialAverage& other, unsigned nSeen, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            Sums[i] += other.Sums[i];
+        }
+
+        if (TrimCount != 0)
+        {
+            auto nOther = (std::min)(other.Count, TrimCount);
+            for (size_t i = begin; i < end; i++)
+            {
+                // Every value of the overall k lowest is among the k lowest of
+                // the runner that saw it
+                auto nKept = nSeen;
+                for (unsigned j = 0; j < nOther; j++)
+                {
+                    Insert(&Lowest[i * TrimCount], nKept, other.Lowest[i * TrimCount + j], std::less<float>());
+                    Insert(&Highest[i * TrimCount], nKept, other.Highest[i * TrimCount + j], std::greater<float>());
+                    nKept++;
+                }
+            }
+        }
+    }
+
+    void MergeTotals(const PartialAverage& other)
+    {
+        WeightSum += other.WeightSum;
+        Count += other.Count;
+    }
+
+    // Insertion into the first min(nSeen, TrimCount) sorted values of pKept
+    template <typename TCompare>
+    void Insert(float* pKept, unsigned nSeen, float value, TCompare compare) const
+    {
+        unsigned nKept = (std::min)(nSeen, TrimCount);
+        if (nKept == TrimCount && !compare(value, pKept[TrimCount - 1]))
+        {
+            return;
+        }
+
+        unsigned position = (std::min)(nKept, TrimCount - 1);
+        while (position > 0 && compare(value, pKept[position - 1]))
+        {
+            pKept[position] = pKept[position - 1];
+            position--;
+        }
+        pKept[position] = value;
+    }
+};
+
+template <> struct Operation<OperationType::AverageImages>
 {
     // Input/output variables
     std::wstring m_inputFolder;
     std::wstring m_outputFile;
 
+    // Optional "<file name> <weight>" lines, one for every image in the folder
+    std::wstring m_weightsFile;
+
+    // Fraction of the lowest and of the highest values of every pixel that are
+    // left out of its mean
+    float m_trimFraction;
+
     Operation(
         const std::wstring& inputFolder,
-        const std::wstring& outputFile) :
+        const std::wstring& outputFile,
+        const std::wstring& weightsFile = std::wstring(),
+        float trimFraction = 0.f) :
         m_inputFolder(inputFolder),
-        m_outputFile(outputFile)
+        m_outputFile(outputFile),
+        m_weightsFile(weightsFile),
+        m_trimFraction(trimFraction)
     {}
 
     HRESULT Run(Application::Infrastructure::DeviceResources& resources)
     {
-        UNREFERENCED_PARAMETER(resources);
+        std::vector<std::wstring> children;
+        RETURN_IF_FAILED(GetChildren(m_inputFolder, &children, DCM::FileType::File));
+        RETURN_HR_IF(E_INVALIDARG, children.empty());
 
-        struct ImageData
+        // Images are taken in name order, whatever the directory listing
+        std::sort(std::begin(children), std::end(children));
+        auto nImages = static_cast<unsigned>(children.size());
+
+        std::vector<double> weights(nImages, 1.);
+        if (!m_weightsFile.empty())
         {
-            std::vector<float> Data;
-            unsigned Width;
-            unsigned Height;
-            unsigned Channels;
-        };
+            RETURN_IF_FAILED(ReadWeights(children, &weights));
+        }
 
-        Concurrency::ConcurrentQueue<std::shared_ptr<ImageData>> fileQueue(3);
+        RETURN_HR_IF(E_INVALIDARG, m_trimFraction < 0.f || m_trimFraction >= .5f);
+        RETURN_HR_IF(E_INVALIDARG, m_trimFraction != 0.f && !m_weightsFile.empty());
+        auto trimCount = static_cast<unsigned>(nImages * m_trimFraction);
 
-        std::vector<std::wstring> children;
-        RETURN_IF_FAILED(GetChildren(m_inputFolder, &children, DCM::FileType::File));
+        // One partial per thread, each summing a run of consecutive images. For
+        // a given number of threads every image goes to the same partial and
+        // the partials are merged in image order, so the sums are reproducible.
+        auto nPartials = (std::min)(nImages, Concurrency::TaskPool::GetDefault().GetThreadCount());
+        std::vector<std::unique_ptr<PartialAverage>> partials(nPartials);
+        for (auto& partial : partials)
+        {
+            partial.reset(new PartialAverage());
+        }
 
-        std::thread t1(
-            [](auto resources, auto files, auto queue)
+        // Every image has to match the first one, and the average is placed
+        // like it. The first image is summed from this decode.
+        unsigned width, height, channels;
+        VolumeDescription volume;
+        RETURN_IF_FAILED(GetBufferFromGrayscaleImage(resources, children[0].c_str(), &partials[0]->Image, &width, &height, &channels));
+        RETURN_IF_FAILED(GetImageDescription(children[0], width, height, channels, &volume));
+        size_t nValues = static_cast<size_t>(width) * height * channels;
+
+        std::atomic<bool> isFailed { false };
+        Concurrency::ParallelFor(0, nPartials, 1,
+            [&](uint64_t beginPartial, uint64_t endPartial)
             {
-                [&]() -> HRESULT
+                for (auto p = beginPartial; p < endPartial; p++)
                 {
-                    for (auto file : files.get())
+                    auto pPartial = partials[p].get();
+                    pPartial->Initialize(nValues, trimCount);
+
+                    auto begin = p * nImages / nPartials;
+                    auto end = (p + 1) * nImages / nPartials;
+                    for (auto i = begin; i < end && !isFailed.load(); i++)
                     {
-                        auto spImageData = std::make_shared<ImageData>();
-                        FAIL_FAST_IF_FAILED(
-                            GetBufferFromGrayscaleImage(
-                                resources.get(),
-                                file.c_str(),
-                                &spImageData->Data,
-                                &spImageData->Width,
-                                &spImageData->Height,
-                                &spImageData->Channels
-                            ));
-                        queue.get().Enqueue(std::move(spImageData));
+                        unsigned imageWidth, imageHeight, imageChannels;
+                        if (i != 0 &&
+                            (FAILED(GetBufferFromGrayscaleImage(
+                                resources, children[i].c_str(), &pPartial->Image, &imageWidth, &imageHeight, &imageChannels)) ||
+                             imageWidth != width || imageHeight != height || imageChannels != channels))
+                        {
+                            isFailed.store(true);
+                            break;
+                        }
+                        pPartial->Accumulate(weights[i]);
                     }
-                    RETURN_IF_FAILED(queue.get().Finish());
-                    return S_OK;
-                }();
-            }, std::ref(resources), std::ref(children), std::ref(fileQueue));
-        
-        std::thread t2(
-            [](auto resources, auto queue, auto outputFile)
+                }
+            });
+
+        RETURN_HR_IF(E_FAIL, isFailed.load());
+
+        // The partials are merged once, in image order
+        auto& total = *partials[0];
+        total.Image.clear();
+        total.Image.shrink_to_fit();
+        Concurrency::ParallelFor(0, nValues, 4096,
+            [&](uint64_t begin, uint64_t end)
             {
-                [&]() -> HRESULT
+                auto nSeen = total.Count;
+                for (size_t i = 1; i < partials.size(); i++)
                 {
-                    unsigned width = 0;
-                    unsigned height = 0;
-                    unsigned channels = 0;
-                    Microsoft::WRL::ComPtr<ID3D11Buffer> spOutBuffer;
-                    std::vector<Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView>> uavs;
-                    unsigned slice = 0;
-
-                    bool isDefunct;
-                    while (SUCCEEDED(queue.get().IsDefunct(&isDefunct)) && !isDefunct)
-                    {
-                        std::shared_ptr<ImageData> image;
-                        FAIL_FAST_IF_FAILED(queue.get().Dequeue(&image));
-
-                        if (!spOutBuffer || uavs.size() == 0)
-                        {
-                            width = image->Width;
-                            height = image->Height;
-                            channels = image->Channels;
-
-                            Log(L"Creating resources for output buffer: (%d, %d)", image->Height, image->Width);
-                            std::vector<float> zeroOutBuffer(image->Width * image->Height, 0.f);
-                            FAIL_FAST_IF_FAILED(resources.get().CreateStructuredBuffer(
-                                sizeof(float) * channels /* size of item */,
-                                width * height /* num items */,
-                                &zeroOutBuffer[0]/* data */,
-                                &spOutBuffer));
-
-                            Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spOutBufferUnorderedAccessView;
-                            FAIL_FAST_IF_FAILED(
-                                resources.get().CreateStructuredBufferUAV(
-                                    spOutBuffer.Get(),
-                                    &spOutBufferUnorderedAccessView));
-
-                            uavs = { spOutBufferUnorderedAccessView };
-
-                            Log(L"Created resources for output buffer.");
-                        }
+                    total.Merge(*partials[i], nSeen, begin, end);
+                    nSeen += partials[i]->Count;
+                }
+            });
+        for (size_t i = 1; i < partials.size(); i++)
+        {
+            total.MergeTotals(*partials[i]);
+        }
 
-                        FAIL_FAST_IF_FALSE(width == image->Width);
-                        FAIL_FAST_IF_FALSE(height == image->Height);
-                        FAIL_FAST_IF_FALSE(channels == image->Channels);
+        RETURN_HR_IF(E_INVALIDARG, total.WeightSum <= 0.);
 
-                        struct {
-                            unsigned Slice;
-                            unsigned Unused[3];
-                        } constantData =
-                        {
-                            slice++,
-                        };
-
-                        Microsoft::WRL::ComPtr<ID3D11Buffer> spConstantBuffer;
-                        RETURN_IF_FAILED(resources.get().CreateConstantBuffer(constantData, &spConstantBuffer));
-
-                        Microsoft::WRL::ComPtr<ID3D11Buffer> spBuffer;
-                        RETURN_IF_FAILED(resources.get().CreateStructuredBuffer(
-                            sizeof(float) /* size of item */,
-                            width * height * channels /* num items */,
-                            &(image->Data.at(0)),
-                            &spBuffer));
-
-                        Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> spShaderResourceView;
-                        RETURN_IF_FAILED(resources.get().CreateStructuredBufferSRV(spBuffer.Get(), &spShaderResourceView));
-
-                        std::vector<ID3D11ShaderResourceView*> sharedResourceViews = { spShaderResourceView.Get() };
-                        
-                        Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
-                        RETURN_IF_FAILED(CreateShader(resources, L"Shaders\\average_image.hlsl", &spComputeShader));
-                        resources.get().RunComputeShader(spComputeShader.Get(), spConstantBuffer.Get(), 1, &sharedResourceViews[0],
-                            uavs, width * height, 1, 1);
+        std::vector<float> average(nValues);
+        auto divisor = trimCount != 0 ? static_cast<double>(nImages - 2 * trimCount) : total.WeightSum;
+        Concurrency::ParallelFor(0, nValues, 4096,
+            [&](uint64_t begin, uint64_t end)
+            {
+                for (auto i = begin; i < end; i++)
+                {
+                    auto sum = total.Sums[i];
+                    for (unsigned j = 0; j < trimCount; j++)
+                    {
+                        sum -= total.Lowest[i * trimCount + j];
+                        sum -= total.Highest[i * trimCount + j];
                     }
+                    average[i] = static_cast<float>(sum / divisor);
+                }
+            });
 
-                    RETURN_IF_FAILED(
-                        SaveToFile(
-                            resources,
-                            spOutBuffer.Get(),
-                            width,
-                            height,
-                            sizeof(float) * channels,
-                            outputFile.c_str()));
-                    return S_OK;
-                }();
-            }, std::ref(resources), std::ref(fileQueue), m_outputFile);
-
-        t1.join();
-        t2.join();
+        RETURN_IF_FAILED(SaveToFile(average.data(), volume, m_outputFile.c_str()));
+        return S_OK;
+    }
+
+private:
+    HRESULT ReadWeights(const std::vector<std::wstring>& children, std::vector<double>* pWeights)
+    {
+        std::wifstream stream(ToNativePath(m_weightsFile));
+        RETURN_HR_IF_FALSE(E_INVALIDARG, stream.good());
 
+        std::map<std::wstring, double> weightsByName;
+        std::wstring line;
+        while (std::getline(stream, line))
+        {
+            std::wistringstream lineStream(line);
+            std::wstring name;
+            double weight;
+            if (lineStream >> name >> weight)
+            {
+                RETURN_HR_IF(E_INVALIDARG, weight < 0.);
+                weightsByName[name] = weight;
+            }
+        }
+
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            auto foundIt = weightsByName.find(fs::path(children[i]).filename().wstring());
+            RETURN_HR_IF(E_INVALIDARG, foundIt == weightsByName.end());
+            (*pWeights)[i] = foundIt->second;
+        }
         return S_OK;
     }
 };
@@ -0,0 +1,643 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+
+namespace DCM
+{
+namespace Operations
+{
+
+/// <summary>
+/// Inputs shared by the micro-benchmarks. Benchmarks that read a series take it
+/// from InputFolder.
+/// </summary>
+struct BenchmarkContext
+{
+    std::wstring InputFolder;
+    unsigned Iterations;
+};
+
+namespace Benchmarks
+{
+
+class Stopwatch
+{
+public:
+    Stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+    double GetElapsedMicroseconds() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#ifdef DCP_CPU_BACKEND
+// DirectXMath is not available to the CPU backend. These do the work of
+// XMMatrixInverse and XMVector4Transform in scalar code, with row vectors as
+// DirectXMath uses them.
+struct BaselineMatrix
+{
+    float m[4][4];
+};
+
+inline BaselineMatrix InvertBaselineMatrix(BaselineMatrix matrix)
+{
+    BaselineMatrix inverse = {};
+    for (unsigned i = 0; i < 4; i++)
+    {
+        inverse.m[i][i] = 1.f;
+    }
+
+    // Gauss-Jordan elimination with partial pivoting
+    for (unsigned column = 0; column < 4; column++)
+    {
+        unsigned pivot = column;
+        for (unsigned row = column + 1; row < 4; row++)
+        {
+            if (std::abs(matrix.m[row][column]) > std::abs(matrix.m[pivot][column]))
+            {
+                pivot = row;
+            }
+        }
+        std::swap(matrix.m[column], matrix.m[pivot]);
+        std::swap(inverse.m[column], inverse.m[pivot]);
+
+        auto scale = 1.f / matrix.m[column][column];
+        for (unsigned i = 0; i < 4; i++)
+        {
+            matrix.m[column][i] *= scale;
+            inverse.m[column][i] *= scale;
+        }
+
+        for (unsigned row = 0; row < 4; row++)
+        {
+            auto factor = matrix.m[row][column];
+            if (row == column || factor == 0.f)
+            {
+                continue;
+            }
+            for (unsigned i = 0; i < 4; i++)
+            {
+                matrix.m[row][i] -= factor * matrix.m[column][i];
+                inverse.m[row][i] -= factor * inverse.m[column][i];
+            }
+        }
+    }
+    return inverse;
+}
+
+inline std::array<float, 4> TransformByBaselineMatrix(const float (&vector)[4], const BaselineMatrix& matrix)
+{
+    std::array<float, 4> result;
+    for (unsigned i = 0; i < 4; i++)
+    {
+        result[i] =
+            vector[0] * matrix.m[0][i] +
+            vector[1] * matrix.m[1][i] +
+            vector[2] * matrix.m[2][i] +
+            vector[3] * matrix.m[3][i];
+    }
+    return result;
+}
+#endif
+
+// SortFilesInScene as it was before slice geometries: the orientation of every
+// file is compared as a string, and on every comparison the positions of both
+// files are converted to wide strings, tokenized and transformed into the
+// frame of the first image
+inline void SortFilesByParsingInComparator(std::vector<std::shared_ptr<DicomFile>>* outFiles)
+{
+    auto GetAsFloatVector = [](const std::wstring& str)
+    {
+        std::wistringstream wisstream(str);
+        std::vector<float> values;
+        std::wstring token;
+        while (std::getline(wisstream, token, L'\\'))
+        {
+            wchar_t* stopString;
+            values.push_back(static_cast<float>(wcstod(token.c_str(), &stopString)));
+        }
+        return values;
+    };
+
+    // Get orientation
+    auto firstFile = outFiles->at(0);
+
+    std::wstring firstImageOrientation;
+    firstFile->GetAttribute(Tags::ImageOrientationPatient, &firstImageOrientation);
+
+    // Ensure all images are oriented in same direction
+    auto foundNotMatchingIt =
+        std::find_if(
+            std::begin(*outFiles), std::end(*outFiles),
+            [&firstImageOrientation](auto dicomFile) {
+                std::wstring imageOrientation;
+                dicomFile->GetAttribute(Tags::ImageOrientationPatient, &imageOrientation);
+                return _wcsicmp(imageOrientation.c_str(), firstImageOrientation.c_str()) != 0;
+            });
+
+    FAIL_FAST_IF_FALSE(foundNotMatchingIt == std::end(*outFiles));
+
+    // Get first images position
+    std::wstring firstImagePosition;
+    firstFile->GetAttribute(Tags::ImagePositionPatient, &firstImagePosition);
+    auto posValues = GetAsFloatVector(firstImagePosition);
+    FAIL_FAST_IF_TRUE(posValues.size() != 3);
+
+    // Construct image frame of reference to zorder files
+    auto orientationValues = GetAsFloatVector(firstImageOrientation);
+    FAIL_FAST_IF_TRUE(orientationValues.size() != 6);
+
+#ifndef DCP_CPU_BACKEND
+    auto xaxis = DirectX::XMVectorSet(
+        orientationValues[0],
+        orientationValues[1],
+        orientationValues[2],
+        0.f);
+    auto yaxis = DirectX::XMVectorSet(
+        orientationValues[3],
+        orientationValues[4],
+        orientationValues[5],
+        0.f);
+    auto zaxis = DirectX::XMVector3Normalize(DirectX::XMVector3Cross(xaxis, yaxis));
+
+    const DirectX::XMFLOAT4X4 refFrameToWorld4x4(
+        orientationValues[0], orientationValues[1], orientationValues[2], 0,
+        orientationValues[3], orientationValues[4], orientationValues[5], 0,
+        DirectX::XMVectorGetX(zaxis), DirectX::XMVectorGetY(zaxis), DirectX::XMVectorGetZ(zaxis), 0,
+        posValues[0], posValues[1], posValues[2], 1
+    );
+
+    auto refFrameToWorld = DirectX::XMLoadFloat4x4(&refFrameToWorld4x4);
+    DirectX::XMVECTOR determinant;
+    auto worldToRefFrame = DirectX::XMMatrixInverse(&determinant, refFrameToWorld);
+
+    auto getDepthInScene = [&](const std::vector<float>& position)
+    {
+        auto vec = DirectX::XMVectorSet(position[0], position[1], position[2], 1.f);
+        vec = DirectX::XMVector4Transform(vec, worldToRefFrame);
+        return DirectX::XMVectorGetZ(vec);
+    };
+#else
+    float zaxis[3] =
+    {
+        orientationValues[1] * orientationValues[5] - orientationValues[2] * orientationValues[4],
+        orientationValues[2] * orientationValues[3] - orientationValues[0] * orientationValues[5],
+        orientationValues[0] * orientationValues[4] - orientationValues[1] * orientationValues[3]
+    };
+    auto zlength = std::sqrt(zaxis[0] * zaxis[0] + zaxis[1] * zaxis[1] + zaxis[2] * zaxis[2]);
+
+    const BaselineMatrix refFrameToWorld =
+    { {
+        { orientationValues[0], orientationValues[1], orientationValues[2], 0 },
+        { orientationValues[3], orientationValues[4], orientationValues[5], 0 },
+        { zaxis[0] / zlength, zaxis[1] / zlength, zaxis[2] / zlength, 0 },
+        { posValues[0], posValues[1], posValues[2], 1 }
+    } };
+
+    auto worldToRefFrame = InvertBaselineMatrix(refFrameToWorld);
+
+    auto getDepthInScene = [&](const std::vector<float>& position)
+    {
+        float vec[4] = { position[0], position[1], position[2], 1.f };
+        return TransformByBaselineMatrix(vec, worldToRefFrame)[2];
+    };
+#endif
+
+    // Sort the files by their order in the scene
+    std::sort(std::begin(*outFiles), std::end(*outFiles),
+        [&](auto left, auto right)
+        {
+            std::wstring leftImagePosition, rightImagePosition;
+            left->GetAttribute(Tags::ImagePositionPatient, &leftImagePosition);
+            auto leftPosValues = GetAsFloatVector(leftImagePosition);
+            FAIL_FAST_IF_TRUE(leftPosValues.size() != 3);
+
+            right->GetAttribute(Tags::ImagePositionPatient, &rightImagePosition);
+            auto rightPosValues = GetAsFloatVector(rightImagePosition);
+            FAIL_FAST_IF_TRUE(rightPosValues.size() != 3);
+
+            return getDepthInScene(leftPosValues) > getDepthInScene(rightPosValues);
+        });
+}
+
+inline HRESULT SortFiles(const BenchmarkContext& context, std::wostream& report)
+{
+    RETURN_HR_IF(E_INVALIDARG, context.InputFolder.empty());
+
+    std::vector<std::shared_ptr<DicomFile>> files;
+    RETURN_IF_FAILED(GetMetadataFiles(context.InputFolder, &files));
+    RETURN_HR_IF(E_FAIL, files.empty());
+
+    // Both sorts start from the same shuffles
+    std::mt19937 random(0);
+    double baselineMicroseconds = 0;
+    double sortMicroseconds = 0;
+    for (unsigned i = 0; i < context.Iterations; i++)
+    {
+        std::shuffle(std::begin(files), std::end(files), random);
+        auto baselineFiles = files;
+        auto sortedFiles = files;
+
+        Stopwatch baseline;
+        SortFilesByParsingInComparator(&baselineFiles);
+        baselineMicroseconds += baseline.GetElapsedMicroseconds();
+
+        Stopwatch sort;
+        RETURN_IF_FAILED(SortFilesInScene(&sortedFiles));
+        sortMicroseconds += sort.GetElapsedMicroseconds();
+
+        RETURN_HR_IF_FALSE(E_FAIL, baselineFiles == sortedFiles);
+    }
+
+    report << L"sort-files: " << files.size() << L" files, " << context.Iterations << L" iterations" << std::endl;
+    report << L"  parse in comparator: " << baselineMicroseconds / context.Iterations << L" us" << std::endl;
+    report << L"  SortFilesInScene:    " << sortMicroseconds / context.Iterations << L" us" << std::endl;
+    report << L"  speedup:             " << baselineMicroseconds / sortMicroseconds << L"x" << std::endl;
+    return S_OK;
+}
+
+// Copy of a series folder that is removed with the object
+class TemporarySeriesFolder
+{
+public:
+    ~TemporarySeriesFolder()
+    {
+        if (!m_folder.empty())
+        {
+            std::error_code error;
+            fs::remove_all(m_folder, error);
+        }
+    }
+
+    HRESULT Create(const std::wstring& inputFolder)
+    {
+        std::vector<std::wstring> fileNames;
+        RETURN_IF_FAILED(GetSliceFileNames(inputFolder, &fileNames));
+
+        std::error_code error;
+        std::random_device random;
+        auto folder = fs::temp_directory_path(error) / (L"dcp-benchmark-" + std::to_wstring(random()));
+        RETURN_HR_IF(E_FAIL, static_cast<bool>(error));
+        RETURN_HR_IF_FALSE(E_FAIL, fs::create_directory(folder, error));
+        m_folder = folder.wstring();
+
+        for (auto& fileName : fileNames)
+        {
+            fs::copy_file(fileName, folder / fs::path(fileName).filename(), error);
+            RETURN_HR_IF(E_FAIL, static_cast<bool>(error));
+        }
+        return S_OK;
+    }
+
+    const std::wstring& GetFolder() const
+    {
+        return m_folder;
+    }
+
+private:
+    std::wstring m_folder;
+};
+
+inline HRESULT LoadSeriesIndex(const BenchmarkContext& context, std::wostream& report)
+{
+    RETURN_HR_IF(E_INVALIDARG, context.InputFolder.empty());
+
+    // The sidecar is removed every iteration, which must not happen to the
+    // user's series
+    TemporarySeriesFolder series;
+    RETURN_IF_FAILED(series.Create(context.InputFolder));
+    auto indexPath = SeriesIndexFile::GetIndexPath(series.GetFolder());
+
+    double parseMicroseconds = 0;
+    double indexMicroseconds = 0;
+    unsigned nFiles = 0;
+    for (unsigned i = 0; i < context.Iterations; i++)
+    {
+        // Without a sidecar every header is parsed, and the sidecar is written
+        std::error_code error;
+        fs::remove(indexPath, error);
+
+        Stopwatch parse;
+        SeriesIndex parsedSeries;
+        RETURN_IF_FAILED(parsedSeries.Load(series.GetFolder()));
+        parseMicroseconds += parse.GetElapsedMicroseconds();
+
+        Stopwatch index;
+        SeriesIndex indexedSeries;
+        RETURN_IF_FAILED(indexedSeries.Load(series.GetFolder()));
+        indexMicroseconds += index.GetElapsedMicroseconds();
+
+        nFiles = parsedSeries.GetCount();
+        RETURN_HR_IF(E_FAIL, indexedSeries.GetCount() != nFiles);
+        for (unsigned j = 0; j < nFiles; j++)
+        {
+            RETURN_HR_IF(
+                E_FAIL,
+                parsedSeries.GetMetadataFile(j)->SafeGetFilename() != indexedSeries.GetMetadataFile(j)->SafeGetFilename());
+        }
+    }
+
+    std::error_code error;
+    fs::remove(indexPath, error);
+
+    report << L"series-index: " << nFiles << L" files, " << context.Iterations << L" iterations" << std::endl;
+    report << L"  parse headers: " << parseMicroseconds / context.Iterations << L" us" << std::endl;
+    report << L"  fresh sidecar: " << indexMicroseconds / context.Iterations << L" us" << std::endl;
+    report << L"  speedup:       " << parseMicroseconds / indexMicroseconds << L"x" << std::endl;
+    return S_OK;
+}
+
+// The queue as it was before the lock-free rings, for comparison
+class LockedQueue
+{
+public:
+    LockedQueue(unsigned size) : m_queue(size + 1) {}
+
+    HRESULT Enqueue(uint64_t&& value)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_full.wait(lock, [&]() { return m_readPos != (m_writePos + 1) % m_queue.size(); });
+        m_queue[m_writePos] = value;
+        m_writePos = (m_writePos + 1) % m_queue.size();
+        m_empty.notify_all();
+        return S_OK;
+    }
+
+    HRESULT DequeueBatch(uint64_t* pValues, unsigned, unsigned* pCount)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_empty.wait(lock, [&]() { return m_readPos != m_writePos || m_isFinalized; });
+        if (m_readPos == m_writePos)
+        {
+            *pCount = 0;
+            return S_FALSE;
+        }
+        *pValues = m_queue[m_readPos];
+        m_readPos = (m_readPos + 1) % m_queue.size();
+        m_full.notify_all();
+        *pCount = 1;
+        return S_OK;
+    }
+
+    HRESULT Finish()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_isFinalized = true;
+        m_empty.notify_all();
+        return S_OK;
+    }
+
+private:
+    std::vector<uint64_t> m_queue;
+    size_t m_readPos = 0;
+    size_t m_writePos = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_empty;
+    std::condition_variable m_full;
+    bool m_isFinalized = false;
+};
+
+// Returns the items per second moved through the queue by nProducers threads
+// enqueueing and nConsumers threads dequeueing up to batchSize items at a time
+template <typename TQueue>
+HRESULT MeasureQueue(unsigned nProducers, unsigned nConsumers, unsigned batchSize, uint64_t nItems, double* pItemsPerSecond)
+{
+    TQueue queue(128);
+    std::atomic<uint64_t> sum(0);
+    std::atomic<unsigned> nProducersLeft(nProducers);
+
+    Stopwatch stopwatch;
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nProducers; i++)
+    {
+        threads.emplace_back(
+            [&, i]()
+            {
+                for (uint64_t value = i; value < nItems; value += nProducers)
+                {
+                    auto item = value;
+                    FAIL_FAST_IF_FAILED(queue.Enqueue(std::move(item)));
+                }
+                if (--nProducersLeft == 0)
+                {
+                    queue.Finish();
+                }
+            });
+    }
+    for (unsigned i = 0; i < nConsumers; i++)
+    {
+        threads.emplace_back(
+            [&]()
+            {
+                std::vector<uint64_t> batch(batchSize);
+                uint64_t consumerSum = 0;
+                unsigned count;
+                while (queue.DequeueBatch(batch.data(), batchSize, &count) == S_OK)
+                {
+                    for (unsigned j = 0; j < count; j++)
+                    {
+                        consumerSum += batch[j];
+                    }
+                }
+                sum += consumerSum;
+            });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    *pItemsPerSecond = nItems / (stopwatch.GetElapsedMicroseconds() / 1000000.);
+    RETURN_HR_IF(E_FAIL, sum != nItems * (nItems - 1) / 2);
+    return S_OK;
+}
+
+inline HRESULT Queue(const BenchmarkContext& context, std::wostream& report)
+{
+    using Spsc = Concurrency::ConcurrentQueue<uint64_t, Concurrency::QueueConcurrency::SingleProducerSingleConsumer>;
+    using Mpmc = Concurrency::ConcurrentQueue<uint64_t, Concurrency::QueueConcurrency::MultiProducerMultiConsumer>;
+
+    static const struct
+    {
+        const wchar_t* Name;
+        HRESULT (*Measure)(unsigned, unsigned, unsigned, uint64_t, double*);
+        unsigned Producers;
+        unsigned Consumers;
+        unsigned BatchSize;
+    } Configurations[] =
+    {
+
+    { L"locked  1x1        ", MeasureQueue<LockedQueue>, 1, 1, 1 },
+    { L"spsc    1x1        ", MeasureQueue<Spsc>,        1, 1, 1 },
+    { L"spsc    1x1 batch  ", MeasureQueue<Spsc>,        1, 1, 32 },
+    { L"locked  4x4        ", MeasureQueue<LockedQueue>, 4, 4, 1 },
+    { L"mpmc    1x1        ", MeasureQueue<Mpmc>,        1, 1, 1 },
+    { L"mpmc    4x4        ", MeasureQueue<Mpmc>,        4, 4, 1 },
+    { L"mpmc    4x4 batch  ", MeasureQueue<Mpmc>,        4, 4, 32 }
+
+    };
+
+    const uint64_t nItems = 1 << 20;
+    report << L"queue: " << nItems << L" items, " << context.Iterations << L" iterations, producers x consumers" << std::endl;
+    for (auto& configuration : Configurations)
+    {
+        double itemsPerSecond = 0;
+        for (unsigned i = 0; i < context.Iterations; i++)
+        {
+            double iterationItemsPerSecond;
+            RETURN_IF_FAILED(
+                configuration.Measure(
+                    configuration.Producers, configuration.Consumers, configuration.BatchSize, nItems, &iterationItemsPerSecond));
+            itemsPerSecond += iterationItemsPerSecond;
+        }
+        report << L"  " << configuration.Name << static_cast<uint64_t>(itemsPerSecond / context.Iterations) << L" items/s" << std::endl;
+    }
+    return S_OK;
+}
+
+// Dispatch as it was before the task pool: every call starts its own threads
+template <typename TBody>
+void ParallelForOnNewThreads(uint64_t nItems, uint64_t minChunkSize, TBody&& body)
+{
+    const uint64_t nCores = (std::max)(1u, std::thread::hardware_concurrency());
+    uint64_t nChunks = (std::min<uint64_t>)(nCores * 4, (nItems + minChunkSize - 1) / minChunkSize);
+    uint64_t chunkSize = (nItems + nChunks - 1) / nChunks;
+    unsigned nThreads = static_cast<unsigned>((std::min<uint64_t>)(nCores, nChunks));
+
+    std::atomic<uint64_t> nextChunk { 0 };
+    auto worker = [&]()
+    {
+        for (auto chunk = nextChunk++; chunk < nChunks; chunk = nextChunk++)
+        {
+            auto begin = chunk * chunkSize;
+            body(begin, (std::min)(nItems, begin + chunkSize));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < nThreads; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// Small kernels dispatched back to back, the way the voxelize operations run
+// one dispatch per slice
+inline HRESULT Dispatch(const BenchmarkContext& context, std::wostream& report)
+{
+    const uint64_t nItems = 1 << 16;
+    const unsigned nDispatches = 256;
+    std::vector<float> input(nItems, 1.f);
+    std::vector<float> output(nItems, 0.f);
+    auto kernel = [&](uint64_t begin, uint64_t end)
+    {
+        for (auto i = begin; i < end; i++)
+        {
+            output[i] += input[i];
+        }
+    };
+
+    double threadsMicroseconds = 0;
+    double poolMicroseconds = 0;
+    for (unsigned i = 0; i < context.Iterations; i++)
+    {
+        Stopwatch threadsStopwatch;
+        for (unsigned j = 0; j < nDispatches; j++)
+        {
+            ParallelForOnNewThreads(nItems, 1024, kernel);
+        }
+        threadsMicroseconds += threadsStopwatch.GetElapsedMicroseconds();
+
+        Stopwatch poolStopwatch;
+        for (unsigned j = 0; j < nDispatches; j++)
+        {
+            Concurrency::ParallelFor(0, nItems, 1024, kernel);
+        }
+        poolMicroseconds += poolStopwatch.GetElapsedMicroseconds();
+    }
+
+    RETURN_HR_IF(E_FAIL, output[0] != 2.f * nDispatches * context.Iterations);
+
+    report << L"dispatch: " << nDispatches << L" dispatches of " << nItems << L" items, "
+        << Concurrency::TaskPool::GetDefault().GetThreadCount() << L" pool threads, "
+        << context.Iterations << L" iterations" << std::endl;
+    report << L"  threads per dispatch: " << threadsMicroseconds / context.Iterations << L" us" << std::endl;
+    report << L"  task pool:            " << poolMicroseconds / context.Iterations << L" us" << std::endl;
+    return S_OK;
+}
+
+} // Benchmarks
+
+template <> struct Operation<OperationType::Benchmark>
+{
+    std::wstring m_name;
+    BenchmarkContext m_context;
+    std::wstring m_outputFile;
+
+    Operation(
+        std::wstring name,
+        std::wstring inputFolder,
+        unsigned iterations,
+        std::wstring outputFile) :
+            m_name(name),
+            m_context { inputFolder, iterations },
+            m_outputFile(outputFile)
+    {}
+
+    HRESULT Run(Application::Infrastructure::DeviceResources& resources)
+    {
+        UNREFERENCED_PARAMETER(resources);
+
+        static const struct
+        {
+            const wchar_t* Name;
+            HRESULT (*Run)(const BenchmarkContext& context, std::wostream& report);
+        } BenchmarkList[] =
+        {
+
+        { L"dispatch",      Benchmarks::Dispatch },
+        { L"queue",         Benchmarks::Queue },
+        { L"series-index",  Benchmarks::LoadSeriesIndex },
+        { L"sort-files",    Benchmarks::SortFiles }
+
+        };
+
+        RETURN_HR_IF(E_INVALIDARG, m_context.Iterations == 0);
+
+        auto foundIt =
+            std::find_if(
+                std::begin(BenchmarkList),
+                std::end(BenchmarkList),
+                [this](const auto& benchmark)
+                {
+                    return _wcsicmp(benchmark.Name, m_name.c_str()) == 0;
+                }
+            );
+        RETURN_HR_IF(E_INVALIDARG, foundIt == std::end(BenchmarkList));
+
+        std::wostringstream report;
+        RETURN_IF_FAILED(foundIt->Run(m_context, report));
+        wprintf(L"%ls", report.str().c_str());
+
+        std::wofstream stream(ToNativePath(m_outputFile), std::ios_base::out | std::ios_base::trunc);
+        stream << report.str();
+        stream.flush();
+        return S_OK;
+    }
+};
+
+template <> void inline LogOperation<OperationType::Benchmark>() { Log(L"[OperationType::Benchmark]"); }
+
+} // Operations
+} // DCM
@@ -0,0 +1,311 @@
+#pragma once
+
+namespace DCM
+{
+namespace Operations
+{
+
+enum class Colormap
+{
+    // Blue through green to red, the map Shaders\normalize_image.hlsl used
+    Hue,
+    Gray,
+    // Black through red and yellow to white
+    Hot
+};
+
+inline HRESULT ParseColormap(const std::wstring& name, Colormap* pColormap)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pColormap);
+
+    if (_wcsicmp(name.c_str(), L"hue") == 0)
+    {
+        *pColormap = Colormap::Hue;
+        return S_OK;
+    }
+    if (_wcsicmp(name.c_str(), L"gray") == 0)
+    {
+        *pColormap = Colormap::Gray;
+        return S_OK;
+    }
+    if (_wcsicmp(name.c_str(), L"hot") == 0)
+    {
+        *pColormap = Colormap::Hot;
+        return S_OK;
+    }
+    return E_INVALIDARG;
+}
+
+/// <summary>
+/// Colors of a colormap sampled at Size evenly spaced values over [0, 1]. Each
+/// entry is a finished GUID_WICPixelFormat64bppRGBA pixel, so a value only has
+/// to be scaled to an index and looked up.
+/// </summary>
+class ColormapTable
+{
+public:
+    static const unsigned Size = 4096;
+
+    // Built on first use, once per colormap
+    static const ColormapTable& Get(Colormap colormap)
+    {
+        static const ColormapTable tables[] =
+        {
+            ColormapTable(Colormap::Hue),
+            ColormapTable(Colormap::Gray),
+            ColormapTable(Colormap::Hot)
+        };
+        return tables[static_cast<unsigned>(colormap)];
+    }
+
+    const uint64_t* GetEntries() const
+    {
+        return m_entries.data();
+    }
+
+private:
+    explicit ColormapTable(Colormap colormap) :
+        m_entries(Size)
+    {
+        for (unsigned i = 0; i < Size; i++)
+        {
+            float rgb[3];
+            GetColor(colormap, static_cast<float>(i) / (Size - 1), rgb);
+
+            const uint64_t USHRT_MAX_VALUE = 0xFFFF;
+            m_entries[i] =
+                static_cast<uint64_t>(rgb[0] * USHRT_MAX_VALUE) |
+                static_cast<uint64_t>(rgb[1] * USHRT_MAX_VALUE) << 16 |
+                static_cast<uint64_t>(rgb[2] * USHRT_MAX_VALUE) << 32 |
+                USHRT_MAX_VALUE << 48;
+        }
+    }
+
+    static void GetColor(Colormap colormap, float normalizedValue, float rgb[3])
+    {
+        auto saturate = [](float value) { return (std::min)((std::max)(value, 0.f), 1.f); };
+
+        switch (colormap)
+        {
+        case Colormap::Hue:
+        {
+            float hue = (std::max)((-normalizedValue * .6666f / .6f) + .6666f, 0.f);
+
+            // HSVtoRGB with full saturation and value
+            const float K[4] = { 1.f, 2.f / 3.f, 1.f / 3.f, 3.f };
+            for (unsigned i = 0; i < 3; i++)
+            {
+                float shifted = hue + K[i];
+                float p = fabsf((shifted - floorf(shifted)) * 6.f - K[3]);
+                rgb[i] = saturate(p - K[0]);
+            }
+            break;
+        }
+        case Colormap::Gray:
+            rgb[0] = rgb[1] = rgb[2] = normalizedValue;
+            break;
+        case Colormap::Hot:
+            rgb[0] = saturate(normalizedValue * 3.f);
+            rgb[1] = saturate(normalizedValue * 3.f - 1.f);
+            rgb[2] = saturate(normalizedValue * 3.f - 2.f);
+            break;
+        }
+    }
+
+    std::vector<uint64_t> m_entries;
+};
+
+namespace Details
+{
+
+inline void GetRangeScalar(const float* pValues, size_t count, float* pMinimum, float* pMaximum)
+{
+    auto minimum = *pMinimum;
+    auto maximum = *pMaximum;
+    for (size_t i = 0; i < count; i++)
+    {
+        // NaN fails both comparisons and is skipped
+        minimum = pValues[i] < minimum ? pValues[i] : minimum;
+        maximum = pValues[i] > maximum ? pValues[i] : maximum;
+    }
+    *pMinimum = minimum;
+    *pMaximum = maximum;
+}
+
+#ifdef DCP_X86_SIMD
+
+inline void GetRangeSse2(const float* pValues, size_t count, float* pMinimum, float* pMaximum)
+{
+    __m128 minimum = _mm_set1_ps(*pMinimum);
+    __m128 maximum = _mm_set1_ps(*pMaximum);
+
+    // minps and maxps return their second operand when either one is NaN, so
+    // the values go first and NaN is skipped as in the scalar loop
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 values[2] = { _mm_loadu_ps(pValues + i), _mm_loadu_ps(pValues + i + 4) };
+        minimum = _mm_min_ps(values[0], _mm_min_ps(values[1], minimum));
+        maximum = _mm_max_ps(values[0], _mm_max_ps(values[1], maximum));
+    }
+
+    float minimums[4], maximums[4];
+    _mm_storeu_ps(minimums, minimum);
+    _mm_storeu_ps(maximums, maximum);
+    GetRangeScalar(minimums, 4, pMinimum, pMaximum);
+    GetRangeScalar(maximums, 4, pMinimum, pMaximum);
+    GetRangeScalar(pValues + i, count - i, pMinimum, pMaximum);
+}
+
+#endif // DCP_X86_SIMD
+
+// Index of value in a table of ColormapTable::Size entries spread over the
+// range, values outside of it and NaN take the first or last entry
+inline unsigned GetColormapIndex(float value, float minimum, float scale)
+{
+    const float last = ColormapTable::Size - 1.f;
+    float position = (value - minimum) * scale + .5f;
+    position = position > 0.f ? position : 0.f;
+    position = position < last ? position : last;
+    return static_cast<unsigned>(position);
+}
+
+inline void ApplyColormapScalar(const float* pValues, size_t count, float minimum, float scale, const uint64_t* pTable, uint64_t* pPixels)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        pPixels[i] = pTable[GetColormapIndex(pValues[i], minimum, scale)];
+    }
+}
+
+#ifdef DCP_X86_SIMD
+
+DCP_TARGET("avx2")
+inline void ApplyColormapAvx2(const float* pValues, size_t count, float minimum, float scale, const uint64_t* pTable, uint64_t* pPixels)
+{
+    // Same arithmetic as GetColormapIndex, so both paths pick the same entries
+    const __m256 minimums = _mm256_set1_ps(minimum);
+    const __m256 scales = _mm256_set1_ps(scale);
+    const __m256 halves = _mm256_set1_ps(.5f);
+    const __m256 zeros = _mm256_setzero_ps();
+    const __m256 lasts = _mm256_set1_ps(ColormapTable::Size - 1.f);
+    auto pEntries = reinterpret_cast<const long long*>(pTable);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 position = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(pValues + i), minimums), scales), halves);
+        position = _mm256_min_ps(_mm256_max_ps(position, zeros), lasts);
+        __m256i indices = _mm256_cvttps_epi32(position);
+
+        auto pOut = reinterpret_cast<__m256i*>(pPixels + i);
+        _mm256_storeu_si256(pOut, _mm256_i32gather_epi64(pEntries, _mm256_castsi256_si128(indices), 8));
+        _mm256_storeu_si256(pOut + 1, _mm256_i32gather_epi64(pEntries, _mm256_extracti128_si256(indices, 1), 8));
+    }
+
+    ApplyColormapScalar(pValues + i, count - i, minimum, scale, pTable, pPixels + i);
+}
+
+#endif // DCP_X86_SIMD
+
+} // Details
+
+/// <summary>
+/// Smallest and largest value of the buffer in one parallel pass. NaN values
+/// are skipped, and a buffer without any other value gives an empty range with
+/// the minimum above the maximum.
+/// </summary>
+inline void GetRange(const float* pValues, size_t count, float* pMinimum, float* pMaximum)
+{
+    std::mutex mutex;
+    *pMinimum = std::numeric_limits<float>::infinity();
+    *pMaximum = -std::numeric_limits<float>::infinity();
+
+    Concurrency::ParallelFor(0, count, 64 * 1024,
+        [&](uint64_t begin, uint64_t end)
+        {
+            float minimum = std::numeric_limits<float>::infinity();
+            float maximum = -std::numeric_limits<float>::infinity();
+#ifdef DCP_X86_SIMD
+            Details::GetRangeSse2(pValues + begin, end - begin, &minimum, &maximum);
+#else
+            Details::GetRangeScalar(pValues + begin, end - begin, &minimum, &maximum);
+#endif
+
+            std::lock_guard<std::mutex> lock(mutex);
+            *pMinimum = (std::min)(*pMinimum, minimum);
+            *pMaximum = (std::max)(*pMaximum, maximum);
+        });
+}
+
+/// <summary>
+/// Range between the given percentiles of the values, with NaN left out as in
+/// GetRange. The ranks are found with nth_element on a copy, which takes linear
+/// time and, unlike a histogram over [min, max], is not thrown off by a single
+/// extreme outlier.
+/// </summary>
+inline void GetPercentileRange(
+    const float* pValues,
+    size_t count,
+    float lowPercentile,
+    float highPercentile,
+    float* pMinimum,
+    float* pMaximum)
+{
+    std::vector<float> values;
+    values.reserve(count);
+    std::copy_if(pValues, pValues + count, std::back_inserter(values), [](float value) { return value == value; });
+    if (values.empty())
+    {
+        *pMinimum = std::numeric_limits<float>::infinity();
+        *pMaximum = -std::numeric_limits<float>::infinity();
+        return;
+    }
+
+    auto last = values.size() - 1;
+    auto lowRank = static_cast<size_t>(lowPercentile / 100. * last);
+    auto highRank = static_cast<size_t>(std::ceil(highPercentile / 100. * last));
+
+    std::nth_element(std::begin(values), std::begin(values) + highRank, std::end(values));
+    *pMaximum = values[highRank];
+
+    // Everything below highRank is now in front of it
+    std::nth_element(std::begin(values), std::begin(values) + lowRank, std::begin(values) + highRank);
+    *pMinimum = values[lowRank];
+}
+
+/// <summary>
+/// Maps every value to its color through the table of the colormap, with the
+/// minimum at the first entry and the maximum at the last. The lookups are
+/// AVX2 gathers where the processor has them.
+/// </summary>
+inline void ApplyColormap(
+    const float* pValues,
+    size_t count,
+    float minimum,
+    float maximum,
+    Colormap colormap,
+    uint64_t* pPixels)
+{
+    auto pTable = ColormapTable::Get(colormap).GetEntries();
+    auto scale = maximum > minimum ? (ColormapTable::Size - 1) / (maximum - minimum) : 0.f;
+
+    auto applyColormap = &Details::ApplyColormapScalar;
+#ifdef DCP_X86_SIMD
+    auto instructionSet = Application::Infrastructure::GetInstructionSet();
+    if (instructionSet == Application::Infrastructure::InstructionSet::Avx2 ||
+        instructionSet == Application::Infrastructure::InstructionSet::Avx512)
+    {
+        applyColormap = &Details::ApplyColormapAvx2;
+    }
+#endif
+
+    Concurrency::ParallelFor(0, count, 64 * 1024,
+        [&](uint64_t begin, uint64_t end)
+        {
+            applyColormap(pValues + begin, end - begin, minimum, scale, pTable, pPixels + begin);
+        });
+}
+
+} // Operations
+} // DCM
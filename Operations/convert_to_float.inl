@@ -40,8 +40,8 @@ public:
         Microsoft::WRL::ComPtr<ID3D11Buffer> spBuffer;
         FAIL_FAST_IF_FAILED(resources.CreateStructuredBuffer(
             sizeof(short) * 2 /* size of item */,
-            static_cast<unsigned>(data->size() / 4) /* num items */,
-            &data->at(0) /* data */,
+            static_cast<unsigned>(data.size() / 4) /* num items */,
+            data.data() /* data */,
             &spBuffer));
 
         Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> spShaderResourceView;
@@ -75,7 +75,7 @@ public:
 
         // Create the shader
         Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
-        RETURN_IF_FAILED(CreateShader(resources, L"Shaders\\convert_to_float.hlsl", &spComputeShader));
+        RETURN_IF_FAILED(resources.CreateKernel(L"convert_to_float", &spComputeShader));
 
         resources.RunComputeShader(spComputeShader.Get(), spAddConstantBuffer.Get(),
             1, &sharedResourceViews.at(0), uavs, m_rows, m_columns, 1);
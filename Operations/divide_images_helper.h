@@ -14,7 +14,7 @@ inline HRESULT DivideImages(
 {
     // Create the shader
     Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
-    RETURN_IF_FAILED(resources.CreateComputeShader(L"Shaders\\divide_images.hlsl", "CSMain", &spComputeShader));
+    RETURN_IF_FAILED(resources.CreateKernel(L"divide_images", &spComputeShader));
 
     struct {
         float Factor;
@@ -28,12 +28,14 @@ inline HRESULT DivideImages(
     Microsoft::WRL::ComPtr<ID3D11Buffer> spDividendBuffer;
     unsigned dividendWidth;
     unsigned dividendHeight;
+    VolumeDescription volume;
     {
         unsigned dividendChannels;
         std::vector<float> data;
         RETURN_IF_FAILED(GetBufferFromGrayscaleImage(resources, dividendFile.c_str(), &data, &dividendWidth, &dividendHeight, &dividendChannels));
 
         RETURN_HR_IF_FALSE(E_FAIL, dividendChannels == 1);
+        RETURN_IF_FAILED(GetImageDescription(dividendFile, dividendWidth, dividendHeight, dividendChannels, &volume));
 
         // Create dividend input buffer
         RETURN_IF_FAILED(resources.CreateStructuredBuffer(
@@ -95,9 +97,7 @@ inline HRESULT DivideImages(
         SaveToFile(
             resources,
             spOutBuffer.Get(),
-            dividendWidth,
-            dividendHeight,
-            sizeof(float),
+            volume,
             m_outputFile.c_str()));
 
     return S_OK;
@@ -131,5 +131,32 @@ inline HRESULT GetVoxelDimensions(
     return S_OK;
 }
 
+// The volume that a voxelize operation writes, oriented like the slices
+inline HRESULT GetVoxelVolumeDescription(
+    std::shared_ptr<DicomFile> spFile,
+    unsigned short voxelImageColumns,
+    unsigned short voxelImageRows,
+    unsigned short voxelImageDepth,
+    double voxelWidthInMillimeters,
+    double voxelHeightInMillimeters,
+    double voxelDepthInMillimeters,
+    VolumeDescription* pDescription)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pDescription);
+
+    SliceGeometry geometry;
+    RETURN_IF_FAILED(GetSliceGeometry(spFile, &geometry));
+
+    *pDescription = VolumeDescription();
+    pDescription->Width = voxelImageColumns;
+    pDescription->Height = voxelImageRows;
+    pDescription->Depth = voxelImageDepth;
+    pDescription->Spacing[0] = static_cast<float>(voxelWidthInMillimeters);
+    pDescription->Spacing[1] = static_cast<float>(voxelHeightInMillimeters);
+    pDescription->Spacing[2] = static_cast<float>(voxelDepthInMillimeters);
+    memcpy(pDescription->Orientation, geometry.Orientation, sizeof(geometry.Orientation));
+    return S_OK;
+}
+
 } // Operations
 } // DCM
@@ -17,6 +17,8 @@ template <> struct Operation<OperationType::GFactorSSIM>
     unsigned m_xROI;
     unsigned m_yROI;
     unsigned m_zROI;
+
+    // Slices in the mosaic of the inputs, or 0 to take it from their header
     unsigned m_depth;
 
     Operation(
@@ -34,101 +36,106 @@ template <> struct Operation<OperationType::GFactorSSIM>
             m_zROI(zROI),
             m_depth(depth),
             m_outputFile(outputFile)
-    {
-        FAIL_FAST_IF_FALSE(m_xROI == 2);
-        FAIL_FAST_IF_FALSE(m_yROI == 2);
-        FAIL_FAST_IF_FALSE(m_zROI == 2);
-    }
+    {}
 
-    unsigned GetIndexForImagePos(
-        unsigned width, unsigned depth,
-        unsigned x, unsigned y, unsigned z)
+    // Sums of x, y, x^2, y^2 and x*y
+    struct Moments
     {
-        return (width * depth * y) + (z * width) + x;
-    }
+        double X;
+        double Y;
+        double XX;
+        double YY;
+        double XY;
 
-    double ComputeMeanForSSIM(
-        float* data, unsigned width, unsigned depth,
-        unsigned x, unsigned y, unsigned z)
-    {
-        double sum =
-            data[GetIndexForImagePos(width, depth, x, y, z)] +
-            data[GetIndexForImagePos(width, depth, x, y + 1, z)] +
-            data[GetIndexForImagePos(width, depth, x + 1, y, z)] +
-            data[GetIndexForImagePos(width, depth, x + 1, y + 1, z)] +
-            data[GetIndexForImagePos(width, depth, x, y, z + 1)] +
-            data[GetIndexForImagePos(width, depth, x, y + 1, z + 1)] +
-            data[GetIndexForImagePos(width, depth, x + 1, y, z + 1)] +
-            data[GetIndexForImagePos(width, depth, x + 1, y + 1, z + 1)];
-        return sum / 8;
-    }
+        Moments& operator+=(const Moments& other)
+        {
+            X += other.X; Y += other.Y; XX += other.XX; YY += other.YY; XY += other.XY;
+            return *this;
+        }
+    };
 
-    double ComputeVarianceForSSIM(
-        float* data, double mean, unsigned width, unsigned depth,
-        unsigned x, unsigned y, unsigned z)
+    static Moments GetMoments(float xValue, float yValue)
     {
-        double sum =
-            pow(mean - data[GetIndexForImagePos(width, depth, x, y, z)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x, y + 1, z)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x + 1, y, z)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x + 1, y + 1, z)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x, y, z + 1)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x, y + 1, z + 1)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x + 1, y, z + 1)], 2) +
-            pow(mean - data[GetIndexForImagePos(width, depth, x + 1, y + 1, z + 1)], 2);
-        return sum / 8;
+        return Moments
+        {
+            xValue,
+            yValue,
+            static_cast<double>(xValue) * xValue,
+            static_cast<double>(yValue) * yValue,
+            static_cast<double>(xValue) * yValue
+        };
     }
 
-    double ProcessVoxelCovariance(
-        float* xData,
-        float* yData,
-        double ux,
-        double uy,
-        unsigned width, unsigned depth,
-        unsigned xindex, unsigned yindex, unsigned zindex,
-        unsigned xsize, unsigned ysize, unsigned zsize)
+    /// <summary>
+    /// Reads one of the inputs. A .dd volume is used in place in its mapping,
+    /// any other image is decompressed or decoded into pBuffer.
+    /// </summary>
+    static HRESULT ReadInput(
+        Application::Infrastructure::DeviceResources& resources,
+        const std::wstring& fileName,
+        VolumeFile* pVolumeFile,
+        std::vector<float>* pBuffer,
+        const float** ppData,
+        VolumeDescription* pDescription)
     {
-        double covariance = 0;
+        if (IsVolumeFile(fileName))
+        {
+            RETURN_IF_FAILED(pVolumeFile->Open(fileName));
+            RETURN_IF_FAILED(pVolumeFile->GetData(ppData));
+            *pDescription = pVolumeFile->GetDescription();
+        }
+        else
+        {
+            unsigned width, height, channels;
+            RETURN_IF_FAILED(GetBufferFromGrayscaleImage(
+                resources, fileName.c_str(), pBuffer, &width, &height, &channels));
+            RETURN_IF_FAILED(GetImageDescription(fileName, width, height, channels, pDescription));
+            *ppData = pBuffer->data();
+        }
 
-        for (unsigned x1 = 0; x1 < xsize; x1++)
-            for (unsigned y1 = 0; y1 < ysize; y1++)
-                for (unsigned z1 = 0; z1 < zsize; z1++)
-                {
-                    covariance +=
-                        (xData[GetIndexForImagePos(width, depth, xindex + x1, yindex + y1, zindex + z1)] - ux) *
-                        (yData[GetIndexForImagePos(width, depth, xindex + x1, yindex + y1, zindex + z1)] - uy);
-                }
-        covariance /= ((xsize * ysize * zsize)-1);
-        return covariance;
+        RETURN_HR_IF_FALSE(E_FAIL, pDescription->Channels == 1);
+        return S_OK;
     }
 
     HRESULT Run(Application::Infrastructure::DeviceResources& resources)
     {
-        std::vector<float> xData;
-        unsigned xWidth, xHeight, xChannels;
-        RETURN_IF_FAILED(GetBufferFromGrayscaleImage(
-            resources, m_xFile.c_str(), &xData, &xWidth, &xHeight, &xChannels));
-        Microsoft::WRL::ComPtr<IWICBitmapSource> spYFileSource;
-
-        std::vector<float> yData;
-        unsigned yWidth, yHeight, yChannels;
-        RETURN_IF_FAILED(GetBufferFromGrayscaleImage(
-            resources, m_yFile.c_str(), &yData, &yWidth, &yHeight, &yChannels));
+        VolumeFile xFile;
+        std::vector<float> xBuffer;
+        const float* xData;
+        VolumeDescription volume;
+        RETURN_IF_FAILED(ReadInput(resources, m_xFile, &xFile, &xBuffer, &xData, &volume));
+
+        VolumeFile yFile;
+        std::vector<float> yBuffer;
+        const float* yData;
+        VolumeDescription yVolume;
+        RETURN_IF_FAILED(ReadInput(resources, m_yFile, &yFile, &yBuffer, &yData, &yVolume));
+
+        RETURN_HR_IF_FALSE(E_FAIL, volume.GetMosaicWidth() == yVolume.GetMosaicWidth());
+        RETURN_HR_IF_FALSE(E_FAIL, volume.Height == yVolume.Height);
+
+        // A depth that is given splits up the mosaic, and has to agree with the
+        // header of a volume that has one
+        if (m_depth != 0)
+        {
+            RETURN_HR_IF(E_INVALIDARG, volume.Depth != 1 && volume.Depth != m_depth);
+            RETURN_HR_IF(E_INVALIDARG, volume.GetMosaicWidth() % m_depth != 0);
+            volume.Width = volume.GetMosaicWidth() / m_depth;
+            volume.Depth = m_depth;
+        }
 
-        RETURN_HR_IF_FALSE(E_FAIL, xWidth == yWidth);
-        RETURN_HR_IF_FALSE(E_FAIL, xHeight == yHeight);
-        RETURN_HR_IF_FALSE(E_FAIL, xChannels == yChannels);
+        unsigned width = volume.Width;
+        unsigned height = volume.Height;
+        unsigned depth = volume.Depth;
 
-        unsigned width = xWidth / m_depth;
-        unsigned height = yHeight;
-        unsigned depth = m_depth;
+        // The covariance is divided by one less than the size of the window
+        RETURN_HR_IF(E_INVALIDARG, m_xROI == 0 || m_yROI == 0 || m_zROI == 0);
+        RETURN_HR_IF(E_INVALIDARG, m_xROI > width || m_yROI > height || m_zROI > depth);
+        RETURN_HR_IF(E_INVALIDARG, static_cast<uint64_t>(m_xROI) * m_yROI * m_zROI < 2);
 
         unsigned ssimWidth = width - m_xROI + 1;
         unsigned ssimHeight = height - m_yROI + 1;
-        unsigned ssimDepth = m_depth - m_zROI + 1;
-
-        unsigned outputWidth = ssimWidth * ssimDepth;
-        unsigned outputHeight = ssimHeight;
+        unsigned ssimDepth = depth - m_zROI + 1;
 
         double k1 = .01;
         double k2 = .03;
@@ -138,41 +145,81 @@ template <> struct Operation<OperationType::GFactorSSIM>
         double c1 = k1 * k1*L*L;
         double c2 = k2 * k2*L*L;
 
-        std::vector<float> ssimImage(outputHeight*outputWidth);
-        for (unsigned z = 0; z < ssimDepth; z++)
-        {
-            for (unsigned x = 0; x < ssimWidth; x++)
+        const double n = static_cast<double>(m_xROI) * m_yROI * m_zROI;
+
+        // The window sums are separable, they are taken down the rows, then
+        // along depth, then along the columns. Every sum runs over the values
+        // of its window only, so its rounding does not depend on the rest of
+        // the volume and a constant window has no variance at all.
+        std::vector<float> ssimImage(static_cast<size_t>(ssimWidth) * ssimHeight * ssimDepth);
+        Concurrency::ParallelFor(0, ssimHeight, 1,
+            [&](uint64_t yBegin, uint64_t yEnd)
             {
-                for (unsigned y = 0; y < ssimHeight; y++)
+                std::vector<Moments> rowSums(static_cast<size_t>(width) * depth);
+                std::vector<Moments> depthSums(width);
+                for (auto y = yBegin; y < yEnd; y++)
                 {
-                    double ux = ComputeMeanForSSIM(xData.data(), width, depth, x, y, z);
-                    double sx = sqrt(ComputeVarianceForSSIM(xData.data(), ux, width, depth, x, y, z));
-
-                    double uy = ComputeMeanForSSIM(yData.data(), width, depth, x, y, z);
-                    double sy = sqrt(ComputeVarianceForSSIM(yData.data(), uy, width, depth, x, y, z));
-
-                    double xy_covariance = ProcessVoxelCovariance(
-                        xData.data(),
-                        yData.data(),
-                        ux, uy,
-                        width, depth,
-                        x, y, z,
-                        m_xROI, m_yROI, m_zROI);
-
-                    ssimImage[GetIndexForImagePos(ssimWidth, ssimDepth, x, y, z)] =
-                        ((2 * ux * uy) + c1) * (2 * xy_covariance + c2) /
-                        (((ux * ux) + (uy * uy) + c1) * (sx*sx + sy*sy + c2));
+                    // Sums over the m_yROI rows of the windows, laid out like a row
+                    for (uint64_t z = 0; z < depth; z++)
+                    {
+                        auto out = rowSums.data() + z * width;
+                        for (uint64_t x = 0; x < width; x++)
+                        {
+                            out[x] = Moments {};
+                        }
+                        for (uint64_t yWindow = y; yWindow < y + m_yROI; yWindow++)
+                        {
+                            auto in = (yWindow * depth + z) * width;
+                            for (uint64_t x = 0; x < width; x++)
+                            {
+                                out[x] += GetMoments(xData[in + x], yData[in + x]);
+                            }
+                        }
+                    }
+
+                    for (uint64_t z = 0; z < ssimDepth; z++)
+                    {
+                        for (uint64_t x = 0; x < width; x++)
+                        {
+                            depthSums[x] = Moments {};
+                        }
+                        for (uint64_t zWindow = z; zWindow < z + m_zROI; zWindow++)
+                        {
+                            auto in = rowSums.data() + zWindow * width;
+                            for (uint64_t x = 0; x < width; x++)
+                            {
+                                depthSums[x] += in[x];
+                            }
+                        }
+
+                        auto out = ssimImage.data() + (y * ssimDepth + z) * ssimWidth;
+                        for (uint64_t x = 0; x < ssimWidth; x++)
+                        {
+                            Moments sum {};
+                            for (uint64_t xWindow = x; xWindow < x + m_xROI; xWindow++)
+                            {
+                                sum += depthSums[xWindow];
+                            }
+
+                            double ux = sum.X / n;
+                            double uy = sum.Y / n;
+                            double xVariance = (std::max)(sum.XX - sum.X * ux, 0.) / n;
+                            double yVariance = (std::max)(sum.YY - sum.Y * uy, 0.) / n;
+                            double xy_covariance = (sum.XY - sum.X * uy) / (n - 1);
+
+                            out[x] = static_cast<float>(
+                                ((2 * ux * uy) + c1) * (2 * xy_covariance + c2) /
+                                (((ux * ux) + (uy * uy) + c1) * (xVariance + yVariance + c2)));
+                        }
+                    }
                 }
-            }
-        }
+            });
 
-        RETURN_IF_FAILED(
-            SaveToFile(
-                ssimImage.data(),
-                outputWidth,
-                outputHeight,
-                sizeof(float),
-                m_outputFile.c_str()));
+        // Placed like the inputs, one voxel per window
+        volume.Width = ssimWidth;
+        volume.Height = ssimHeight;
+        volume.Depth = ssimDepth;
+        RETURN_IF_FAILED(SaveToFile(ssimImage.data(), volume, m_outputFile.c_str()));
         return S_OK;
     }
 };
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <iomanip>
+#include <charconv>
 
 namespace DCM
 {
@@ -9,19 +9,33 @@ namespace Operations
 
 template <> struct Operation<OperationType::ImageToCsv> 
 {
+    // Values are written with the fewest digits that read back to the same float
+    static const int ShortestPrecision = -1;
+
+    // Rows are formatted in blocks of about this many values, one block per task
+    static const unsigned ValuesPerBlock = 64 * 1024;
+
     std::wstring m_inputFile;
     std::wstring m_outputFile;
 
+    // Digits after the decimal point, or ShortestPrecision
+    int m_precision;
+    bool m_isTabSeparated;
+
     Operation(
         std::wstring inputFile,
-        std::wstring outputFile) :
+        std::wstring outputFile,
+        int precision = ShortestPrecision,
+        bool isTabSeparated = false) :
             m_inputFile(inputFile),
-            m_outputFile(outputFile)
+            m_outputFile(outputFile),
+            m_precision(precision),
+            m_isTabSeparated(isTabSeparated)
     {}
 
     HRESULT Run(Application::Infrastructure::DeviceResources& resources)
     {
-        UNREFERENCED_PARAMETER(resources);
+        RETURN_HR_IF(E_INVALIDARG, m_precision < ShortestPrecision);
 
         std::vector<float> data;
         unsigned width;
@@ -39,24 +53,105 @@ template <> struct Operation<OperationType::ImageToCsv>
 
         RETURN_HR_IF_FALSE(E_FAIL, channels == 1);
 
-        std::ofstream stream(m_outputFile.c_str(), std::ios_base::out | std::ios_base::trunc);
-        for (unsigned row = 0; row < height; row++)
+        std::ofstream stream(ToNativePath(m_outputFile), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+        RETURN_HR_IF_FALSE(E_FAIL, stream.good());
+
+        // The blocks only depend on the width, and a wave of them is formatted
+        // in parallel then written in order, so the text is the same whatever
+        // the number of threads
+        unsigned rowsPerBlock = (std::max)(1u, ValuesPerBlock / (std::max)(width, 1u));
+        unsigned nBlocks = (height + rowsPerBlock - 1) / rowsPerBlock;
+        unsigned blocksPerWave = Concurrency::TaskPool::GetDefault().GetThreadCount() * 4;
+        std::vector<std::vector<char>> blocks(blocksPerWave);
+        std::atomic<bool> isFailed { false };
+
+        for (unsigned waveBegin = 0; waveBegin < nBlocks; waveBegin += blocksPerWave)
+        {
+            auto waveEnd = (std::min)(nBlocks, waveBegin + blocksPerWave);
+            Concurrency::ParallelFor(waveBegin, waveEnd, 1,
+                [&](uint64_t begin, uint64_t end)
+                {
+                    for (auto block = begin; block < end; block++)
+                    {
+                        auto rowBegin = static_cast<unsigned>(block) * rowsPerBlock;
+                        auto rowEnd = (std::min)(height, rowBegin + rowsPerBlock);
+                        if (FAILED(FormatRows(data.data(), width, rowBegin, rowEnd, &blocks[block - waveBegin])))
+                        {
+                            isFailed.store(true);
+                        }
+                    }
+                });
+            RETURN_HR_IF(E_FAIL, isFailed.load());
+
+            for (unsigned block = waveBegin; block < waveEnd; block++)
+            {
+                auto& text = blocks[block - waveBegin];
+                stream.write(text.data(), text.size());
+            }
+            RETURN_HR_IF_FALSE(E_FAIL, stream.good());
+        }
+
+        stream.flush();
+        RETURN_HR_IF_FALSE(E_FAIL, stream.good());
+
+        return S_OK;
+    }
+
+private:
+    HRESULT FormatRows(const float* pData, unsigned width, unsigned rowBegin, unsigned rowEnd, std::vector<char>* pText)
+    {
+        // Room for the longest value, 39 integer digits of FLT_MAX with a sign
+        // and the fraction, followed by the separator
+        const size_t MaxValueLength = 48 + (std::max)(m_precision, 0);
+        const char* pSeparator = m_isTabSeparated ? "\t" : ", ";
+        const size_t separatorLength = strlen(pSeparator);
+
+        auto& text = *pText;
+        text.resize(static_cast<size_t>(rowEnd - rowBegin) * width * MaxValueLength);
+        auto pPosition = text.data();
+        auto pEnd = text.data() + text.size();
+
+        for (unsigned row = rowBegin; row < rowEnd; row++)
         {
+            auto pRow = pData + static_cast<size_t>(row) * width;
             for (unsigned column = 0; column < width; column++)
             {
-                stream << std::setprecision(std::numeric_limits<long double>::digits10 + 1) << static_cast<double>(data[row * width + column]);
+                RETURN_IF_FAILED(FormatValue(pRow[column], &pPosition, pEnd));
+
                 if (column == width - 1)
                 {
-                    stream << "\n";
+                    *pPosition++ = '\n';
                 }
                 else
                 {
-                    stream << ", ";
+                    memcpy(pPosition, pSeparator, separatorLength);
+                    pPosition += separatorLength;
                 }
             }
         }
-        stream.flush();
 
+        text.resize(pPosition - text.data());
+        return S_OK;
+    }
+
+    HRESULT FormatValue(float value, char** ppPosition, char* pEnd) const
+    {
+#ifdef __cpp_lib_to_chars
+        auto result = m_precision == ShortestPrecision ?
+            std::to_chars(*ppPosition, pEnd, value) :
+            std::to_chars(*ppPosition, pEnd, value, std::chars_format::fixed, m_precision);
+        RETURN_HR_IF(E_FAIL, result.ec != std::errc());
+        *ppPosition = result.ptr;
+#else
+        // Standard libraries before floating point to_chars, such as the one of
+        // the v141 toolset, print 9 significant digits, which also read back to
+        // the same float but are not always the fewest
+        auto length = m_precision == ShortestPrecision ?
+            snprintf(*ppPosition, pEnd - *ppPosition, "%.9g", value) :
+            snprintf(*ppPosition, pEnd - *ppPosition, "%.*f", m_precision, value);
+        RETURN_HR_IF(E_FAIL, length < 0 || length >= pEnd - *ppPosition);
+        *ppPosition += length;
+#endif
         return S_OK;
     }
 };
@@ -34,16 +34,9 @@ namespace DCM
 
             HRESULT Run(Application::Infrastructure::DeviceResources& resources)
             {
-                UNREFERENCED_PARAMETER(resources);
-                wchar_t pwzFileName[MAX_PATH + 1];
-                RETURN_HR_IF(E_FAIL, 0 == GetModuleFileName(NULL, pwzFileName, MAX_PATH + 1));
-                std::wstring shaderPath(pwzFileName);
-                shaderPath.erase(shaderPath.begin() + shaderPath.find_last_of(L'\\') + 1, shaderPath.end());
-                shaderPath += L"Shaders\\multiply_images.hlsl";
-
                 // Create the shader
                 Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
-                RETURN_IF_FAILED(resources.CreateComputeShader(shaderPath.c_str(), "CSMain", &spComputeShader));
+                RETURN_IF_FAILED(resources.CreateKernel(L"multiply_images", &spComputeShader));
 
                 auto convertFile1Op = MakeOperation<OperationType::ConvertToFloat>(m_inputFile);
                 convertFile1Op->Run(resources);
@@ -17,30 +17,47 @@ private:
     float m_min;
     float m_max;
 
+    Colormap m_colormap;
+
+    // Percentiles of the values that the range is clipped to when it is not
+    // given, so that a few outliers do not wash out the rest of the image
+    float m_lowPercentile;
+    float m_highPercentile;
+
 public:
     Operation(
         const std::wstring& inputFile,
-        const std::wstring& outputFile) : 
+        const std::wstring& outputFile,
+        Colormap colormap = Colormap::Hue,
+        float lowPercentile = 0.f,
+        float highPercentile = 100.f) : 
             m_inputFile(inputFile),
             m_outputFile(outputFile),
             m_min(std::numeric_limits<float>::min()),
-            m_max(std::numeric_limits<float>::min())
+            m_max(std::numeric_limits<float>::min()),
+            m_colormap(colormap),
+            m_lowPercentile(lowPercentile),
+            m_highPercentile(highPercentile)
     {}
 
     Operation(
         const std::wstring& inputFile,
         const std::wstring& outputFile,
         float min,
-        float max) :
+        float max,
+        Colormap colormap = Colormap::Hue) :
         m_inputFile(inputFile),
         m_outputFile(outputFile),
         m_min(min),
-        m_max(max)
+        m_max(max),
+        m_colormap(colormap),
+        m_lowPercentile(0.f),
+        m_highPercentile(100.f)
     {}
 
     HRESULT Run(Application::Infrastructure::DeviceResources& resources)
     {
-        UNREFERENCED_PARAMETER(resources);
+        RETURN_HR_IF(E_INVALIDARG, m_lowPercentile < 0.f || m_lowPercentile >= m_highPercentile || m_highPercentile > 100.f);
 
         std::vector<float> data;
         unsigned width;
@@ -49,60 +66,31 @@ public:
         RETURN_IF_FAILED(GetBufferFromGrayscaleImage(resources, m_inputFile.c_str(), &data, &width, &height, &nChannels));
         RETURN_HR_IF_FALSE(E_FAIL, nChannels == 1);
 
-        auto min = 
-            (m_min == std::numeric_limits<float>::min()) ?
-                *std::min_element(std::begin(data), std::end(data)) : 
-                m_min;
-        auto max =
-            m_max == std::numeric_limits<float>::min() ? 
-                *std::max_element(std::begin(data), std::end(data)) :
-                m_max;
-
-        struct {
-            float minimum;
-            float maximum;
-            double unused;
-        } constantData =
+        auto min = m_min;
+        auto max = m_max;
+        if (m_min == std::numeric_limits<float>::min() ||
+            m_max == std::numeric_limits<float>::min())
         {
-            min,
-            max
-        };
-
-        Microsoft::WRL::ComPtr<ID3D11Buffer> spConstantBuffer;
-        RETURN_IF_FAILED(resources.CreateConstantBuffer(constantData, &spConstantBuffer));
-
-        Microsoft::WRL::ComPtr<ID3D11Buffer> spBuffer;
-        RETURN_IF_FAILED(resources.CreateStructuredBuffer(
-            sizeof(float) /* size of item */,
-            width * height * nChannels /* num items */,
-            &data.at(0),
-            &spBuffer));
-
-        Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> spShaderResourceView;
-        RETURN_IF_FAILED(resources.CreateStructuredBufferSRV(spBuffer.Get(), &spShaderResourceView));
-
-        std::vector<ID3D11ShaderResourceView*> sharedResourceViews = { spShaderResourceView.Get() };
-
-        Microsoft::WRL::ComPtr<ID3D11Buffer> spOutBuffer;
-        RETURN_IF_FAILED(
-            resources.CreateStructuredBuffer(
-                sizeof(unsigned short) * 4 /* size of item */,
-                width * height /* num items */,
-                nullptr,
-                &spOutBuffer));
-
-        Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spOutBufferUnorderedAccessView;
-        RETURN_IF_FAILED(resources.CreateStructuredBufferUAV(spOutBuffer.Get(), &spOutBufferUnorderedAccessView));
-
-        std::vector<Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView>> uavs = { spOutBufferUnorderedAccessView.Get() };
-
-        Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
-        RETURN_IF_FAILED(CreateShader(resources, L"Shaders\\normalize_image.hlsl", &spComputeShader));
-        resources.RunComputeShader(spComputeShader.Get(), spConstantBuffer.Get(),
-            1, &sharedResourceViews.at(0), uavs, width * height, 1, 1);
+            float dataMin, dataMax;
+            if (m_lowPercentile != 0.f || m_highPercentile != 100.f)
+            {
+                GetPercentileRange(data.data(), data.size(), m_lowPercentile, m_highPercentile, &dataMin, &dataMax);
+            }
+            else
+            {
+                GetRange(data.data(), data.size(), &dataMin, &dataMax);
+            }
+
+            min = (m_min == std::numeric_limits<float>::min()) ? dataMin : m_min;
+            max = (m_max == std::numeric_limits<float>::min()) ? dataMax : m_max;
+        }
+
+        // The pixels are written out as they are, with no device round trip
+        std::vector<uint64_t> pixels(data.size());
+        ApplyColormap(data.data(), data.size(), min, max, m_colormap, pixels.data());
 
         WICPixelFormatGUID format = GUID_WICPixelFormat64bppRGBA;
-        RETURN_IF_FAILED(SaveToFile(resources, spOutBuffer.Get(), width, height,
+        RETURN_IF_FAILED(SaveToFile(resources, pixels.data(), width, height,
             sizeof(unsigned short) * 4, format, m_outputFile.c_str()));
 
         return S_OK;
@@ -26,7 +26,8 @@ enum OperationType
     SignalToNoise,
     GFactor,
     SSIM,
-    GFactorSSIM
+    GFactorSSIM,
+    Benchmark
 };
 
 template <unsigned TType> void LogOperation() {}
@@ -58,6 +59,7 @@ namespace DCM
 #include "multiply_images.inl"
 #include "gfactor.inl"
 #include "image_to_csv.inl"
+#include "colormap_helper.h"
 #include "normalize.inl"
 #include "signal_to_noise.inl"
 #include "voxelize_means.inl"
@@ -65,4 +67,5 @@ namespace DCM
 #include "voxelize_covariance.inl"
 #include "ssim.inl"
 #include "gfactor_ssim.inl"
+#include "benchmark.inl"
 
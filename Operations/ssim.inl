@@ -1,5 +1,7 @@
 #pragma once
 
+#include "voxelize_pair_helper.h"
+
 namespace DCM
 {
 namespace Operations
@@ -16,34 +18,84 @@ template <> struct Operation<OperationType::SSIM>
     unsigned m_yInMillimeters;
     unsigned m_zInMillimeters;
 
+    bool m_isWritingIntermediates;
+
     Operation(
         const std::wstring& xFolder,
         const std::wstring& yFolder,
         unsigned xInMillimeters,
         unsigned yInMillimeters,
         unsigned zInMillimeters,
-        const std::wstring& outputFile) :
+        const std::wstring& outputFile,
+        bool isWritingIntermediates = false) :
             m_xFolder(xFolder),
             m_yFolder(yFolder),
             m_xInMillimeters(xInMillimeters),
             m_yInMillimeters(yInMillimeters),
             m_zInMillimeters(zInMillimeters),
-            m_outputFile(outputFile)
+            m_outputFile(outputFile),
+            m_isWritingIntermediates(isWritingIntermediates)
     {}
 
     HRESULT Run(Application::Infrastructure::DeviceResources& resources)
     {
+        Microsoft::WRL::ComPtr<ID3D11Buffer> spMomentsBuffer;
+        unsigned short voxelImageColumns, voxelImageRows, voxelImageDepth;
+        unsigned bitsAllocated;
+        VolumeDescription volume;
+        RETURN_IF_FAILED(AccumulateVoxelPairMoments(
+            resources, m_xFolder, m_yFolder,
+            m_xInMillimeters, m_yInMillimeters, m_zInMillimeters,
+            &spMomentsBuffer, &voxelImageColumns, &voxelImageRows, &voxelImageDepth, &bitsAllocated, &volume));
+
+        Microsoft::WRL::ComPtr<ID3D11ComputeShader> spFinalizeComputeShader;
+        RETURN_IF_FAILED(resources.CreateKernel(L"voxelize_ssim_finalize", &spFinalizeComputeShader));
+
+        // The SSIM map, followed by the statistics behind it when they are written
+        // out, .ddc when the map is
+        const wchar_t* outputSuffixes[] = { L"", L".xmean", L".ymean", L".xstddev", L".ystddev", L".xycov" };
+        std::wstring intermediateExtension = IsChunkedVolumeFile(m_outputFile) ? L".ddc" : L".dd";
+        const unsigned nOutputs = m_isWritingIntermediates ? static_cast<unsigned>(std::size(outputSuffixes)) : 1;
+
+        unsigned numElements = voxelImageColumns * voxelImageRows * voxelImageDepth;
+        std::vector<Microsoft::WRL::ComPtr<ID3D11Buffer>> outBuffers(nOutputs);
+        std::vector<Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView>> outUAVs(nOutputs);
+        for (unsigned i = 0; i < nOutputs; i++)
+        {
+            FAIL_FAST_IF_FAILED(resources.CreateStructuredBuffer(sizeof(float), numElements, nullptr, &outBuffers[i]));
+            FAIL_FAST_IF_FAILED(resources.CreateStructuredBufferUAV(outBuffers[i].Get(), &outUAVs[i]));
+        }
+
+        Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> spMomentsBufferSRV;
+        FAIL_FAST_IF_FAILED(resources.CreateStructuredBufferSRV(spMomentsBuffer.Get(), &spMomentsBufferSRV));
+        std::vector<ID3D11ShaderResourceView*> sharedResourceViews = { spMomentsBufferSRV.Get() };
+
+        // Stabilizing constants of the SSIM for the dynamic range of the pixels
+        double L = std::ldexp(1., bitsAllocated) - 1;
+        double k1 = .01;
+        double k2 = .03;
+
+        struct {
+            float C1;
+            float C2;
+            unsigned UNUSED[2];
+        } constantFinalizeData = { static_cast<float>(k1 * k1*L*L), static_cast<float>(k2 * k2*L*L), { 0, 0 } };
 
-        std::wstring xMeanFile = m_outputFile + L".xmean.dd";
-        std::wstring yMeanFile = m_outputFile + L".ymean.dd";
-        std::wstring xStdDevFile = m_outputFile + L".xstddev.dd";
-        std::wstring yStdDevFile = m_outputFile + L".ystddev.dd";
-        std::wstring xyCovarianceFile = m_outputFile + L".xycov.dd";
+        Microsoft::WRL::ComPtr<ID3D11Buffer> spFinalizeConstantBuffer;
+        FAIL_FAST_IF_FAILED(resources.CreateConstantBuffer(constantFinalizeData, &spFinalizeConstantBuffer));
 
-        MakeOperation<OperationType::VoxelizeStdDev>(m_xFolder, xStdDevFile, m_xInMillimeters, m_yInMillimeters, m_zInMillimeters, xMeanFile)->Run(resources);
-        MakeOperation<OperationType::VoxelizeStdDev>(m_yFolder, yStdDevFile, m_xInMillimeters, m_yInMillimeters, m_zInMillimeters, yMeanFile)->Run(resources);
-        MakeOperation<OperationType::VoxelizeCovariance>(m_xFolder, m_yFolder, xMeanFile, yMeanFile, m_xInMillimeters, m_yInMillimeters, m_zInMillimeters, xyCovarianceFile)->Run(resources);
+        resources.RunComputeShader(spFinalizeComputeShader.Get(), spFinalizeConstantBuffer.Get(), 1, &sharedResourceViews[0],
+            outUAVs, numElements, 1, 1);
 
+        for (unsigned i = 0; i < nOutputs; i++)
+        {
+            RETURN_IF_FAILED(
+                SaveToFile(
+                    resources,
+                    outBuffers[i].Get(),
+                    volume,
+                    (i == 0 ? m_outputFile : m_outputFile + outputSuffixes[i] + intermediateExtension).c_str()));
+        }
 
         return S_OK;
     }
@@ -31,181 +31,141 @@ template <> struct Operation<OperationType::VoxelizeMeans>
 
     HRESULT Run(Application::Infrastructure::DeviceResources& resources)
     {
-        wchar_t pwzFileName[MAX_PATH + 1];
-        RETURN_HR_IF(E_FAIL, 0 == GetModuleFileName(NULL, pwzFileName, MAX_PATH + 1));
-        std::wstring shaderPath(pwzFileName);
-        shaderPath.erase(shaderPath.begin() + shaderPath.find_last_of(L'\\') + 1, shaderPath.end());
-        shaderPath += L"Shaders\\voxelize_mean.hlsl";
-
         // Create the shader
         Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
-        RETURN_IF_FAILED(resources.CreateComputeShader(shaderPath.c_str(), "CSMain", &spComputeShader));
+        RETURN_IF_FAILED(resources.CreateKernel(L"voxelize_mean", &spComputeShader));
+
+        SeriesIndex series;
+        RETURN_IF_FAILED(series.Load(m_inputFolder));
+        auto nFiles = series.GetCount();
+
+        // Slices are accumulated in scene order so that the sums are rounded the
+        // same way on every run
+        SliceLoader slices(series, SliceOrder::InOrder);
+
+        Microsoft::WRL::ComPtr<ID3D11Buffer> spOutBuffer;
+        Microsoft::WRL::ComPtr<ID3D11Buffer> spOutBufferCounts;
+        std::vector<Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView>> uavs;
+        unsigned short voxelImageColumns = 0;
+        unsigned short voxelImageRows = 0;
+        unsigned short voxelImageDepth = 0;
+        VolumeDescription volume;
+        Application::Infrastructure::PooledDeviceBuffer constantBuffer;
+        Application::Infrastructure::PooledDeviceBuffer inputBuffer;
+
+        // Slices are accumulated on this thread, the kernels run on the task pool
+        LoadedSlice slice;
+        HRESULT hr;
+        while ((hr = slices.Next(&slice)) == S_OK)
+        {
+            auto& file = slice.File;
+            if (!spOutBuffer || uavs.size() == 0)
+            {
+                RETURN_IF_FAILED(GetVoxelDimensions(file, nFiles,
+                    m_xInMillimeters, m_yInMillimeters, m_zInMillimeters,
+                    &voxelImageColumns, &voxelImageRows, &voxelImageDepth));
+                RETURN_IF_FAILED(GetVoxelVolumeDescription(file,
+                    voxelImageColumns, voxelImageRows, voxelImageDepth,
+                    m_xInMillimeters, m_yInMillimeters, m_zInMillimeters,
+                    &volume));
+
+                Log(L"Creating resources for output buffer: (%d, %d, %d)", voxelImageColumns, voxelImageRows, voxelImageDepth);
+
+                // Mean buffer
+                RETURN_IF_FAILED(resources.CreateStructuredBuffer(
+                    sizeof(float) /* size of item */,
+                    voxelImageColumns * voxelImageRows * voxelImageDepth /* num items */,
+                    nullptr/* data */,
+                    &spOutBuffer));
+
+                Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spOutBufferUnorderedAccessView;
+                RETURN_IF_FAILED(
+                    resources.CreateStructuredBufferUAV(
+                        spOutBuffer.Get(),
+                        &spOutBufferUnorderedAccessView));
 
-        std::vector<std::shared_ptr<DicomFile>> metadataFiles;
-        RETURN_IF_FAILED(GetMetadataFiles(m_inputFolder, &metadataFiles));
-        RETURN_IF_FAILED(SortFilesInScene(&metadataFiles));
-        auto nFiles = static_cast<unsigned>(metadataFiles.size());
+                // Counts
+                std::vector<unsigned> zeroOutBufferCount(voxelImageColumns * voxelImageRows * voxelImageDepth, 0);
+                RETURN_IF_FAILED(
+                    resources.CreateStructuredBuffer(
+                        sizeof(unsigned) /* size of item */,
+                        voxelImageColumns * voxelImageRows * voxelImageDepth /* num items */,
+                        &zeroOutBufferCount[0],
+                        &spOutBufferCounts));
 
-        Concurrency::ConcurrentQueue<std::shared_ptr<DicomFile>> fileQueue(100);
+                Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spOutBufferCountsUnorderedAccessView;
+                RETURN_IF_FAILED(
+                    resources.CreateStructuredBufferUAV(
+                        spOutBufferCounts.Get(),
+                        &spOutBufferCountsUnorderedAccessView));
 
-        std::thread t1([](auto metadataFiles, auto fileQueue)
-        {
-            [&]()->HRESULT
-            {
-                for (auto file : metadataFiles.get())
-                {
-                    // Get the full file
-                    std::shared_ptr<DicomFile> fullFile;
-                    FAIL_FAST_IF_FAILED(MakeDicomImageFile(file->SafeGetFilename(), &fullFile));
-                    RETURN_IF_FAILED(fileQueue.get().Enqueue(std::move(fullFile)));
-                }
-
-                fileQueue.get().Finish();
-                return S_OK;
-            }();
-        }, std::ref(metadataFiles), std::ref(fileQueue));
-
-        std::thread t2(
-            [](auto resources,
-                auto spComputeShader,
-                auto fileQueue,
-                auto nFiles,
-                auto voxelWidthInMillimeters,
-                auto voxelHeightInMillimeters,
-                auto voxelDepthInMillimeters,
-                auto outputFile)
-        {
-            [&]()->HRESULT
-            {
-                Microsoft::WRL::ComPtr<ID3D11Buffer> spOutBuffer;
-                Microsoft::WRL::ComPtr<ID3D11Buffer> spOutBufferCounts;
-                std::vector<Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView>> uavs;
-                unsigned short voxelImageColumns = 0;
-                unsigned short voxelImageRows = 0;
-                unsigned short voxelImageDepth = 0;
-                unsigned slice = 0;
-
-                bool isDefunct;
-                while (SUCCEEDED(fileQueue.get().IsDefunct(&isDefunct)) && !isDefunct)
-                {
-                    std::shared_ptr<DicomFile> file;
-                    FAIL_FAST_IF_FAILED(fileQueue.get().Dequeue(&file));
+                uavs = { spOutBufferUnorderedAccessView, spOutBufferCountsUnorderedAccessView };
 
-                    if (!spOutBuffer || uavs.size() == 0)
-                    {
-                        FAIL_FAST_IF_FAILED(GetVoxelDimensions(file, nFiles,
-                            voxelWidthInMillimeters, voxelHeightInMillimeters, voxelDepthInMillimeters,
-                            &voxelImageColumns, &voxelImageRows, &voxelImageDepth));
-
-                        Log(L"Creating resources for output buffer: (%d, %d, %d)", voxelImageColumns, voxelImageRows, voxelImageDepth);
-
-                        // Mean buffer
-                        FAIL_FAST_IF_FAILED(resources.get().CreateStructuredBuffer(
-                            sizeof(float) /* size of item */,
-                            voxelImageColumns * voxelImageRows * voxelImageDepth /* num items */,
-                            nullptr/* data */,
-                            &spOutBuffer));
-
-                        Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spOutBufferUnorderedAccessView;
-                        FAIL_FAST_IF_FAILED(
-                            resources.get().CreateStructuredBufferUAV(
-                                spOutBuffer.Get(),
-                                &spOutBufferUnorderedAccessView));
-
-                        // Counts
-                        std::vector<unsigned> zeroOutBufferCount(voxelImageColumns * voxelImageRows * voxelImageDepth, 0);
-                        FAIL_FAST_IF_FAILED(
-                            resources.get().CreateStructuredBuffer(
-                                sizeof(unsigned) /* size of item */,
-                                voxelImageColumns * voxelImageRows * voxelImageDepth /* num items */,
-                                &zeroOutBufferCount[0],
-                                &spOutBufferCounts));
-
-                        Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spOutBufferCountsUnorderedAccessView;
-                        FAIL_FAST_IF_FAILED(
-                            resources.get().CreateStructuredBufferUAV(
-                                spOutBufferCounts.Get(),
-                                &spOutBufferCountsUnorderedAccessView));
-
-                        uavs = { spOutBufferUnorderedAccessView, spOutBufferCountsUnorderedAccessView };
-
-                        Log(L"Created resources for output buffer.");
-                    }
+                Log(L"Created resources for output buffer.");
+            }
 
-                    Log(L"Processing: %ls", file->SafeGetFilename().c_str());
-                    Log(L"Creating constant resources.");
+            Log(L"Processing: %ls", file->SafeGetFilename().c_str());
+            Log(L"Creating constant resources.");
 
-                    struct {
-                        unsigned InputRCD[3];
-                        unsigned OutputRCD[3];
-                        float SpacingXYZ[3];
-                        float VoxelSpacingXYZ[3];
-                    } constantData =
+            struct {
+                unsigned InputRCD[3];
+                unsigned OutputRCD[3];
+                float SpacingXYZ[3];
+                float VoxelSpacingXYZ[3];
+            } constantData =
+            {
+                {
+                    static_cast<unsigned>(Property<ImageProperty::Rows>::SafeGet(file)),
+                    static_cast<unsigned>(Property<ImageProperty::Columns>::SafeGet(file)),
+                    slice.Index
+                },
                     {
-                        {
-                            static_cast<unsigned>(Property<ImageProperty::Rows>::SafeGet(file)),
-                            static_cast<unsigned>(Property<ImageProperty::Columns>::SafeGet(file)),
-                            slice++
-                        },
-                            {
-                                voxelImageRows,
-                                voxelImageColumns,
-                                voxelImageDepth
-                            },
-                            {
-                                Property<ImageProperty::Spacings>::SafeGet(file)[0],
-                                Property<ImageProperty::Spacings>::SafeGet(file)[1],
-                                Property<ImageProperty::Spacings>::SafeGet(file)[2]
-                            },
-                            {
-                                static_cast<float>(voxelWidthInMillimeters),
-                                static_cast<float>(voxelHeightInMillimeters),
-                                static_cast<float>(voxelDepthInMillimeters)
-                            }
-                    };
-
-                    Microsoft::WRL::ComPtr<ID3D11Buffer> spConstantBuffer;
-                    FAIL_FAST_IF_FAILED(resources.get().CreateConstantBuffer(constantData, &spConstantBuffer));
-
-                    Log(L"Created constant resources.");
-
-                    // Get data as structured buffer
-                    // Because structured buffers require a minumum size of 4 bytes per element,
-                    // 2 pixels are packed together.
-                    auto data = Property<ImageProperty::PixelData>::SafeGet(file);
-                    Microsoft::WRL::ComPtr<ID3D11Buffer> spBuffer;
-                    FAIL_FAST_IF_FAILED(resources.get().CreateStructuredBuffer(
-                        sizeof(short) * 2 /* size of item */,
-                        static_cast<unsigned>(data->size() / 4) /* num items */,
-                        &data->at(0) /* data */,
-                        &spBuffer));
-
-                    Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> spShaderResourceView;
-                    FAIL_FAST_IF_FAILED(resources.get().CreateStructuredBufferSRV(spBuffer.Get(), &spShaderResourceView));
-
-                    std::vector<ID3D11ShaderResourceView*> sharedResourceViews = { spShaderResourceView.Get() };
-                    resources.get().RunComputeShader(spComputeShader.Get(), spConstantBuffer.Get(), 1, &sharedResourceViews[0],
-                        uavs, voxelImageColumns * voxelImageRows * voxelImageDepth, 1, 1);
-                }
-
-                RETURN_IF_FAILED(
-                    SaveToFile(
-                        resources,
-                        spOutBuffer.Get(),
-                        voxelImageColumns * voxelImageDepth,
                         voxelImageRows,
-                        sizeof(float),
-                        outputFile.c_str()));
-
-                return S_OK;
-            }();
-        },
-            std::ref(resources), spComputeShader, std::ref(fileQueue), nFiles,
-            m_xInMillimeters, m_yInMillimeters, m_zInMillimeters,
-            m_outputFile);
-
-        t1.join();
-        t2.join();
+                        voxelImageColumns,
+                        voxelImageDepth
+                    },
+                    {
+                        Property<ImageProperty::Spacings>::SafeGet(file)[0],
+                        Property<ImageProperty::Spacings>::SafeGet(file)[1],
+                        Property<ImageProperty::Spacings>::SafeGet(file)[2]
+                    },
+                    {
+                        static_cast<float>(m_xInMillimeters),
+                        static_cast<float>(m_yInMillimeters),
+                        static_cast<float>(m_zInMillimeters)
+                    }
+            };
+
+            // The pooled buffers of the previous slice are reused
+            RETURN_IF_FAILED(resources.AcquireConstantBuffer(constantData, &constantBuffer));
+
+            Log(L"Created constant resources.");
+
+            // Get data as structured buffer
+            // Because structured buffers require a minumum size of 4 bytes per element,
+            // 2 pixels are packed together.
+            auto data = Property<ImageProperty::PixelData>::SafeGet(file);
+            RETURN_IF_FAILED(resources.AcquireStructuredBuffer(
+                sizeof(short) * 2 /* size of item */,
+                static_cast<unsigned>(data.size() / 4) /* num items */,
+                data.data() /* data */,
+                &inputBuffer));
+
+            std::vector<ID3D11ShaderResourceView*> sharedResourceViews = { inputBuffer.GetView() };
+            // Only the slab of voxels that the slice falls in
+            resources.RunComputeShader(spComputeShader.Get(), constantBuffer.GetBuffer(), 1, &sharedResourceViews[0],
+                uavs, voxelImageColumns, voxelImageRows, 1);
+        }
+
+        RETURN_IF_FAILED(hr);
+        RETURN_HR_IF_NULL(E_FAIL, spOutBuffer.Get());
+
+        RETURN_IF_FAILED(
+            SaveToFile(
+                resources,
+                spOutBuffer.Get(),
+                volume,
+                m_outputFile.c_str()));
 
         return S_OK;
     }
@@ -0,0 +1,163 @@
+#pragma once
+
+namespace DCM
+{
+namespace Operations
+{
+
+// Count and running moments of two paired series in every voxel, see
+// Shaders\voxelize_ssim.hlsl
+struct VoxelPairMoments
+{
+    unsigned Count;
+    unsigned Unused;
+    unsigned Moments[10];
+};
+
+/// <summary>
+/// Streams the slices of two series side by side and accumulates the moments of
+/// each voxel from the pixel data that the loaders read, so every slice is read
+/// from disk once. The moments buffer feeds Shaders\voxelize_ssim_finalize.hlsl.
+/// </summary>
+inline HRESULT AccumulateVoxelPairMoments(
+    Application::Infrastructure::DeviceResources& resources,
+    const std::wstring& xFolder,
+    const std::wstring& yFolder,
+    unsigned xInMillimeters,
+    unsigned yInMillimeters,
+    unsigned zInMillimeters,
+    ID3D11Buffer** ppMomentsBuffer,
+    unsigned short* pVoxelImageColumns,
+    unsigned short* pVoxelImageRows,
+    unsigned short* pVoxelImageDepth,
+    unsigned* pBitsAllocated,
+    VolumeDescription* pVolume)
+{
+    RETURN_HR_IF_NULL(E_POINTER, ppMomentsBuffer);
+    RETURN_HR_IF_NULL(E_POINTER, pVoxelImageColumns);
+    RETURN_HR_IF_NULL(E_POINTER, pVoxelImageRows);
+    RETURN_HR_IF_NULL(E_POINTER, pVoxelImageDepth);
+    RETURN_HR_IF_NULL(E_POINTER, pBitsAllocated);
+    RETURN_HR_IF_NULL(E_POINTER, pVolume);
+
+    SeriesIndex xSeries;
+    RETURN_IF_FAILED(xSeries.Load(xFolder));
+    auto nFiles = xSeries.GetCount();
+
+    SeriesIndex ySeries;
+    RETURN_IF_FAILED(ySeries.Load(yFolder));
+    RETURN_HR_IF(E_FAIL, nFiles != ySeries.GetCount());
+
+    // Both series are loaded in scene order so that their slices pair up
+    SliceLoader xSlices(xSeries, SliceOrder::InOrder);
+    SliceLoader ySlices(ySeries, SliceOrder::InOrder);
+
+    Microsoft::WRL::ComPtr<ID3D11ComputeShader> spComputeShader;
+    RETURN_IF_FAILED(resources.CreateKernel(L"voxelize_ssim", &spComputeShader));
+
+    Microsoft::WRL::ComPtr<ID3D11Buffer> spMomentsBuffer;
+    Microsoft::WRL::ComPtr<ID3D11UnorderedAccessView> spMomentsBufferUAV;
+
+    unsigned short voxelImageColumns = 0;
+    unsigned short voxelImageRows = 0;
+    unsigned short voxelImageDepth = 0;
+    unsigned bitsAllocated = 0;
+
+    // Slices of the same series are the same size, so after the first pair
+    // these come back from the buffer pool
+    Application::Infrastructure::PooledDeviceBuffer constantBuffer;
+    Application::Infrastructure::PooledDeviceBuffer inputBuffers[2];
+
+    LoadedSlice xSlice, ySlice;
+    HRESULT hr;
+    while ((hr = xSlices.Next(&xSlice)) == S_OK && (hr = ySlices.Next(&ySlice)) == S_OK)
+    {
+        auto& xFile = xSlice.File;
+        auto& yFile = ySlice.File;
+
+        auto rows = static_cast<unsigned>(Property<ImageProperty::Rows>::SafeGet(xFile));
+        auto columns = static_cast<unsigned>(Property<ImageProperty::Columns>::SafeGet(xFile));
+        RETURN_HR_IF(E_FAIL, rows != static_cast<unsigned>(Property<ImageProperty::Rows>::SafeGet(yFile)));
+        RETURN_HR_IF(E_FAIL, columns != static_cast<unsigned>(Property<ImageProperty::Columns>::SafeGet(yFile)));
+
+        if (!spMomentsBuffer)
+        {
+            FAIL_FAST_IF_FAILED(GetVoxelDimensions(
+                xFile, nFiles,
+                xInMillimeters, yInMillimeters, zInMillimeters,
+                &voxelImageColumns, &voxelImageRows, &voxelImageDepth));
+            FAIL_FAST_IF_FAILED(GetVoxelVolumeDescription(
+                xFile,
+                voxelImageColumns, voxelImageRows, voxelImageDepth,
+                xInMillimeters, yInMillimeters, zInMillimeters,
+                pVolume));
+            bitsAllocated = Property<ImageProperty::BitsAllocated>::SafeGet<unsigned>(xFile);
+
+            Log(L"Creating resources for output buffer: (%d, %d, %d)", voxelImageColumns, voxelImageRows, voxelImageDepth);
+
+            unsigned numElements = voxelImageColumns * voxelImageRows * voxelImageDepth;
+            std::vector<VoxelPairMoments> zeroMoments(numElements, VoxelPairMoments {});
+            FAIL_FAST_IF_FAILED(resources.CreateStructuredBuffer(sizeof(VoxelPairMoments), numElements, zeroMoments.data(), &spMomentsBuffer));
+            FAIL_FAST_IF_FAILED(resources.CreateStructuredBufferUAV(spMomentsBuffer.Get(), &spMomentsBufferUAV));
+
+            Log(L"Created resources for output buffer.");
+        }
+
+        Log(L"Processing: %ls and %ls", xFile->SafeGetFilename().c_str(), yFile->SafeGetFilename().c_str());
+
+        // Both slices as structured buffers of 2 packed pixels, straight from
+        // the pixel data that the loaders already read
+        for (unsigned i = 0; i < 2; i++)
+        {
+            auto data = Property<ImageProperty::PixelData>::SafeGet(i == 0 ? xFile : yFile);
+            FAIL_FAST_IF_FAILED(resources.AcquireStructuredBuffer(
+                sizeof(short) * 2 /* size of item */,
+                static_cast<unsigned>(data.size() / 4) /* num items */,
+                data.data() /* data */,
+                &inputBuffers[i]));
+        }
+
+        struct {
+            unsigned InputRCD[3];
+            unsigned OutputRCD[3];
+            float SpacingXYZ[3];
+            float VoxelSpacingXYZ[3];
+        } constantData =
+        {
+            { rows, columns, xSlice.Index },
+            { voxelImageRows, voxelImageColumns, voxelImageDepth },
+            {
+                Property<ImageProperty::Spacings>::SafeGet(xFile)[0],
+                Property<ImageProperty::Spacings>::SafeGet(xFile)[1],
+                Property<ImageProperty::Spacings>::SafeGet(xFile)[2]
+            },
+            {
+                static_cast<float>(xInMillimeters),
+                static_cast<float>(yInMillimeters),
+                static_cast<float>(zInMillimeters)
+            }
+        };
+
+        FAIL_FAST_IF_FAILED(resources.AcquireConstantBuffer(constantData, &constantBuffer));
+
+        std::vector<ID3D11ShaderResourceView*> sharedResourceViews =
+            { inputBuffers[0].GetView(), inputBuffers[1].GetView() };
+
+        // Only the slab of voxels that the slices fall in
+        resources.RunComputeShader(spComputeShader.Get(), constantBuffer.GetBuffer(), 2, &sharedResourceViews[0],
+            { spMomentsBufferUAV }, voxelImageColumns, voxelImageRows, 1);
+    }
+
+    RETURN_IF_FAILED(hr);
+    RETURN_HR_IF_NULL(E_FAIL, spMomentsBuffer.Get());
+
+    *ppMomentsBuffer = spMomentsBuffer.Detach();
+    *pVoxelImageColumns = voxelImageColumns;
+    *pVoxelImageRows = voxelImageRows;
+    *pVoxelImageDepth = voxelImageDepth;
+    *pBitsAllocated = bitsAllocated;
+    return S_OK;
+}
+
+} // Operations
+} // DCM
\ No newline at end of file
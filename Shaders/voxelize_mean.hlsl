@@ -14,33 +14,30 @@ cbuffer CS_CONSTANT_BUFFER : register(b0)
     float VOXEL_SPACING_Z;
 };
 
+// FLOAT_PIXELS reads one float per pixel instead of two packed 16 bit pixels
+#if FLOAT_PIXELS
+StructuredBuffer<float> BufferIn : register(t0);
+#else
 StructuredBuffer<uint> BufferIn : register(t0);
+#endif
 RWStructuredBuffer<float> BufferMeans : register(u0);
 RWStructuredBuffer<uint> BufferCountsOut : register(u1);
 RWStructuredBuffer<float> BufferMeansSquared : register(u2);
 
-uint3 GetImageForIndex(uint index)
-{
-    uint stride = OUTPUT_C * OUTPUT_D;
-    uint3 rcd;
-    rcd.x = floor(index / (float)stride); // row
-    rcd.y = (index % stride) % OUTPUT_C; // column
-    rcd.z = floor((index % stride) / (float)OUTPUT_C); // depth
-    return rcd;
-}
-
 [numthreads(1, 1, 1)]
 void CSMain( uint3 DTid : SV_DispatchThreadID )
 {
-    uint3 rcd = GetImageForIndex(DTid.x);
-
-    // Ensure that the slice image being processed is relevant to the current pixel.
+    // Only the slab of voxels that the slice falls in is dispatched, with one
+    // thread per column and row
     uint inputVoxelDepth = floor(INPUT_D * SPACING_Z / VOXEL_SPACING_Z);
-    if (inputVoxelDepth != rcd.z)
+    if (inputVoxelDepth >= OUTPUT_D || DTid.x >= OUTPUT_C || DTid.y >= OUTPUT_R)
     {
         return;
     }
 
+    uint3 rcd = uint3(DTid.y, DTid.x, inputVoxelDepth);
+    uint index = (rcd.x * OUTPUT_C * OUTPUT_D) + (rcd.z * OUTPUT_C) + rcd.y;
+
     float aggregator = 0;
     float aggregatorSquared = 0;
     uint inputStartRow    = floor(rcd.x * VOXEL_SPACING_Y / SPACING_Y);
@@ -52,6 +49,9 @@ void CSMain( uint3 DTid : SV_DispatchThreadID )
     {
         for (uint c = inputStartColumn; c < inputEndColumn; c++)
         {
+#if FLOAT_PIXELS
+            float value = BufferIn[r * INPUT_C + c];
+#else
             uint bufferIndex = floor((r * INPUT_C + c) / 2);
             uint bufferOffset = (r * INPUT_C + c) % 2;
 
@@ -64,6 +64,7 @@ void CSMain( uint3 DTid : SV_DispatchThreadID )
             {
                 value = (float)(BufferIn[bufferIndex] >> 16);
             }
+#endif
 
             aggregator += value;
             aggregatorSquared += (value * value);
@@ -71,7 +72,7 @@ void CSMain( uint3 DTid : SV_DispatchThreadID )
     }
 
     uint nCount = (inputEndRow - inputStartRow) * (inputEndColumn - inputStartColumn);
-    BufferMeans[DTid.x] = ((BufferCountsOut[DTid.x] * BufferMeans[DTid.x]) + aggregator) / (BufferCountsOut[DTid.x] + nCount);
-    BufferMeansSquared[DTid.x] = ((BufferCountsOut[DTid.x] * BufferMeansSquared[DTid.x]) + aggregatorSquared) / (BufferCountsOut[DTid.x] + nCount);
-    BufferCountsOut[DTid.x] += nCount;
+    BufferMeans[index] = ((BufferCountsOut[index] * BufferMeans[index]) + aggregator) / (BufferCountsOut[index] + nCount);
+    BufferMeansSquared[index] = ((BufferCountsOut[index] * BufferMeansSquared[index]) + aggregatorSquared) / (BufferCountsOut[index] + nCount);
+    BufferCountsOut[index] += nCount;
 }
\ No newline at end of file
@@ -0,0 +1,115 @@
+cbuffer CS_CONSTANT_BUFFER : register(b0)
+{
+    uint INPUT_R;
+    uint INPUT_C;
+    uint INPUT_D;
+    uint OUTPUT_R;
+    uint OUTPUT_C;
+    uint OUTPUT_D;
+    float SPACING_X;
+    float SPACING_Y;
+    float SPACING_Z;
+    float VOXEL_SPACING_X;
+    float VOXEL_SPACING_Y;
+    float VOXEL_SPACING_Z;
+};
+
+// Count, means, sums of squared differences from the means and co-moment of
+// the paired pixels that fell in a voxel so far. The CPU backend keeps exact
+// integer sums in the same 48 bytes instead.
+struct VoxelPairMoments
+{
+    uint Count;
+    uint Unused;
+    float MeanX;
+    float MeanY;
+    float M2X;
+    float M2Y;
+    float CXY;
+    uint Unused2[5];
+};
+
+StructuredBuffer<uint> BufferX : register(t0);
+StructuredBuffer<uint> BufferY : register(t1);
+RWStructuredBuffer<VoxelPairMoments> BufferMoments : register(u0);
+
+float GetPixel(uint packed, uint index)
+{
+    if (index % 2 == 0)
+    {
+        return (float)((packed << 16) >> 16);
+    }
+    else
+    {
+        return (float)(packed >> 16);
+    }
+}
+
+[numthreads(1, 1, 1)]
+void CSMain( uint3 DTid : SV_DispatchThreadID )
+{
+    // Only the slab of voxels that the slice falls in is dispatched, with one
+    // thread per column and row
+    uint inputVoxelDepth = floor(INPUT_D * SPACING_Z / VOXEL_SPACING_Z);
+    if (inputVoxelDepth >= OUTPUT_D || DTid.x >= OUTPUT_C || DTid.y >= OUTPUT_R)
+    {
+        return;
+    }
+
+    uint3 rcd = uint3(DTid.y, DTid.x, inputVoxelDepth);
+    uint index = (rcd.x * OUTPUT_C * OUTPUT_D) + (rcd.z * OUTPUT_C) + rcd.y;
+
+    uint inputStartRow    = floor(rcd.x * VOXEL_SPACING_Y / SPACING_Y);
+    uint inputEndRow      = floor((rcd.x + 1) * VOXEL_SPACING_Y / SPACING_Y);
+    uint inputStartColumn = floor(rcd.y * VOXEL_SPACING_X / SPACING_X);
+    uint inputEndColumn   = floor((rcd.y + 1) * VOXEL_SPACING_X / SPACING_X);
+
+    uint nCount = (inputEndRow - inputStartRow) * (inputEndColumn - inputStartColumn);
+    if (nCount == 0)
+    {
+        return;
+    }
+
+    // Means of the pixels of this pair of slices, then their moments about them
+    float2 aggregator = 0;
+    uint r, c;
+    for (r = inputStartRow; r < inputEndRow; r++)
+    {
+        for (c = inputStartColumn; c < inputEndColumn; c++)
+        {
+            uint pixelIndex = r * INPUT_C + c;
+            aggregator += float2(
+                GetPixel(BufferX[pixelIndex / 2], pixelIndex),
+                GetPixel(BufferY[pixelIndex / 2], pixelIndex));
+        }
+    }
+    float2 batchMean = aggregator / nCount;
+
+    float2 batchM2 = 0;
+    float batchC = 0;
+    for (r = inputStartRow; r < inputEndRow; r++)
+    {
+        for (c = inputStartColumn; c < inputEndColumn; c++)
+        {
+            uint pixelIndex = r * INPUT_C + c;
+            float2 difference = float2(
+                GetPixel(BufferX[pixelIndex / 2], pixelIndex),
+                GetPixel(BufferY[pixelIndex / 2], pixelIndex)) - batchMean;
+            batchM2 += difference * difference;
+            batchC += difference.x * difference.y;
+        }
+    }
+
+    // Merge the pair of slices into the running moments (Chan et al.)
+    VoxelPairMoments moments = BufferMoments[index];
+    uint count = moments.Count + nCount;
+    float2 delta = batchMean - float2(moments.MeanX, moments.MeanY);
+    float weight = (float)moments.Count * nCount / count;
+    moments.MeanX += delta.x * nCount / count;
+    moments.MeanY += delta.y * nCount / count;
+    moments.M2X += batchM2.x + delta.x * delta.x * weight;
+    moments.M2Y += batchM2.y + delta.y * delta.y * weight;
+    moments.CXY += batchC + delta.x * delta.y * weight;
+    moments.Count = count;
+    BufferMoments[index] = moments;
+}
\ No newline at end of file
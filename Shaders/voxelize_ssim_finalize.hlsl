@@ -0,0 +1,60 @@
+cbuffer CS_CONSTANT_BUFFER : register(b0)
+{
+    float C1;
+    float C2;
+    uint UNUSED[2];
+};
+
+struct VoxelPairMoments
+{
+    uint Count;
+    uint Unused;
+    float MeanX;
+    float MeanY;
+    float M2X;
+    float M2Y;
+    float CXY;
+    uint Unused2[5];
+};
+
+StructuredBuffer<VoxelPairMoments> BufferMoments : register(t0);
+
+// Only the SSIM is always bound, writes to the others are dropped when the
+// statistics behind it were not requested
+RWStructuredBuffer<float> BufferSSIM : register(u0);
+RWStructuredBuffer<float> BufferMeansX : register(u1);
+RWStructuredBuffer<float> BufferMeansY : register(u2);
+RWStructuredBuffer<float> BufferStdDevX : register(u3);
+RWStructuredBuffer<float> BufferStdDevY : register(u4);
+RWStructuredBuffer<float> BufferCovariance : register(u5);
+
+[numthreads(1, 1, 1)]
+void CSMain(uint3 DTid : SV_DispatchThreadID)
+{
+    VoxelPairMoments moments = BufferMoments[DTid.x];
+    if (moments.Count == 0)
+    {
+        BufferSSIM[DTid.x] = 0;
+        BufferMeansX[DTid.x] = 0;
+        BufferMeansY[DTid.x] = 0;
+        BufferStdDevX[DTid.x] = 0;
+        BufferStdDevY[DTid.x] = 0;
+        BufferCovariance[DTid.x] = 0;
+        return;
+    }
+
+    float ux = moments.MeanX;
+    float uy = moments.MeanY;
+    float xVariance = max(moments.M2X, 0) / moments.Count;
+    float yVariance = max(moments.M2Y, 0) / moments.Count;
+    float covariance = moments.CXY / moments.Count;
+
+    BufferSSIM[DTid.x] =
+        ((2 * ux * uy) + C1) * ((2 * covariance) + C2) /
+        (((ux * ux) + (uy * uy) + C1) * (xVariance + yVariance + C2));
+    BufferMeansX[DTid.x] = ux;
+    BufferMeansY[DTid.x] = uy;
+    BufferStdDevX[DTid.x] = sqrt(xVariance);
+    BufferStdDevY[DTid.x] = sqrt(yVariance);
+    BufferCovariance[DTid.x] = covariance;
+}
\ No newline at end of file
@@ -0,0 +1,102 @@
+cbuffer CS_CONSTANT_BUFFER : register(b0)
+{
+    uint INPUT_R;
+    uint INPUT_C;
+    uint INPUT_D;
+    uint OUTPUT_R;
+    uint OUTPUT_C;
+    uint OUTPUT_D;
+    float SPACING_X;
+    float SPACING_Y;
+    float SPACING_Z;
+    float VOXEL_SPACING_X;
+    float VOXEL_SPACING_Y;
+    float VOXEL_SPACING_Z;
+};
+
+// Count, mean and sum of squared differences from the mean of the pixels that
+// fell in a voxel so far. Shader model 5 has no 64 bit integers, the CPU backend
+// keeps exact integer sums in the same 24 bytes instead.
+struct VoxelMoments
+{
+    uint Count;
+    uint Unused;
+    float Mean;
+    float M2;
+    uint2 Unused2;
+};
+
+StructuredBuffer<uint> BufferIn : register(t0);
+RWStructuredBuffer<VoxelMoments> BufferMoments : register(u0);
+
+float GetPixel(uint r, uint c)
+{
+    uint bufferIndex = floor((r * INPUT_C + c) / 2);
+    uint bufferOffset = (r * INPUT_C + c) % 2;
+
+    if (bufferOffset == 0)
+    {
+        return (float)((BufferIn[bufferIndex] << 16) >> 16);
+    }
+    else
+    {
+        return (float)(BufferIn[bufferIndex] >> 16);
+    }
+}
+
+[numthreads(1, 1, 1)]
+void CSMain( uint3 DTid : SV_DispatchThreadID )
+{
+    // Only the slab of voxels that the slice falls in is dispatched, with one
+    // thread per column and row
+    uint inputVoxelDepth = floor(INPUT_D * SPACING_Z / VOXEL_SPACING_Z);
+    if (inputVoxelDepth >= OUTPUT_D || DTid.x >= OUTPUT_C || DTid.y >= OUTPUT_R)
+    {
+        return;
+    }
+
+    uint3 rcd = uint3(DTid.y, DTid.x, inputVoxelDepth);
+    uint index = (rcd.x * OUTPUT_C * OUTPUT_D) + (rcd.z * OUTPUT_C) + rcd.y;
+
+    uint inputStartRow    = floor(rcd.x * VOXEL_SPACING_Y / SPACING_Y);
+    uint inputEndRow      = floor((rcd.x + 1) * VOXEL_SPACING_Y / SPACING_Y);
+    uint inputStartColumn = floor(rcd.y * VOXEL_SPACING_X / SPACING_X);
+    uint inputEndColumn   = floor((rcd.y + 1) * VOXEL_SPACING_X / SPACING_X);
+
+    uint nCount = (inputEndRow - inputStartRow) * (inputEndColumn - inputStartColumn);
+    if (nCount == 0)
+    {
+        return;
+    }
+
+    // Mean of the pixels of this slice, then their squared differences from it
+    float aggregator = 0;
+    uint r, c;
+    for (r = inputStartRow; r < inputEndRow; r++)
+    {
+        for (c = inputStartColumn; c < inputEndColumn; c++)
+        {
+            aggregator += GetPixel(r, c);
+        }
+    }
+    float batchMean = aggregator / nCount;
+
+    float batchM2 = 0;
+    for (r = inputStartRow; r < inputEndRow; r++)
+    {
+        for (c = inputStartColumn; c < inputEndColumn; c++)
+        {
+            float difference = GetPixel(r, c) - batchMean;
+            batchM2 += difference * difference;
+        }
+    }
+
+    // Merge the slice into the running moments (Chan et al.)
+    VoxelMoments moments = BufferMoments[index];
+    uint count = moments.Count + nCount;
+    float delta = batchMean - moments.Mean;
+    moments.Mean += delta * nCount / count;
+    moments.M2 += batchM2 + delta * delta * ((float)moments.Count * nCount / count);
+    moments.Count = count;
+    BufferMoments[index] = moments;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+struct VoxelMoments
+{
+    uint Count;
+    uint Unused;
+    float Mean;
+    float M2;
+    uint2 Unused2;
+};
+
+StructuredBuffer<VoxelMoments> BufferMoments : register(t0);
+RWStructuredBuffer<float> BufferMeans : register(u0);
+RWStructuredBuffer<float> BufferStdDev : register(u1);
+
+[numthreads(1, 1, 1)]
+void CSMain(uint3 DTid : SV_DispatchThreadID)
+{
+    VoxelMoments moments = BufferMoments[DTid.x];
+    if (moments.Count == 0)
+    {
+        BufferMeans[DTid.x] = 0;
+        BufferStdDev[DTid.x] = 0;
+        return;
+    }
+
+    BufferMeans[DTid.x] = moments.Mean;
+    BufferStdDev[DTid.x] = sqrt(max(moments.M2, 0) / moments.Count);
+}
\ No newline at end of file
@@ -87,8 +87,7 @@ protected:
         return S_OK;
     }
 
-    template <>
-    HRESULT Read<std::wstring>(const std::wstring& param, std::wstring* value)
+    HRESULT Read(const std::wstring& param, std::wstring* value)
     {
         *value = param;
         return S_OK;
@@ -121,15 +120,53 @@ private:
 
 
 
-    HRESULT ProcessArguments()
+#ifdef _WIN32
+    HRESULT GetCommandLineArguments(std::vector<std::wstring>* pArguments)
     {
+        RETURN_HR_IF_NULL(E_POINTER, pArguments);
+
         int iArgs;
         auto args = CommandLineToArgvW(GetCommandLineW(), &iArgs);
+        RETURN_HR_IF_NULL(E_FAIL, args);
+
+        pArguments->assign(args, args + iArgs);
+        LocalFree(args);
+        return S_OK;
+    }
+#else
+    HRESULT GetCommandLineArguments(std::vector<std::wstring>* pArguments)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pArguments);
+        pArguments->clear();
+
+        // Arguments are NUL separated
+        std::ifstream stream("/proc/self/cmdline", std::ios_base::binary);
+        std::string argument;
+        while (std::getline(stream, argument, '\0'))
+        {
+            std::wstring wideArgument(argument.size(), L'\0');
+            auto length = mbstowcs(&wideArgument[0], argument.c_str(), argument.size());
+            RETURN_HR_IF(E_INVALIDARG, length == static_cast<size_t>(-1));
+            wideArgument.resize(length);
+            pArguments->emplace_back(std::move(wideArgument));
+        }
+        return S_OK;
+    }
+#endif
+
+    HRESULT ProcessArguments()
+    {
+        std::vector<std::wstring> arguments;
+        RETURN_IF_FAILED(GetCommandLineArguments(&arguments));
+
+        std::vector<wchar_t*> args(arguments.size());
+        std::transform(std::begin(arguments), std::end(arguments), std::begin(args),
+            [](std::wstring& argument) { return &argument[0]; });
 
-        unsigned nArgs = static_cast<unsigned>(iArgs);
+        unsigned nArgs = static_cast<unsigned>(args.size());
         for (unsigned i = 1; i < nArgs;)
         {
-            wprintf(L"%s ", args[i]);
+            wprintf(L"%ls ", args[i]);
 
             unsigned nArgsToFolllow;
             if (FAILED(shim().GetLengthOfArgumentsToFollow(args[i], &nArgsToFolllow)))
@@ -164,7 +201,7 @@ private:
             std::vector<std::wstring> optionParameters;
             for (unsigned j = i + 1; j < i + 1 + nArgsToFolllow; j++)
             {
-                wprintf(L"%s ", args[j]);
+                wprintf(L"%ls ", args[j]);
                 optionParameters.emplace_back(std::wstring(args[j]));
             }
 
@@ -0,0 +1,196 @@
+/*
+*
+*   buffer_pool.h
+*
+*   Buffers of the same size and use recycled across dispatches and operations.
+*
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace Application
+{
+namespace Infrastructure
+{
+
+enum class BufferUsage
+{
+    // Structured buffer read by kernels through its shader resource view
+    Input,
+    // Constant buffer bound to b0
+    Constants
+};
+
+struct BufferPoolStatistics
+{
+    // Bytes of every buffer the pool holds, handed out or idle. Once the loops
+    // of an operation have run once this stays flat, it is the steady state.
+    uint64_t BytesAllocated = 0;
+    uint64_t PeakBytesAllocated = 0;
+    // Bytes of the buffers that are handed out right now
+    uint64_t BytesInUse = 0;
+    uint64_t PeakBytesInUse = 0;
+    uint64_t Allocations = 0;
+    uint64_t Reuses = 0;
+};
+
+template <typename TBuffer, typename TView> class BufferPool;
+
+/// <summary>
+/// Buffer handed out by a BufferPool, and given back to it when the
+/// PooledBuffer is reset or destroyed.
+/// </summary>
+template <typename TBuffer, typename TView>
+class PooledBuffer
+{
+public:
+    PooledBuffer() = default;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    PooledBuffer(PooledBuffer&& other)
+    {
+        *this = std::move(other);
+    }
+
+    PooledBuffer& operator=(PooledBuffer&& other)
+    {
+        if (this != &other)
+        {
+            Reset();
+            m_pPool = other.m_pPool;
+            m_key = other.m_key;
+            m_spBuffer = std::move(other.m_spBuffer);
+            m_spView = std::move(other.m_spView);
+            other.m_pPool = nullptr;
+        }
+        return *this;
+    }
+
+    ~PooledBuffer()
+    {
+        Reset();
+    }
+
+    TBuffer* GetBuffer() const { return m_spBuffer.Get(); }
+    TView* GetView() const { return m_spView.Get(); }
+
+    void Reset()
+    {
+        if (m_pPool && m_spBuffer)
+        {
+            m_pPool->Return(m_key, std::move(m_spBuffer), std::move(m_spView));
+        }
+        m_pPool = nullptr;
+        m_spBuffer.Reset();
+        m_spView.Reset();
+    }
+
+private:
+    friend class BufferPool<TBuffer, TView>;
+
+    typedef std::tuple<BufferUsage, unsigned, unsigned> Key;
+
+    BufferPool<TBuffer, TView>* m_pPool = nullptr;
+    Key m_key;
+    Microsoft::WRL::ComPtr<TBuffer> m_spBuffer;
+    Microsoft::WRL::ComPtr<TView> m_spView;
+};
+
+/// <summary>
+/// Idle buffers keyed by usage, element size and byte width. A loop that
+/// acquires a buffer per slice and drops it at the end of the iteration gets
+/// the same buffer back every time, so only the first iteration allocates.
+/// Idle buffers beyond MaxIdleBytes are freed rather than kept.
+/// </summary>
+template <typename TBuffer, typename TView>
+class BufferPool
+{
+public:
+    typedef PooledBuffer<TBuffer, TView> Buffer;
+
+    static const uint64_t MaxIdleBytes = 256 * 1024 * 1024;
+
+    // Calls create(TBuffer**, TView**) when no idle buffer fits
+    template <typename TCreate>
+    HRESULT Acquire(BufferUsage usage, unsigned elementSize, unsigned byteWidth, TCreate&& create, Buffer* pBuffer)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pBuffer);
+        pBuffer->Reset();
+
+        typename Buffer::Key key(usage, elementSize, byteWidth);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto& idle = m_idle[key];
+            if (!idle.empty())
+            {
+                pBuffer->m_spBuffer = std::move(idle.back().first);
+                pBuffer->m_spView = std::move(idle.back().second);
+                idle.pop_back();
+                m_idleBytes -= byteWidth;
+                m_statistics.Reuses++;
+                OnHandedOut(byteWidth);
+                pBuffer->m_pPool = this;
+                pBuffer->m_key = key;
+                return S_OK;
+            }
+        }
+
+        RETURN_IF_FAILED(create(pBuffer->m_spBuffer.ReleaseAndGetAddressOf(), pBuffer->m_spView.ReleaseAndGetAddressOf()));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_statistics.Allocations++;
+        m_statistics.BytesAllocated += byteWidth;
+        m_statistics.PeakBytesAllocated = (std::max)(m_statistics.PeakBytesAllocated, m_statistics.BytesAllocated);
+        OnHandedOut(byteWidth);
+        pBuffer->m_pPool = this;
+        pBuffer->m_key = key;
+        return S_OK;
+    }
+
+    BufferPoolStatistics GetStatistics()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_statistics;
+    }
+
+private:
+    friend class PooledBuffer<TBuffer, TView>;
+
+    void OnHandedOut(unsigned byteWidth)
+    {
+        m_statistics.BytesInUse += byteWidth;
+        m_statistics.PeakBytesInUse = (std::max)(m_statistics.PeakBytesInUse, m_statistics.BytesInUse);
+    }
+
+    void Return(const typename Buffer::Key& key, Microsoft::WRL::ComPtr<TBuffer>&& spBuffer, Microsoft::WRL::ComPtr<TView>&& spView)
+    {
+        auto byteWidth = std::get<2>(key);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_statistics.BytesInUse -= byteWidth;
+        if (m_idleBytes + byteWidth > MaxIdleBytes)
+        {
+            // Not kept, the PooledBuffer releases it
+            m_statistics.BytesAllocated -= byteWidth;
+            return;
+        }
+        m_idle[key].emplace_back(std::move(spBuffer), std::move(spView));
+        m_idleBytes += byteWidth;
+    }
+
+    std::mutex m_mutex;
+    std::map<typename Buffer::Key, std::vector<std::pair<Microsoft::WRL::ComPtr<TBuffer>, Microsoft::WRL::ComPtr<TView>>>> m_idle;
+    uint64_t m_idleBytes = 0;
+    BufferPoolStatistics m_statistics;
+};
+
+} // Infrastructure
+} // Application
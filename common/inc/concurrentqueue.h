@@ -1,100 +1,377 @@
 #pragma once
 
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
+#include <thread>
+#include <vector>
+#include <type_traits>
 
 namespace Concurrency
 {
 
-template <typename T>
-class ConcurrentQueue
+enum class QueueConcurrency
 {
-    std::vector<T> m_queue;
-    unsigned m_readPos = 0;
-    unsigned m_writePos = 0;
-    std::mutex m_mutex;
-    std::condition_variable m_empty;
-    std::condition_variable m_full;
-    bool m_isFinalized = false;
+    // Exactly one thread enqueues and exactly one thread dequeues
+    SingleProducerSingleConsumer,
+    // Any number of threads on either side
+    MultiProducerMultiConsumer
+};
+
+namespace Details
+{
+
+// Keeps the indices written by producers and by consumers on separate cache lines
+const size_t CacheLineSize = 64;
+
+inline size_t RoundUpToPowerOf2(size_t value)
+{
+    size_t result = 1;
+    while (result < value)
+    {
+        result <<= 1;
+    }
+    return result;
+}
+
+/// <summary>
+/// Parks threads that found the ring full or empty. The lock-free paths only pay
+/// for an atomic load of the waiter count, the mutex is taken when someone is
+/// actually waiting.
+/// </summary>
+class WaitList
+{
+public:
+    template <typename TPredicate>
+    void Wait(TPredicate isReady)
+    {
+        // Items usually arrive within a few microseconds of each other, unless
+        // the other side cannot run until this thread gives up the only core
+        static const unsigned nSpins = std::thread::hardware_concurrency() > 1 ? SpinCount : 0;
+        for (unsigned i = 0; i < nSpins; i++)
+        {
+            if (isReady())
+            {
+                return;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_nWaiters.fetch_add(1);
+        // Pairs with the fence in Notify, either the waiter sees the new state or
+        // the notifier sees the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_condition.wait(lock, isReady);
+        m_nWaiters.fetch_sub(1);
+    }
+
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_nWaiters.load(std::memory_order_relaxed) != 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_condition.notify_all();
+        }
+    }
+
 private:
+    static const unsigned SpinCount = 64;
 
-    unsigned NextRead()
+    std::atomic<unsigned> m_nWaiters { 0 };
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+};
+
+/// <summary>
+/// Ring of one producer and one consumer. Each side owns its index and keeps a
+/// cached copy of the other one, so the shared index is only read when the
+/// cached copy says the ring is full or empty.
+/// </summary>
+template <typename T>
+class SingleProducerSingleConsumerRing
+{
+public:
+    SingleProducerSingleConsumerRing(size_t capacity) :
+        m_slots(RoundUpToPowerOf2(capacity)),
+        m_mask(m_slots.size() - 1)
     {
-        return (m_readPos + 1) % m_queue.size();
     }
 
-    void IncrementRead()
+    bool TryEnqueue(T&& obj)
     {
-        m_readPos = (m_readPos + 1) % m_queue.size();
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cachedHead == m_slots.size())
+        {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail - m_cachedHead == m_slots.size())
+            {
+                return false;
+            }
+        }
+
+        m_slots[tail & m_mask] = std::move(obj);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
     }
 
-    unsigned NextWrite()
+    size_t TryDequeue(T* pObjs, size_t maxCount)
     {
-        return (m_writePos + 1) % m_queue.size();
+        auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cachedTail)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cachedTail)
+            {
+                return 0;
+            }
+        }
+
+        // The whole batch is published back to the producer with one store
+        auto count = (std::min)(maxCount, m_cachedTail - head);
+        for (size_t i = 0; i < count; i++)
+        {
+            pObjs[i] = std::move(m_slots[(head + i) & m_mask]);
+            m_slots[(head + i) & m_mask] = T();
+        }
+        m_head.store(head + count, std::memory_order_release);
+        return count;
     }
 
-    void IncrementWrite()
+    bool IsEmpty() const
     {
-        m_writePos = (m_writePos + 1) % m_queue.size();
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
     }
 
+private:
+    std::vector<T> m_slots;
+    const size_t m_mask;
+
+    alignas(CacheLineSize) std::atomic<size_t> m_head { 0 };
+    size_t m_cachedTail = 0;
+
+    alignas(CacheLineSize) std::atomic<size_t> m_tail { 0 };
+    size_t m_cachedHead = 0;
+};
+
+/// <summary>
+/// Bounded ring for any number of producers and consumers. Every slot carries
+/// a sequence number that tells whose turn it is, producers and consumers
+/// claim positions with a compare exchange on their own index.
+/// </summary>
+template <typename T>
+class MultiProducerMultiConsumerRing
+{
 public:
-    ConcurrentQueue(unsigned size) :
-        m_queue(size + 1)
+    MultiProducerMultiConsumerRing(size_t capacity) :
+        m_slots(RoundUpToPowerOf2(capacity)),
+        m_mask(m_slots.size() - 1)
     {
+        for (size_t i = 0; i < m_slots.size(); i++)
+        {
+            m_slots[i].Sequence.store(i, std::memory_order_relaxed);
+        }
     }
 
-    HRESULT Enqueue(T&& obj)
+    bool TryEnqueue(T&& obj)
     {
-        FAIL_FAST_IF_TRUE(m_isFinalized);
+        Slot* pSlot;
+        auto position = m_enqueuePosition.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            pSlot = &m_slots[position & m_mask];
+            auto sequence = pSlot->Sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0)
+            {
+                if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                // The slot still holds the item of the previous lap
+                return false;
+            }
+            else
+            {
+                position = m_enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
 
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_full.wait(lock, [&](){ return m_readPos != NextWrite(); });
+        pSlot->Value = std::move(obj);
+        pSlot->Sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t TryDequeue(T* pObjs, size_t maxCount)
+    {
+        size_t count = 0;
+        while (count < maxCount && TryDequeueOne(&pObjs[count]))
+        {
+            count++;
+        }
+        return count;
+    }
+
+    bool IsEmpty() const
+    {
+        auto position = m_dequeuePosition.load(std::memory_order_acquire);
+        auto sequence = m_slots[position & m_mask].Sequence.load(std::memory_order_acquire);
+        return static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1) < 0;
+    }
+
+private:
+    bool TryDequeueOne(T* pObj)
+    {
+        Slot* pSlot;
+        auto position = m_dequeuePosition.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            pSlot = &m_slots[position & m_mask];
+            auto sequence = pSlot->Sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (difference == 0)
+            {
+                if (m_dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                // Nothing has been written to the slot yet in this lap
+                return false;
+            }
+            else
+            {
+                position = m_dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+
+        *pObj = std::move(pSlot->Value);
+        pSlot->Value = T();
+        pSlot->Sequence.store(position + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    struct Slot
+    {
+        std::atomic<size_t> Sequence;
+        T Value;
+    };
+
+    std::vector<Slot> m_slots;
+    const size_t m_mask;
 
-        m_queue[m_writePos] = std::move(obj);
+    alignas(CacheLineSize) std::atomic<size_t> m_enqueuePosition { 0 };
+    alignas(CacheLineSize) std::atomic<size_t> m_dequeuePosition { 0 };
+};
 
-        IncrementWrite();
+} // namespace Details
+
+/// <summary>
+/// Bounded blocking queue over a lock-free ring. Enqueue waits while the queue
+/// is full and Dequeue waits while it is empty. Once the producers are done they
+/// call Finish, after which consumers drain what is left and then Dequeue
+/// returns S_FALSE without an item.
+/// </summary>
+template <typename T, QueueConcurrency TConcurrency = QueueConcurrency::MultiProducerMultiConsumer>
+class ConcurrentQueue
+{
+    using Ring =
+        typename std::conditional<
+            TConcurrency == QueueConcurrency::SingleProducerSingleConsumer,
+            Details::SingleProducerSingleConsumerRing<T>,
+            Details::MultiProducerMultiConsumerRing<T>>::type;
+
+    Ring m_ring;
+    std::atomic<bool> m_isFinalized { false };
+    Details::WaitList m_notEmpty;
+    Details::WaitList m_notFull;
+
+public:
+    // The capacity is rounded up to a power of 2
+    ConcurrentQueue(unsigned size) :
+        m_ring((std::max)(size, 1u))
+    {
+    }
 
-        m_empty.notify_all();
+    HRESULT Enqueue(T&& obj)
+    {
+        FAIL_FAST_IF_TRUE(m_isFinalized.load(std::memory_order_acquire));
 
+        if (!m_ring.TryEnqueue(std::move(obj)))
+        {
+            m_notFull.Wait([&]() { return m_ring.TryEnqueue(std::move(obj)); });
+        }
+        m_notEmpty.Notify();
         return S_OK;
     }
 
+    // Returns S_FALSE once the queue is finished and drained
     HRESULT Dequeue(T* pObj)
     {
-        RETURN_HR_IF_NULL(E_POINTER, pObj);
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_empty.wait(lock, [&](){ return m_readPos != m_writePos || m_isFinalized; });
+        unsigned count;
+        RETURN_IF_FAILED(DequeueBatch(pObj, 1, &count));
+        return count == 1 ? S_OK : S_FALSE;
+    }
 
-        *pObj = std::move(m_queue.at(m_readPos));
+    // Waits for at least one item and takes up to maxCount of those that are
+    // ready. Returns S_FALSE with no items once the queue is finished and drained.
+    HRESULT DequeueBatch(T* pObjs, unsigned maxCount, unsigned* pCount)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pObjs);
+        RETURN_HR_IF_NULL(E_POINTER, pCount);
+        RETURN_HR_IF(E_INVALIDARG, maxCount == 0);
 
-        IncrementRead();
+        size_t count = m_ring.TryDequeue(pObjs, maxCount);
+        if (count == 0)
+        {
+            bool isDrained = false;
+            m_notEmpty.Wait(
+                [&]()
+                {
+                    // Finish comes after the last Enqueue, so if the queue was
+                    // finished before this attempt it is drained when it fails
+                    bool isFinalized = m_isFinalized.load(std::memory_order_acquire);
+                    count = m_ring.TryDequeue(pObjs, maxCount);
+                    isDrained = count == 0 && isFinalized;
+                    return count != 0 || isDrained;
+                });
 
-        m_full.notify_all();
+            if (isDrained)
+            {
+                *pCount = 0;
+                return S_FALSE;
+            }
+        }
 
+        m_notFull.Notify();
+        *pCount = static_cast<unsigned>(count);
         return S_OK;
     }
 
     bool IsEmpty() const
     {
-        return m_readPos == m_writePos;
+        return m_ring.IsEmpty();
     }
 
+    // Called once all items have been enqueued
     HRESULT Finish()
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_isFinalized = true;
-        m_empty.notify_all();
+        m_isFinalized.store(true, std::memory_order_release);
+        m_notEmpty.Notify();
         return S_OK;
     }
 
     HRESULT IsDefunct(bool* pIsDefunct)
     {
         RETURN_HR_IF_NULL(E_POINTER, pIsDefunct);
-        *pIsDefunct = (m_isFinalized == true) && IsEmpty();
+        *pIsDefunct = m_isFinalized.load(std::memory_order_acquire) && IsEmpty();
         return S_OK;
     }
 };
 
-} // namespace Concurrent
\ No newline at end of file
+} // namespace Concurrent
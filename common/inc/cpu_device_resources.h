@@ -0,0 +1,469 @@
+/*
+*
+*   cpu_device_resources.h
+*
+*   CPU compute backend. Mirrors the structured buffer, constant buffer and
+*   dispatch model of the D3D11 DeviceResources so that operations can run
+*   unchanged on machines without a GPU. Shaders are resolved by file name to
+*   native kernels (see dcp/cpu_kernels.cpp) and each dispatch is spread across
+*   all available cores.
+*
+*   Included in place of device_resources.h when DCP_CPU_BACKEND is defined.
+*
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+
+namespace Microsoft
+{
+namespace WRL
+{
+
+// Intrusive reference counted pointer with the subset of the WRL ComPtr
+// interface that the operations rely on.
+template <typename T>
+class ComPtr
+{
+    T* m_ptr = nullptr;
+
+    void InternalAddRef() const { if (m_ptr) { m_ptr->AddRef(); } }
+    void InternalRelease()
+    {
+        T* ptr = m_ptr;
+        if (ptr)
+        {
+            m_ptr = nullptr;
+            ptr->Release();
+        }
+    }
+
+public:
+    ComPtr() = default;
+    ComPtr(decltype(nullptr)) {}
+    ComPtr(T* ptr) : m_ptr(ptr) { InternalAddRef(); }
+    ComPtr(const ComPtr& other) : m_ptr(other.m_ptr) { InternalAddRef(); }
+    ComPtr(ComPtr&& other) : m_ptr(other.m_ptr) { other.m_ptr = nullptr; }
+    ~ComPtr() { InternalRelease(); }
+
+    ComPtr& operator=(const ComPtr& other)
+    {
+        ComPtr(other).Swap(*this);
+        return *this;
+    }
+
+    ComPtr& operator=(ComPtr&& other)
+    {
+        ComPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ComPtr& operator=(T* ptr)
+    {
+        ComPtr(ptr).Swap(*this);
+        return *this;
+    }
+
+    void Swap(ComPtr& other) { std::swap(m_ptr, other.m_ptr); }
+
+    T* Get() const { return m_ptr; }
+    T* operator->() const { return m_ptr; }
+    explicit operator bool() const { return m_ptr != nullptr; }
+
+    T** operator&() { InternalRelease(); return &m_ptr; }
+    T* const* GetAddressOf() const { return &m_ptr; }
+    T** ReleaseAndGetAddressOf() { InternalRelease(); return &m_ptr; }
+
+    T* Detach()
+    {
+        T* ptr = m_ptr;
+        m_ptr = nullptr;
+        return ptr;
+    }
+
+    void Reset() { InternalRelease(); }
+
+    HRESULT CopyTo(T** ppOut) const
+    {
+        RETURN_HR_IF_NULL(E_POINTER, ppOut);
+        InternalAddRef();
+        *ppOut = m_ptr;
+        return S_OK;
+    }
+};
+
+} // WRL
+} // Microsoft
+
+#endif // _WIN32
+
+#include "buffer_pool.h"
+#include "kernel_registry.h"
+
+struct D3D11_MAPPED_SUBRESOURCE
+{
+    void* pData;
+    UINT RowPitch;
+    UINT DepthPitch;
+};
+
+namespace Application
+{
+namespace Infrastructure
+{
+namespace Cpu
+{
+
+class Resource
+{
+    std::atomic<unsigned long> m_references { 1 };
+
+public:
+    virtual ~Resource() = default;
+
+    unsigned long AddRef() { return ++m_references; }
+    unsigned long Release()
+    {
+        auto references = --m_references;
+        if (references == 0)
+        {
+            delete this;
+        }
+        return references;
+    }
+};
+
+// Host memory standing in for both structured and constant buffers.
+class Buffer : public Resource
+{
+    std::vector<unsigned char> m_data;
+    unsigned m_elementSize;
+
+public:
+    Buffer(unsigned elementSize, unsigned byteWidth, const void* pInitData) :
+        m_data(byteWidth),
+        m_elementSize(elementSize)
+    {
+        if (pInitData && byteWidth != 0)
+        {
+            memcpy(m_data.data(), pInitData, byteWidth);
+        }
+    }
+
+    unsigned char* GetData() { return m_data.data(); }
+    unsigned GetByteWidth() const { return static_cast<unsigned>(m_data.size()); }
+    unsigned GetElementSize() const { return m_elementSize; }
+    unsigned GetElementCount() const { return m_elementSize == 0 ? 0 : GetByteWidth() / m_elementSize; }
+};
+
+// Views only keep their buffer alive; the CPU has no need for a separate
+// description of read and read/write access.
+class BufferView : public Resource
+{
+    Microsoft::WRL::ComPtr<Buffer> m_spBuffer;
+
+public:
+    BufferView(Buffer* pBuffer) : m_spBuffer(pBuffer) {}
+    Buffer* GetBuffer() const { return m_spBuffer.Get(); }
+};
+
+class ShaderResourceView : public BufferView { using BufferView::BufferView; };
+class UnorderedAccessView : public BufferView { using BufferView::BufferView; };
+
+// Slots bound to a single dispatch, addressed like the HLSL registers:
+// b0 for the constants, t# for the inputs and u# for the outputs.
+struct Bindings
+{
+    static const unsigned MaxSlots = 8;
+
+    unsigned char* Constants = nullptr;
+    unsigned char* ShaderResources[MaxSlots] = {};
+    unsigned ShaderResourceByteWidths[MaxSlots] = {};
+    unsigned char* UnorderedAccess[MaxSlots] = {};
+
+    template <typename T> const T& GetConstants() const { return *reinterpret_cast<const T*>(Constants); }
+    template <typename T> const T* GetInput(unsigned slot) const { return reinterpret_cast<const T*>(ShaderResources[slot]); }
+    template <typename T> unsigned GetInputCount(unsigned slot) const { return ShaderResourceByteWidths[slot] / sizeof(T); }
+    template <typename T> T* GetOutput(unsigned slot) const { return reinterpret_cast<T*>(UnorderedAccess[slot]); }
+};
+
+struct ThreadId
+{
+    unsigned x;
+    unsigned y;
+    unsigned z;
+};
+
+// Runs the threads [begin, end) of a dispatch with the given dimensions.
+typedef void (*KernelFunction)(const Bindings& bindings, uint64_t begin, uint64_t end, unsigned X, unsigned Y);
+
+// Adapts a single thread kernel, written like an HLSL CSMain, to a range of threads.
+template <void (*TMain)(const Bindings&, const ThreadId&)>
+void RunThreads(const Bindings& bindings, uint64_t begin, uint64_t end, unsigned X, unsigned Y)
+{
+    const uint64_t sliceSize = static_cast<uint64_t>(X) * Y;
+    for (auto i = begin; i < end; i++)
+    {
+        ThreadId id =
+        {
+            static_cast<unsigned>(i % X),
+            static_cast<unsigned>((i / X) % Y),
+            static_cast<unsigned>(i / sliceSize)
+        };
+        TMain(bindings, id);
+    }
+}
+
+// Implemented next to the native kernels, resolves a kernel from the shader file
+// name and the specialization constants in KernelRegistry::GetSpecializationString form.
+HRESULT FindKernel(const std::wstring& shaderName, const std::string& specialization, KernelFunction* pKernel);
+
+class ComputeShader : public Resource
+{
+    KernelFunction m_kernel;
+
+public:
+    ComputeShader(KernelFunction kernel) : m_kernel(kernel) {}
+    KernelFunction GetKernel() const { return m_kernel; }
+};
+
+} // Cpu
+
+typedef PooledBuffer<Cpu::Buffer, Cpu::ShaderResourceView> PooledDeviceBuffer;
+
+class CpuDeviceResources
+{
+#ifdef _WIN32
+    Microsoft::WRL::ComPtr<IWICImagingFactory2> m_wicFactory;
+#endif
+    // Dispatches are cut into chunks of at least this many threads so that
+    // tiny kernels do not pay for waking every core.
+    static const uint64_t MinThreadsPerChunk = 1024;
+
+    KernelRegistry<Cpu::ComputeShader> m_kernels;
+    BufferPool<Cpu::Buffer, Cpu::ShaderResourceView> m_bufferPool;
+
+public:
+
+    CpuDeviceResources()
+    {
+#ifdef _WIN32
+        CoCreateInstance(
+            CLSID_WICImagingFactory2,
+            nullptr,
+            CLSCTX_INPROC_SERVER,
+            IID_PPV_ARGS(&m_wicFactory)
+        );
+#endif
+    }
+
+    void RunComputeShader(
+        Cpu::ComputeShader* pComputeShader,
+        Cpu::Buffer* pConstantBuffer,
+        UINT nShaderResourceViews,
+        Cpu::ShaderResourceView** pShaderResourceViews,
+        std::vector<Microsoft::WRL::ComPtr<Cpu::UnorderedAccessView>> uavs,
+        UINT X,
+        UINT Y,
+        UINT Z)
+    {
+        FAIL_FAST_IF_NULL(pComputeShader);
+        FAIL_FAST_IF_TRUE(nShaderResourceViews > Cpu::Bindings::MaxSlots);
+        FAIL_FAST_IF_TRUE(uavs.size() > Cpu::Bindings::MaxSlots);
+
+        // Setup bindings
+        Cpu::Bindings bindings;
+        if (pConstantBuffer)
+        {
+            bindings.Constants = pConstantBuffer->GetData();
+        }
+        for (UINT i = 0; i < nShaderResourceViews; i++)
+        {
+            if (pShaderResourceViews[i])
+            {
+                bindings.ShaderResources[i] = pShaderResourceViews[i]->GetBuffer()->GetData();
+                bindings.ShaderResourceByteWidths[i] = pShaderResourceViews[i]->GetBuffer()->GetByteWidth();
+            }
+        }
+        for (size_t i = 0; i < uavs.size(); i++)
+        {
+            bindings.UnorderedAccess[i] = uavs[i] ? uavs[i]->GetBuffer()->GetData() : nullptr;
+        }
+
+        // Run
+        Dispatch(pComputeShader->GetKernel(), bindings, X, Y, Z);
+    }
+
+    HRESULT Map(Cpu::Buffer* pBuffer, D3D11_MAPPED_SUBRESOURCE* mappedResource)
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+        RETURN_HR_IF_NULL(E_POINTER, mappedResource);
+        mappedResource->pData = pBuffer->GetData();
+        mappedResource->RowPitch = pBuffer->GetByteWidth();
+        mappedResource->DepthPitch = pBuffer->GetByteWidth();
+        return S_OK;
+    }
+
+    HRESULT Unmap(Cpu::Buffer* pBuffer)
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+        return S_OK;
+    }
+
+    HRESULT GetBufferOnCPU(Cpu::Buffer* pBuffer, Cpu::Buffer** pCPUBuffer)
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+        RETURN_HR_IF_NULL(E_POINTER, pCPUBuffer);
+
+        // Buffers already live in host memory, no staging copy is needed.
+        pBuffer->AddRef();
+        *pCPUBuffer = pBuffer;
+        return S_OK;
+    }
+
+    HRESULT CreateComputeShader(
+        LPCWSTR pSrcFile,
+        LPCSTR pFunctionName,
+        Cpu::ComputeShader** ppShaderOut,
+        const KernelSpecialization& specialization = KernelSpecialization())
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pSrcFile);
+        return CreateKernel(pSrcFile, ppShaderOut, pFunctionName, specialization);
+    }
+
+    // Kernels are resolved by the shader file name without directory or
+    // extension, every specialization is instantiated in the kernel table
+    HRESULT CreateKernel(
+        LPCWSTR pKernelName,
+        Cpu::ComputeShader** ppShaderOut,
+        LPCSTR pFunctionName = "CSMain",
+        const KernelSpecialization& specialization = KernelSpecialization())
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pKernelName);
+        RETURN_HR_IF_NULL(E_POINTER, ppShaderOut);
+
+        return m_kernels.GetOrBuild(pKernelName, pFunctionName, specialization,
+            [&](Cpu::ComputeShader** ppShader)
+            {
+                auto id = KernelRegistry<Cpu::ComputeShader>::GetKernelId(pKernelName);
+                auto constants = KernelRegistry<Cpu::ComputeShader>::GetSpecializationString(specialization);
+
+                Cpu::KernelFunction kernel;
+                RETURN_IF_FAILED(Cpu::FindKernel(id, constants, &kernel));
+                *ppShader = new Cpu::ComputeShader(kernel);
+                return S_OK;
+            },
+            ppShaderOut);
+    }
+
+    template <typename T>
+    HRESULT CreateConstantBuffer(T& initData, Cpu::Buffer** ppBufOut)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, ppBufOut);
+        *ppBufOut = new Cpu::Buffer(0, sizeof(T), &initData);
+        return S_OK;
+    }
+
+    HRESULT CreateStructuredBuffer(UINT uElementSize, UINT uCount, const void* pInitData, Cpu::Buffer** ppBufOut)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, ppBufOut);
+        *ppBufOut = nullptr;
+        RETURN_HR_IF(E_INVALIDARG, uElementSize == 0);
+
+        *ppBufOut = new Cpu::Buffer(uElementSize, uElementSize * uCount, pInitData);
+        return S_OK;
+    }
+
+    // Input buffer with its view from the buffer pool, filled with pInitData
+    HRESULT AcquireStructuredBuffer(UINT uElementSize, UINT uCount, const void* pInitData, PooledDeviceBuffer* pBuffer)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pBuffer);
+        RETURN_IF_FAILED(m_bufferPool.Acquire(BufferUsage::Input, uElementSize, uElementSize * uCount,
+            [&](Cpu::Buffer** ppBuffer, Cpu::ShaderResourceView** ppView)
+            {
+                RETURN_IF_FAILED(CreateStructuredBuffer(uElementSize, uCount, nullptr, ppBuffer));
+                return CreateStructuredBufferSRV(*ppBuffer, ppView);
+            },
+            pBuffer));
+
+        if (pInitData && uCount != 0)
+        {
+            memcpy(pBuffer->GetBuffer()->GetData(), pInitData, uElementSize * uCount);
+        }
+        return S_OK;
+    }
+
+    template <typename T>
+    HRESULT AcquireConstantBuffer(const T& data, PooledDeviceBuffer* pBuffer)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pBuffer);
+        RETURN_IF_FAILED(m_bufferPool.Acquire(BufferUsage::Constants, 0, sizeof(T),
+            [](Cpu::Buffer** ppBuffer, Cpu::ShaderResourceView**)
+            {
+                *ppBuffer = new Cpu::Buffer(0, sizeof(T), nullptr);
+                return S_OK;
+            },
+            pBuffer));
+
+        memcpy(pBuffer->GetBuffer()->GetData(), &data, sizeof(T));
+        return S_OK;
+    }
+
+    BufferPoolStatistics GetBufferPoolStatistics()
+    {
+        return m_bufferPool.GetStatistics();
+    }
+
+    HRESULT CreateStructuredBufferSRV(Cpu::Buffer* pBuffer, Cpu::ShaderResourceView** ppSRVOut)
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+        RETURN_HR_IF_NULL(E_POINTER, ppSRVOut);
+        RETURN_HR_IF(E_INVALIDARG, pBuffer->GetElementSize() == 0);
+        *ppSRVOut = new Cpu::ShaderResourceView(pBuffer);
+        return S_OK;
+    }
+
+    HRESULT CreateStructuredBufferUAV(Cpu::Buffer* pBuffer, Cpu::UnorderedAccessView** ppUAVOut)
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+        RETURN_HR_IF_NULL(E_POINTER, ppUAVOut);
+        RETURN_HR_IF(E_INVALIDARG, pBuffer->GetElementSize() == 0);
+        *ppUAVOut = new Cpu::UnorderedAccessView(pBuffer);
+        return S_OK;
+    }
+
+#ifdef _WIN32
+    IWICImagingFactory2*         GetWicImagingFactory() const { return m_wicFactory.Get(); }
+#endif
+
+private:
+    void Dispatch(Cpu::KernelFunction kernel, const Cpu::Bindings& bindings, UINT X, UINT Y, UINT Z)
+    {
+        const uint64_t nThreads = static_cast<uint64_t>(X) * Y * Z;
+        Concurrency::ParallelFor(0, nThreads, MinThreadsPerChunk,
+            [&](uint64_t begin, uint64_t end)
+            {
+                kernel(bindings, begin, end, X, Y);
+            });
+    }
+};
+
+typedef CpuDeviceResources DeviceResources;
+
+} // Infrastructure
+} // Application
+
+// The operations are written against the D3D11 resource types,
+// map those names onto the CPU resources.
+typedef Application::Infrastructure::Cpu::Buffer                ID3D11Buffer;
+typedef Application::Infrastructure::Cpu::ShaderResourceView    ID3D11ShaderResourceView;
+typedef Application::Infrastructure::Cpu::UnorderedAccessView   ID3D11UnorderedAccessView;
+typedef Application::Infrastructure::Cpu::ComputeShader         ID3D11ComputeShader;
@@ -1,16 +1,28 @@
 #pragma once
 
+#include "buffer_pool.h"
+#include "kernel_registry.h"
+
 namespace Application
 {
 namespace Infrastructure
 {
 
+typedef PooledBuffer<ID3D11Buffer, ID3D11ShaderResourceView> PooledDeviceBuffer;
+
 class DeviceResources
 {
     Microsoft::WRL::ComPtr<ID3D11Device> m_d3dDevice;
     Microsoft::WRL::ComPtr<ID3D11DeviceContext> m_d3dDeviceContext;
     Microsoft::WRL::ComPtr<IWICImagingFactory2>	m_wicFactory;
 
+    // Operations run concurrently on the task pool, but the immediate context
+    // is not free threaded
+    std::mutex m_contextMutex;
+
+    KernelRegistry<ID3D11ComputeShader> m_kernels;
+    BufferPool<ID3D11Buffer, ID3D11ShaderResourceView> m_bufferPool;
+
 public:
 
     DeviceResources()
@@ -35,6 +47,8 @@ public:
         UINT Y,
         UINT Z)
     {
+        std::lock_guard<std::mutex> lock(m_contextMutex);
+
         // Setup shader
         m_d3dDeviceContext->CSSetShader(pComputeShader, nullptr, 0);
         if (nShaderResourceViews > 0)
@@ -78,6 +92,7 @@ public:
     {
         RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
         RETURN_HR_IF_NULL(E_POINTER, mappedResource);
+        std::lock_guard<std::mutex> lock(m_contextMutex);
         RETURN_IF_FAILED(m_d3dDeviceContext->Map(pBuffer, 0, D3D11_MAP_READ, 0, mappedResource));
         return S_OK;
     }
@@ -85,6 +100,7 @@ public:
     HRESULT Unmap(ID3D11Buffer* pBuffer)
     {
         RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+        std::lock_guard<std::mutex> lock(m_contextMutex);
         m_d3dDeviceContext->Unmap(pBuffer, 0);
         return S_OK;
     }
@@ -107,66 +123,67 @@ public:
 #if defined(_DEBUG) || defined(PROFILE)
         RETURN_IF_FAILED(spDebug->SetPrivateData(WKPDID_D3DDebugObjectName, sizeof("Debug") - 1, "Debug"));
 #endif
-        m_d3dDeviceContext->CopyResource(spDebug.Get(), pBuffer);
+        {
+            std::lock_guard<std::mutex> lock(m_contextMutex);
+            m_d3dDeviceContext->CopyResource(spDebug.Get(), pBuffer);
+        }
 
         *pCPUBuffer = spDebug.Detach();
         return S_OK;
     }
 
-    HRESULT CreateComputeShader(LPCWSTR pSrcFile, LPCSTR pFunctionName, ID3D11ComputeShader** ppShaderOut)
+    HRESULT CreateComputeShader(
+        LPCWSTR pSrcFile,
+        LPCSTR pFunctionName,
+        ID3D11ComputeShader** ppShaderOut,
+        const KernelSpecialization& specialization = KernelSpecialization())
     {
         RETURN_HR_IF_NULL(E_INVALIDARG, pSrcFile);
         RETURN_HR_IF_NULL(E_INVALIDARG, pFunctionName);
         RETURN_HR_IF_NULL(E_POINTER, ppShaderOut);
 
-        DWORD dwShaderFlags = D3DCOMPILE_ENABLE_STRICTNESS;
-#ifdef _DEBUG
-        // Set the D3DCOMPILE_DEBUG flag to embed debug information in the shaders.
-        // Setting this flag improves the shader debugging experience, but still allows 
-        // the shaders to be optimized and to run exactly the way they will run in 
-        // the release configuration of this program.
-        dwShaderFlags |= D3DCOMPILE_DEBUG;
-
-        // Disable optimizations to further improve shader debugging
-        dwShaderFlags |= D3DCOMPILE_SKIP_OPTIMIZATION;
-#endif
-
-        const D3D_SHADER_MACRO defines[] =
-        {
-            "USE_STRUCTURED_BUFFERS", "1",
-            nullptr, nullptr
-        };
-
-        // We generally prefer to use the higher CS shader profile when possible as CS 5.0 is better performance on 11-class hardware
-        LPCSTR pProfile = (m_d3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0) ? "cs_5_0" : "cs_4_0";
-
-        Microsoft::WRL::ComPtr<ID3DBlob> spErrorBlob;
-        Microsoft::WRL::ComPtr<ID3DBlob> spBlob;
-
-#if D3D_COMPILER_VERSION >= 46
-        auto hr = D3DCompileFromFile(pSrcFile, defines, D3D_COMPILE_STANDARD_FILE_INCLUDE, pFunctionName, pProfile,
-            dwShaderFlags, 0, &spBlob, &spErrorBlob);
-#else
-        auto hr = D3DX11CompileFromFile(pSrcFile, defines, nullptr, pFunctionName, pProfile,
-            dwShaderFlags, 0, nullptr, &spBlob, &spErrorBlob, nullptr);
-#endif
-
-        if (FAILED(hr) && spErrorBlob)
-        {
-            OutputDebugStringA((char*)spErrorBlob->GetBufferPointer());
-        }
-        RETURN_IF_FAILED(hr);
+        return m_kernels.GetOrBuild(pSrcFile, pFunctionName, specialization,
+            [&](ID3D11ComputeShader** ppShader)
+            {
+                return CompileComputeShader(pSrcFile, pFunctionName, specialization, ppShader);
+            },
+            ppShaderOut);
+    }
 
-        RETURN_IF_FAILED(m_d3dDevice->CreateComputeShader(spBlob->GetBufferPointer(), spBlob->GetBufferSize(), nullptr, ppShaderOut));
+    // Kernels are resolved by name. The precompiled .cso that the build places
+    // next to the executable is used when there is no specialization, otherwise
+    // Shaders\<name>.hlsl is compiled with the specialization constants defined.
+    HRESULT CreateKernel(
+        LPCWSTR pKernelName,
+        ID3D11ComputeShader** ppShaderOut,
+        LPCSTR pFunctionName = "CSMain",
+        const KernelSpecialization& specialization = KernelSpecialization())
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pKernelName);
+        RETURN_HR_IF_NULL(E_INVALIDARG, pFunctionName);
+        RETURN_HR_IF_NULL(E_POINTER, ppShaderOut);
 
-#if defined(_DEBUG) || defined(PROFILE)
-        (*ppShaderOut)->SetPrivateData(WKPDID_D3DDebugObjectName, lstrlenA(pFunctionName), pFunctionName);
-#endif
+        return m_kernels.GetOrBuild(pKernelName, pFunctionName, specialization,
+            [&](ID3D11ComputeShader** ppShader)
+            {
+                wchar_t pwzFileName[MAX_PATH + 1];
+                RETURN_HR_IF(E_FAIL, 0 == GetModuleFileName(NULL, pwzFileName, MAX_PATH + 1));
+                std::wstring directory(pwzFileName);
+                directory.erase(directory.begin() + directory.find_last_of(L'\\') + 1, directory.end());
+
+                auto id = KernelRegistry<ID3D11ComputeShader>::GetKernelId(pKernelName);
+                Microsoft::WRL::ComPtr<ID3DBlob> spBlob;
+                if (specialization.empty() && strcmp(pFunctionName, "CSMain") == 0 &&
+                    SUCCEEDED(D3DReadFileToBlob((directory + id + L".cso").c_str(), &spBlob)))
+                {
+                    return m_d3dDevice->CreateComputeShader(spBlob->GetBufferPointer(), spBlob->GetBufferSize(), nullptr, ppShader);
+                }
 
-        return S_OK;
+                return CompileComputeShader((directory + L"Shaders\\" + id + L".hlsl").c_str(), pFunctionName, specialization, ppShader);
+            },
+            ppShaderOut);
     }
 
-
     template <typename T>
     HRESULT CreateConstantBuffer(T& initData, ID3D11Buffer** ppBufOut)
     {
@@ -188,7 +205,7 @@ public:
         return m_d3dDevice->CreateBuffer(&desc, &subresourceData, ppBufOut);
     }
 
-    HRESULT CreateStructuredBuffer(UINT uElementSize, UINT uCount, void* pInitData, ID3D11Buffer** ppBufOut)
+    HRESULT CreateStructuredBuffer(UINT uElementSize, UINT uCount, const void* pInitData, ID3D11Buffer** ppBufOut)
     {
         *ppBufOut = nullptr;
 
@@ -209,6 +226,53 @@ public:
             return m_d3dDevice->CreateBuffer(&desc, nullptr, ppBufOut);
     }
 
+    // Input buffer with its view from the buffer pool, filled with pInitData
+    HRESULT AcquireStructuredBuffer(UINT uElementSize, UINT uCount, const void* pInitData, PooledDeviceBuffer* pBuffer)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pBuffer);
+        RETURN_IF_FAILED(m_bufferPool.Acquire(BufferUsage::Input, uElementSize, uElementSize * uCount,
+            [&](ID3D11Buffer** ppBuffer, ID3D11ShaderResourceView** ppView)
+            {
+                RETURN_IF_FAILED(CreateStructuredBuffer(uElementSize, uCount, nullptr, ppBuffer));
+                return CreateStructuredBufferSRV(*ppBuffer, ppView);
+            },
+            pBuffer));
+
+        if (pInitData)
+        {
+            std::lock_guard<std::mutex> lock(m_contextMutex);
+            m_d3dDeviceContext->UpdateSubresource(pBuffer->GetBuffer(), 0, nullptr, pInitData, 0, 0);
+        }
+        return S_OK;
+    }
+
+    template <typename T>
+    HRESULT AcquireConstantBuffer(const T& data, PooledDeviceBuffer* pBuffer)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pBuffer);
+        RETURN_IF_FAILED(m_bufferPool.Acquire(BufferUsage::Constants, 0, sizeof(T),
+            [&](ID3D11Buffer** ppBuffer, ID3D11ShaderResourceView**)
+            {
+                T initData = data;
+                return CreateConstantBuffer(initData, ppBuffer);
+            },
+            pBuffer));
+
+        // Constant buffers are dynamic, discarding lets the driver rename the
+        // buffer while earlier dispatches still read it
+        std::lock_guard<std::mutex> lock(m_contextMutex);
+        D3D11_MAPPED_SUBRESOURCE mappedResource;
+        RETURN_IF_FAILED(m_d3dDeviceContext->Map(pBuffer->GetBuffer(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
+        memcpy(mappedResource.pData, &data, sizeof(T));
+        m_d3dDeviceContext->Unmap(pBuffer->GetBuffer(), 0);
+        return S_OK;
+    }
+
+    BufferPoolStatistics GetBufferPoolStatistics()
+    {
+        return m_bufferPool.GetStatistics();
+    }
+
     HRESULT CreateStructuredBufferSRV(ID3D11Buffer* pBuffer, ID3D11ShaderResourceView** ppSRVOut)
     {
         D3D11_BUFFER_DESC descBuf;
@@ -252,7 +316,10 @@ public:
     {
         HRESULT hr = S_OK;
 
-        UINT uCreationFlags = D3D11_CREATE_DEVICE_SINGLETHREADED;
+        // Operations create buffers and views from pool threads at the same
+        // time, so the device has to stay free threaded. Only the immediate
+        // context is shared, behind m_contextMutex.
+        UINT uCreationFlags = 0;
 #ifdef _DEBUG
         uCreationFlags |= D3D11_CREATE_DEVICE_DEBUG;
 #endif
@@ -343,6 +410,64 @@ public:
 
     ID3D11Device*                GetD2DDevice()         const { return m_d3dDevice.Get(); }
     IWICImagingFactory2*         GetWicImagingFactory() const { return m_wicFactory.Get(); }
+
+private:
+    HRESULT CompileComputeShader(
+        LPCWSTR pSrcFile,
+        LPCSTR pFunctionName,
+        const KernelSpecialization& specialization,
+        ID3D11ComputeShader** ppShaderOut)
+    {
+        DWORD dwShaderFlags = D3DCOMPILE_ENABLE_STRICTNESS;
+#ifdef _DEBUG
+        // Set the D3DCOMPILE_DEBUG flag to embed debug information in the shaders.
+        // Setting this flag improves the shader debugging experience, but still allows 
+        // the shaders to be optimized and to run exactly the way they will run in 
+        // the release configuration of this program.
+        dwShaderFlags |= D3DCOMPILE_DEBUG;
+
+        // Disable optimizations to further improve shader debugging
+        dwShaderFlags |= D3DCOMPILE_SKIP_OPTIMIZATION;
+#endif
+
+        std::vector<D3D_SHADER_MACRO> defines =
+        {
+            { "USE_STRUCTURED_BUFFERS", "1" }
+        };
+        for (auto& constant : specialization)
+        {
+            defines.push_back({ constant.first.c_str(), constant.second.c_str() });
+        }
+        defines.push_back({ nullptr, nullptr });
+
+        // We generally prefer to use the higher CS shader profile when possible as CS 5.0 is better performance on 11-class hardware
+        LPCSTR pProfile = (m_d3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0) ? "cs_5_0" : "cs_4_0";
+
+        Microsoft::WRL::ComPtr<ID3DBlob> spErrorBlob;
+        Microsoft::WRL::ComPtr<ID3DBlob> spBlob;
+
+#if D3D_COMPILER_VERSION >= 46
+        auto hr = D3DCompileFromFile(pSrcFile, defines.data(), D3D_COMPILE_STANDARD_FILE_INCLUDE, pFunctionName, pProfile,
+            dwShaderFlags, 0, &spBlob, &spErrorBlob);
+#else
+        auto hr = D3DX11CompileFromFile(pSrcFile, defines.data(), nullptr, pFunctionName, pProfile,
+            dwShaderFlags, 0, nullptr, &spBlob, &spErrorBlob, nullptr);
+#endif
+
+        if (FAILED(hr) && spErrorBlob)
+        {
+            OutputDebugStringA((char*)spErrorBlob->GetBufferPointer());
+        }
+        RETURN_IF_FAILED(hr);
+
+        RETURN_IF_FAILED(m_d3dDevice->CreateComputeShader(spBlob->GetBufferPointer(), spBlob->GetBufferSize(), nullptr, ppShaderOut));
+
+#if defined(_DEBUG) || defined(PROFILE)
+        (*ppShaderOut)->SetPrivateData(WKPDID_D3DDebugObjectName, lstrlenA(pFunctionName), pFunctionName);
+#endif
+
+        return S_OK;
+    }
 };
 
 } // Infrastructure
@@ -0,0 +1,108 @@
+/*
+*
+*   instruction_set.h
+*
+*   Detects the widest x86 vector instructions that the processor and the OS
+*   support, so that host code can pick a SIMD path at run time.
+*
+*/
+
+#pragma once
+
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DCP_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC accepts any intrinsic without a per function target
+#define DCP_TARGET(isa)
+#else
+#include <cpuid.h>
+#define DCP_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace Application
+{
+namespace Infrastructure
+{
+
+enum class InstructionSet
+{
+    Scalar,
+    Sse2,
+    Avx2,
+    Avx512
+};
+
+#ifdef DCP_X86_SIMD
+
+inline void GetCpuid(int info[4], int leaf)
+{
+#ifdef _MSC_VER
+    __cpuidex(info, leaf, 0);
+#else
+    unsigned eax, ebx, ecx, edx;
+    __cpuid_count(leaf, 0, eax, ebx, ecx, edx);
+    info[0] = static_cast<int>(eax);
+    info[1] = static_cast<int>(ebx);
+    info[2] = static_cast<int>(ecx);
+    info[3] = static_cast<int>(edx);
+#endif
+}
+
+inline uint64_t GetEnabledXsaveFeatures()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+#endif // DCP_X86_SIMD
+
+inline InstructionSet GetInstructionSet()
+{
+#ifdef DCP_X86_SIMD
+    int info[4];
+    GetCpuid(info, 0);
+    auto highestLeaf = info[0];
+
+    GetCpuid(info, 1);
+    const int OsXsaveBit = 1 << 27;
+    const int AvxBit = 1 << 28;
+    if ((info[2] & OsXsaveBit) == 0 || (info[2] & AvxBit) == 0 || highestLeaf < 7)
+    {
+        return InstructionSet::Sse2;
+    }
+
+    // The processor having the instructions is not enough, the OS must also
+    // save the wider registers on a context switch
+    const uint64_t AvxState = 0x6;
+    const uint64_t Avx512State = 0xE6;
+    auto xsaveFeatures = GetEnabledXsaveFeatures();
+
+    GetCpuid(info, 7);
+    const int Avx2Bit = 1 << 5;
+    const int Avx512FBit = 1 << 16;
+    if ((info[1] & Avx512FBit) != 0 && (xsaveFeatures & Avx512State) == Avx512State)
+    {
+        return InstructionSet::Avx512;
+    }
+    if ((info[1] & Avx2Bit) != 0 && (xsaveFeatures & AvxState) == AvxState)
+    {
+        return InstructionSet::Avx2;
+    }
+    return InstructionSet::Sse2;
+#else
+    return InstructionSet::Scalar;
+#endif
+}
+
+} // Infrastructure
+} // Application
@@ -0,0 +1,109 @@
+/*
+*
+*   kernel_registry.h
+*
+*   Compute kernels of the process, built once and shared by every operation.
+*
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cwctype>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace Application
+{
+namespace Infrastructure
+{
+
+// Preprocessor symbols that a kernel is specialized with. Ordered by name so
+// that the same set of values always makes the same key.
+typedef std::map<std::string, std::string> KernelSpecialization;
+
+/// <summary>
+/// Kernels keyed by their id, entry point and specialization. The id is the
+/// shader file name without directory or extension, so a kernel asked for by
+/// name or by path is the same kernel. The first request builds the kernel and
+/// every later one gets a reference to it, which keeps compiling and file
+/// lookups off the paths that run once per slice or image.
+/// </summary>
+template <typename TKernel>
+class KernelRegistry
+{
+public:
+    static std::wstring GetKernelId(const std::wstring& path)
+    {
+        std::wstring id(path);
+        auto separator = id.find_last_of(L"\\/");
+        if (separator != std::wstring::npos)
+        {
+            id.erase(0, separator + 1);
+        }
+        auto extension = id.find_last_of(L'.');
+        if (extension != std::wstring::npos)
+        {
+            id.erase(extension);
+        }
+        std::transform(id.begin(), id.end(), id.begin(), [](wchar_t c) { return static_cast<wchar_t>(towlower(c)); });
+        return id;
+    }
+
+    static std::string GetSpecializationString(const KernelSpecialization& specialization)
+    {
+        std::string value;
+        for (auto& constant : specialization)
+        {
+            value += constant.first + "=" + constant.second + ";";
+        }
+        return value;
+    }
+
+    // Calls build(TKernel**) when the kernel has not been built yet
+    template <typename TBuild>
+    HRESULT GetOrBuild(
+        const std::wstring& id,
+        const char* pEntryPoint,
+        const KernelSpecialization& specialization,
+        TBuild&& build,
+        TKernel** ppKernel)
+    {
+        RETURN_HR_IF_NULL(E_INVALIDARG, pEntryPoint);
+        RETURN_HR_IF_NULL(E_POINTER, ppKernel);
+
+        std::wstring key = GetKernelId(id) + L"|";
+        for (auto pChar = pEntryPoint; *pChar; pChar++)
+        {
+            key += static_cast<wchar_t>(*pChar);
+        }
+        key += L"|";
+        for (auto c : GetSpecializationString(specialization))
+        {
+            key += static_cast<wchar_t>(c);
+        }
+
+        // Built under the lock, so two operations that start together still
+        // build a kernel only once
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& spKernel = m_kernels[key];
+        if (!spKernel)
+        {
+            auto hr = build(spKernel.ReleaseAndGetAddressOf());
+            if (FAILED(hr))
+            {
+                m_kernels.erase(key);
+                return hr;
+            }
+        }
+        return spKernel.CopyTo(ppKernel);
+    }
+
+private:
+    std::mutex m_mutex;
+    std::map<std::wstring, Microsoft::WRL::ComPtr<TKernel>> m_kernels;
+};
+
+} // Infrastructure
+} // Application
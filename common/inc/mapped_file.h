@@ -0,0 +1,136 @@
+/*
+*
+*   mapped_file.h
+*
+*   Read only memory mapping of a whole file. The mapping stays valid for the
+*   lifetime of the MappedFile object, so views handed out over its contents
+*   must not outlive it.
+*
+*/
+
+#pragma once
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Application
+{
+namespace Infrastructure
+{
+
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    HRESULT Open(const std::wstring& fileName)
+    {
+        Close();
+
+#ifdef _WIN32
+        HANDLE file = CreateFileW(
+            fileName.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+            nullptr);
+        RETURN_HR_IF(HRESULT_FROM_WIN32(GetLastError()), file == INVALID_HANDLE_VALUE);
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size))
+        {
+            auto hr = HRESULT_FROM_WIN32(GetLastError());
+            CloseHandle(file);
+            return hr;
+        }
+
+        m_size = static_cast<size_t>(size.QuadPart);
+        if (m_size != 0)
+        {
+            m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (m_mapping != nullptr)
+            {
+                m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+            }
+        }
+        CloseHandle(file);
+#else
+        int file = open(ToNativePath(fileName).c_str(), O_RDONLY);
+        RETURN_HR_IF(E_FAIL, file == -1);
+
+        struct stat status;
+        if (fstat(file, &status) != 0)
+        {
+            close(file);
+            return E_FAIL;
+        }
+
+        m_size = static_cast<size_t>(status.st_size);
+        if (m_size != 0)
+        {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, m_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(data);
+            }
+        }
+        close(file);
+#endif
+
+        if (m_size != 0 && m_data == nullptr)
+        {
+            Close();
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (m_data)
+        {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+            m_mapping = nullptr;
+        }
+#else
+        if (m_data)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const char* GetData() const { return m_data; }
+    size_t GetSize() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_mapping = nullptr;
+#endif
+};
+
+} // Infrastructure
+} // Application
@@ -0,0 +1,118 @@
+/*
+*
+*   platform.h
+*
+*   Minimal Win32 surface for building the tools on non-Windows hosts.
+*   On Windows this header only provides the path helpers; everywhere else it
+*   supplies the handful of types, macros and CRT functions that the rest of
+*   the code base uses so that it can be compiled against the CPU backend.
+*
+*/
+
+#pragma once
+
+#include <string>
+#include <filesystem>
+
+#ifdef _WIN32
+
+inline const std::wstring& ToNativePath(const std::wstring& path)
+{
+    return path;
+}
+
+#else // _WIN32
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <csignal>
+#include <strings.h>
+#include <unistd.h>
+
+// Without D3D the only available compute backend is the CPU one.
+#ifndef DCP_CPU_BACKEND
+#define DCP_CPU_BACKEND
+#endif
+
+typedef int32_t         HRESULT;
+typedef uint8_t         BYTE;
+typedef uint16_t        WORD;
+typedef uint32_t        DWORD;
+typedef uint32_t        UINT;
+typedef const char*     LPCSTR;
+typedef const wchar_t*  LPCWSTR;
+
+#define S_OK            ((HRESULT)0x00000000)
+#define S_FALSE         ((HRESULT)0x00000001)
+#define E_NOTIMPL       ((HRESULT)0x80004001)
+#define E_POINTER       ((HRESULT)0x80004003)
+#define E_FAIL          ((HRESULT)0x80004005)
+#define E_OUTOFMEMORY   ((HRESULT)0x8007000E)
+#define E_INVALIDARG    ((HRESULT)0x80070057)
+
+#define SUCCEEDED(hr)   (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)      (((HRESULT)(hr)) < 0)
+
+#define MAX_PATH 260
+
+// SAL annotations
+#define _In_
+#define _Out_
+#define _Use_decl_annotations_
+
+#define __declspec(x) DCP_DECLSPEC_##x
+#define DCP_DECLSPEC_selectany inline
+
+#define __fastfail(code)    std::abort()
+#define __debugbreak()      std::raise(SIGTRAP)
+
+#define UNREFERENCED_PARAMETER(p)   (void)(p)
+#define ZeroMemory(p, size)         memset((p), 0, (size))
+
+#define _wcsicmp    wcscasecmp
+#define _strnicmp   strncasecmp
+
+inline void OutputDebugString(const wchar_t*) {}
+inline void OutputDebugStringA(const char*) {}
+
+inline DWORD GetModuleFileName(void*, wchar_t* pwzFileName, DWORD size)
+{
+    char path[MAX_PATH + 1];
+    auto length = readlink("/proc/self/exe", path, MAX_PATH);
+    if (length <= 0 || size == 0)
+    {
+        return 0;
+    }
+    path[length] = '\0';
+    auto converted = mbstowcs(pwzFileName, path, size - 1);
+    if (converted == static_cast<size_t>(-1))
+    {
+        return 0;
+    }
+    pwzFileName[converted] = L'\0';
+    return static_cast<DWORD>(converted);
+}
+
+struct GUID
+{
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t  Data4[8];
+};
+
+typedef GUID WICPixelFormatGUID;
+
+inline const WICPixelFormatGUID GUID_WICPixelFormat32bppGrayFloat =
+    { 0x6fddc324, 0x4e03, 0x4bfe, { 0xb1, 0x85, 0x3d, 0x77, 0x76, 0x8d, 0xc9, 0x11 } };
+inline const WICPixelFormatGUID GUID_WICPixelFormat64bppRGBA =
+    { 0x6fddc324, 0x4e03, 0x4bfe, { 0xb1, 0x85, 0x3d, 0x77, 0x76, 0x8d, 0xc9, 0x16 } };
+
+inline std::string ToNativePath(const std::wstring& path)
+{
+    return std::filesystem::path(path).string();
+}
+
+#endif // _WIN32
@@ -0,0 +1,413 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "concurrentqueue.h"
+
+namespace Concurrency
+{
+
+class TaskPool;
+class TaskGroup;
+
+namespace Details
+{
+
+struct Task
+{
+    std::function<void()> Work;
+    TaskGroup* Group;
+};
+
+/// <summary>
+/// Tasks queued on one worker. The worker pushes and pops at the back, so it
+/// keeps working on what it queued last while that is still in its cache, and
+/// other threads steal from the front, where the oldest and usually largest
+/// pieces of work are.
+/// </summary>
+class TaskDeque
+{
+public:
+    void Push(Task&& task)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+
+    // Only takes a task of pGroup, or any task when pGroup is null
+    bool PopBack(const TaskGroup* pGroup, Task* pTask)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_tasks.rbegin(); it != m_tasks.rend(); ++it)
+        {
+            if (!pGroup || it->Group == pGroup)
+            {
+                *pTask = std::move(*it);
+                m_tasks.erase(std::next(it).base());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool StealFront(const TaskGroup* pGroup, Task* pTask)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_tasks.begin(); it != m_tasks.end(); ++it)
+        {
+            if (!pGroup || it->Group == pGroup)
+            {
+                *pTask = std::move(*it);
+                m_tasks.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::deque<Task> m_tasks;
+};
+
+struct WorkerIdentity
+{
+    const TaskPool* Pool = nullptr;
+    unsigned Index = 0;
+};
+
+inline WorkerIdentity& GetCurrentWorker()
+{
+    static thread_local WorkerIdentity worker;
+    return worker;
+}
+
+} // namespace Details
+
+/// <summary>
+/// Work stealing pool shared by everything that runs in the process. Work is
+/// submitted through a TaskGroup or ParallelFor. A thread that waits on a group
+/// runs the queued tasks of that group itself, so waiting from inside a task
+/// does not tie up a worker and nested parallelism cannot starve the pool.
+/// </summary>
+class TaskPool
+{
+public:
+    explicit TaskPool(unsigned nThreads) :
+        m_nThreads((std::max)(nThreads, 1u))
+    {
+        // One deque per worker, and a last one for threads outside of the pool
+        for (unsigned i = 0; i <= m_nThreads; i++)
+        {
+            m_deques.emplace_back(new Details::TaskDeque());
+        }
+
+        for (unsigned i = 0; i < m_nThreads; i++)
+        {
+            m_workers.emplace_back([this, i]() { RunWorker(i); });
+        }
+    }
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    ~TaskPool()
+    {
+        m_isStopping.store(true);
+        m_workAvailable.Notify();
+        for (auto& worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    unsigned GetThreadCount() const
+    {
+        return m_nThreads;
+    }
+
+    // The pool is created on first use with the requested number of threads,
+    // or one per core when none was requested
+    static TaskPool& GetDefault()
+    {
+        static TaskPool pool(
+            [&]()
+            {
+                GetIsDefaultCreated().store(true);
+                auto nThreads = GetRequestedThreadCount().load();
+                return nThreads != 0 ? nThreads : std::thread::hardware_concurrency();
+            }());
+        return pool;
+    }
+
+    // Must be called before the default pool is first used
+    static HRESULT SetDefaultThreadCount(unsigned nThreads)
+    {
+        RETURN_HR_IF(E_INVALIDARG, nThreads == 0);
+        RETURN_HR_IF(E_FAIL, GetIsDefaultCreated().load());
+        GetRequestedThreadCount().store(nThreads);
+        return S_OK;
+    }
+
+private:
+    friend class TaskGroup;
+
+    static std::atomic<unsigned>& GetRequestedThreadCount()
+    {
+        static std::atomic<unsigned> nThreads { 0 };
+        return nThreads;
+    }
+
+    static std::atomic<bool>& GetIsDefaultCreated()
+    {
+        static std::atomic<bool> isCreated { false };
+        return isCreated;
+    }
+
+    inline void Submit(Details::Task&& task);
+    inline bool TryRunTask(TaskGroup* pGroup);
+
+    // Workers queue on their own deque, everybody else on the shared one
+    unsigned GetHomeDeque() const
+    {
+        auto& worker = Details::GetCurrentWorker();
+        return worker.Pool == this ? worker.Index : m_nThreads;
+    }
+
+    void RunWorker(unsigned index)
+    {
+        auto& worker = Details::GetCurrentWorker();
+        worker.Pool = this;
+        worker.Index = index;
+
+        for (;;)
+        {
+            m_workAvailable.Wait(
+                [this]()
+                {
+                    return m_nQueued.load() != 0 || m_isStopping.load();
+                });
+
+            if (m_isStopping.load())
+            {
+                break;
+            }
+
+            TryRunTask(nullptr);
+        }
+    }
+
+    const unsigned m_nThreads;
+    std::vector<std::unique_ptr<Details::TaskDeque>> m_deques;
+    std::vector<std::thread> m_workers;
+
+    std::atomic<size_t> m_nQueued { 0 };
+    std::atomic<bool> m_isStopping { false };
+    Details::WaitList m_workAvailable;
+};
+
+/// <summary>
+/// Set of tasks that can be waited on together. Continuations run once every
+/// task queued before them has completed, and Wait returns once the tasks and
+/// their continuations are done.
+/// </summary>
+class TaskGroup
+{
+public:
+    explicit TaskGroup(TaskPool& pool = TaskPool::GetDefault()) :
+        m_pool(pool)
+    {
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup()
+    {
+        Wait();
+    }
+
+    template <typename TWork>
+    void Run(TWork&& work)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_nPending++;
+            m_nQueued++;
+        }
+        m_pool.Submit({ std::function<void()>(std::forward<TWork>(work)), this });
+
+        // Wake a waiter so that it can help with the new task
+        m_stateChanged.notify_all();
+    }
+
+    template <typename TContinuation>
+    void ContinueWith(TContinuation&& continuation)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_nPending != 0)
+            {
+                m_continuations.emplace_back(std::forward<TContinuation>(continuation));
+                return;
+            }
+        }
+        Run(std::forward<TContinuation>(continuation));
+    }
+
+    void Wait()
+    {
+        for (;;)
+        {
+            if (m_pool.TryRunTask(this))
+            {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_nPending == 0)
+            {
+                break;
+            }
+
+            // The remaining tasks are running elsewhere, sleep until one of
+            // them finishes or queues more work
+            m_stateChanged.wait(lock, [this]() { return m_nPending == 0 || m_nQueued != 0; });
+        }
+    }
+
+private:
+    friend class TaskPool;
+
+    void OnTaskDequeued()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_nQueued--;
+    }
+
+    void OnTaskCompleted()
+    {
+        std::vector<std::function<void()>> continuations;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_nPending == 0 && !m_continuations.empty())
+            {
+                // Count the continuations before the lock is dropped, so that
+                // nobody sees the group as done in between
+                continuations.swap(m_continuations);
+                m_nPending += continuations.size();
+                m_nQueued += continuations.size();
+            }
+
+            // Notified under the lock, a waiter that sees the group done may
+            // destroy it as soon as the lock is released
+            m_stateChanged.notify_all();
+        }
+
+        for (auto& continuation : continuations)
+        {
+            m_pool.Submit({ std::move(continuation), this });
+        }
+    }
+
+    TaskPool& m_pool;
+
+    std::mutex m_mutex;
+    std::condition_variable m_stateChanged;
+    size_t m_nPending = 0;
+    size_t m_nQueued = 0;
+    std::vector<std::function<void()>> m_continuations;
+};
+
+void TaskPool::Submit(Details::Task&& task)
+{
+    // Counted first so that the count never drops below the tasks in the deques
+    m_nQueued.fetch_add(1);
+    m_deques[GetHomeDeque()]->Push(std::move(task));
+    m_workAvailable.Notify();
+}
+
+bool TaskPool::TryRunTask(TaskGroup* pGroup)
+{
+    // Own deque first, then the shared one, then steal from the other workers
+    // starting with the next one over so that thieves spread out
+    Details::Task task;
+    auto home = GetHomeDeque();
+    bool isFound = m_deques[home]->PopBack(pGroup, &task);
+    for (unsigned i = 1; !isFound && i <= m_nThreads; i++)
+    {
+        isFound = m_deques[(home + i) % (m_nThreads + 1)]->StealFront(pGroup, &task);
+    }
+
+    if (!isFound)
+    {
+        return false;
+    }
+
+    m_nQueued.fetch_sub(1);
+    task.Group->OnTaskDequeued();
+    task.Work();
+    task.Group->OnTaskCompleted();
+    return true;
+}
+
+/// <summary>
+/// Calls body(chunkBegin, chunkEnd) over [begin, end) in chunks of at least
+/// minChunkSize items on the pool, and returns once every chunk is done. The
+/// calling thread works on the chunks as well.
+/// </summary>
+template <typename TBody>
+void ParallelFor(
+    uint64_t begin,
+    uint64_t end,
+    uint64_t minChunkSize,
+    TBody&& body,
+    TaskPool& pool = TaskPool::GetDefault())
+{
+    if (end <= begin)
+    {
+        return;
+    }
+
+    // Oversubscribe each thread a few times so uneven chunks still balance
+    const uint64_t nItems = end - begin;
+    const uint64_t nThreads = pool.GetThreadCount() + 1;
+    minChunkSize = (std::max<uint64_t>)(minChunkSize, 1);
+    uint64_t nChunks = (std::min<uint64_t>)(nThreads * 4, (nItems + minChunkSize - 1) / minChunkSize);
+    uint64_t chunkSize = (nItems + nChunks - 1) / nChunks;
+
+    // Rounding the size up can leave the last chunks empty, they are dropped so
+    // that no chunk starts past the end
+    nChunks = (nItems + chunkSize - 1) / chunkSize;
+
+    // Every runner claims chunks until none are left, a runner that starts late
+    // finds nothing to do and returns right away
+    std::atomic<uint64_t> nextChunk { 0 };
+    auto runner = [&]()
+    {
+        for (auto chunk = nextChunk++; chunk < nChunks; chunk = nextChunk++)
+        {
+            auto chunkBegin = begin + chunk * chunkSize;
+            auto chunkEnd = (std::min)(end, chunkBegin + chunkSize);
+            body(chunkBegin, chunkEnd);
+        }
+    };
+
+    TaskGroup group(pool);
+    auto nRunners = (std::min)(nThreads, nChunks);
+    for (uint64_t i = 1; i < nRunners; i++)
+    {
+        group.Run(runner);
+    }
+    runner();
+    group.Wait();
+}
+
+} // namespace Concurrency
@@ -0,0 +1,604 @@
+//
+// chunked_volume_file.h
+// The .ddc files, volumes cut into cubic chunks that are compressed one at a
+// time, so that large outputs take less disk and a region is read by
+// decompressing only the chunks it touches.
+//
+
+#pragma once
+
+namespace DCM
+{
+namespace Details
+{
+    // Byte k of every element goes to plane k. The sign and exponent bytes of
+    // neighboring floats mostly repeat, and in planes of their own they compress
+    // where the interleaved values do not.
+    inline void ShuffleBytes(const uint8_t* pSource, size_t nElements, unsigned elementSize, uint8_t* pDestination)
+    {
+        for (unsigned k = 0; k < elementSize; k++)
+        {
+            auto pPlane = pDestination + k * nElements;
+            for (size_t i = 0; i < nElements; i++)
+            {
+                pPlane[i] = pSource[i * elementSize + k];
+            }
+        }
+    }
+
+    inline void UnshuffleBytes(const uint8_t* pSource, size_t nElements, unsigned elementSize, uint8_t* pDestination)
+    {
+        for (unsigned k = 0; k < elementSize; k++)
+        {
+            auto pPlane = pSource + k * nElements;
+            for (size_t i = 0; i < nElements; i++)
+            {
+                pDestination[i * elementSize + k] = pPlane[i];
+            }
+        }
+    }
+
+    /// <summary>
+    /// Byte oriented LZ77. A block is a run of sequences, each a token whose high
+    /// nibble is the number of literals and whose low nibble is the match length
+    /// less MinMatch, where 15 means more of the length follows in bytes, ending
+    /// at the first one below 255. The literals come next, then the match as its
+    /// offset back into the output in two bytes. The last sequence has literals
+    /// only.
+    /// </summary>
+    class LzCodec
+    {
+    public:
+        static const size_t MinMatch = 4;
+        static const size_t MaxOffset = 0xFFFF;
+
+        static void Compress(const uint8_t* pSource, size_t size, std::vector<uint8_t>* pCompressed)
+        {
+            const unsigned HashBits = 14;
+
+            // Last position + 1 of every hashed 4 byte sequence, 0 for none
+            std::vector<uint32_t> table(1 << HashBits, 0);
+
+            pCompressed->clear();
+            pCompressed->reserve(size + size / 255 + 16);
+
+            size_t anchor = 0;
+            size_t position = 0;
+            while (position + MinMatch <= size)
+            {
+                auto sequence = Read32(pSource + position);
+                auto& entry = table[(sequence * 2654435761u) >> (32 - HashBits)];
+                size_t candidate = entry;
+                entry = static_cast<uint32_t>(position + 1);
+
+                if (candidate != 0 &&
+                    position - (candidate - 1) <= MaxOffset &&
+                    Read32(pSource + candidate - 1) == sequence)
+                {
+                    size_t match = candidate - 1;
+                    size_t length = MinMatch;
+                    while (position + length < size && pSource[match + length] == pSource[position + length])
+                    {
+                        length++;
+                    }
+
+                    WriteSequence(pSource + anchor, position - anchor, position - match, length, pCompressed);
+                    position += length;
+                    anchor = position;
+                }
+                else
+                {
+                    // Steps grow the longer nothing matches, so bytes that do
+                    // not repeat are passed over quickly
+                    position += 1 + ((position - anchor) >> 6);
+                }
+            }
+
+            WriteSequence(pSource + anchor, size - anchor, 0, 0, pCompressed);
+        }
+
+        static HRESULT Decompress(const uint8_t* pSource, size_t size, uint8_t* pDestination, size_t decompressedSize)
+        {
+            auto pEnd = pSource + size;
+            size_t written = 0;
+            while (pSource != pEnd)
+            {
+                unsigned token = *pSource++;
+
+                size_t nLiterals = token >> 4;
+                if (nLiterals == 15)
+                {
+                    RETURN_IF_FAILED(ReadLength(&pSource, pEnd, &nLiterals));
+                }
+                RETURN_HR_IF(E_FAIL, nLiterals > static_cast<size_t>(pEnd - pSource));
+                RETURN_HR_IF(E_FAIL, nLiterals > decompressedSize - written);
+                memcpy(pDestination + written, pSource, nLiterals);
+                pSource += nLiterals;
+                written += nLiterals;
+
+                if (pSource == pEnd)
+                {
+                    break;
+                }
+
+                RETURN_HR_IF(E_FAIL, pEnd - pSource < 2);
+                size_t offset = pSource[0] | (pSource[1] << 8);
+                pSource += 2;
+
+                size_t length = token & 0xF;
+                if (length == 15)
+                {
+                    RETURN_IF_FAILED(ReadLength(&pSource, pEnd, &length));
+                }
+                length += MinMatch;
+                RETURN_HR_IF(E_FAIL, offset == 0 || offset > written);
+                RETURN_HR_IF(E_FAIL, length > decompressedSize - written);
+
+                auto pMatch = pDestination + written - offset;
+                if (offset >= length)
+                {
+                    memcpy(pDestination + written, pMatch, length);
+                }
+                else
+                {
+                    // The match overlaps the bytes it produces, a run
+                    for (size_t i = 0; i < length; i++)
+                    {
+                        pDestination[written + i] = pMatch[i];
+                    }
+                }
+                written += length;
+            }
+
+            RETURN_HR_IF(E_FAIL, written != decompressedSize);
+            return S_OK;
+        }
+
+    private:
+        static uint32_t Read32(const uint8_t* pSource)
+        {
+            uint32_t value;
+            memcpy(&value, pSource, sizeof(value));
+            return value;
+        }
+
+        static void WriteLength(size_t length, std::vector<uint8_t>* pCompressed)
+        {
+            for (; length >= 255; length -= 255)
+            {
+                pCompressed->push_back(255);
+            }
+            pCompressed->push_back(static_cast<uint8_t>(length));
+        }
+
+        // A matchLength of 0 writes the literals only sequence that ends a block
+        static void WriteSequence(
+            const uint8_t* pLiterals,
+            size_t nLiterals,
+            size_t offset,
+            size_t matchLength,
+            std::vector<uint8_t>* pCompressed)
+        {
+            size_t extraLength = matchLength != 0 ? matchLength - MinMatch : 0;
+            pCompressed->push_back(static_cast<uint8_t>(
+                ((std::min)(nLiterals, size_t(15)) << 4) | (std::min)(extraLength, size_t(15))));
+            if (nLiterals >= 15)
+            {
+                WriteLength(nLiterals - 15, pCompressed);
+            }
+            pCompressed->insert(pCompressed->end(), pLiterals, pLiterals + nLiterals);
+
+            if (matchLength != 0)
+            {
+                pCompressed->push_back(static_cast<uint8_t>(offset & 0xFF));
+                pCompressed->push_back(static_cast<uint8_t>(offset >> 8));
+                if (extraLength >= 15)
+                {
+                    WriteLength(extraLength - 15, pCompressed);
+                }
+            }
+        }
+
+        static HRESULT ReadLength(const uint8_t** ppSource, const uint8_t* pEnd, size_t* pLength)
+        {
+            uint8_t byte;
+            do
+            {
+                RETURN_HR_IF(E_FAIL, *ppSource == pEnd);
+                byte = *(*ppSource)++;
+                *pLength += byte;
+            } while (byte == 255);
+            return S_OK;
+        }
+    };
+}
+
+/// <summary>
+/// A .ddc file. It is a header
+///     char        Magic[8]
+///     DWORD       Version
+///     DWORD       Header size, the offset of the first chunk
+///     DWORD       Width, height, depth and channels
+///     DWORD       VolumeDataType
+///     float[9]    Spacing, orientation
+///     DWORD       Edge of the chunks in voxels
+///     DWORD       Number of chunks
+///     uint64_t    Offset of the chunk index
+/// padded with zeros to HeaderSize, followed by the chunks and then the index
+/// of them, one entry per chunk
+///     uint64_t    Offset of the chunk
+///     DWORD       Size of the chunk in the file
+///     DWORD       ChunkFlags
+/// Chunks and the voxels in them go x fastest, then y, then z, and the chunks
+/// along the far faces of the volume are cut short by it. The bytes of a chunk
+/// are shuffled into planes, see ShuffleBytes, and then compressed with
+/// LzCodec unless that does not make them smaller.
+/// </summary>
+class ChunkedVolumeFile
+{
+public:
+    static const DWORD Version = 1;
+    static const unsigned ChunkSize = 64;
+
+    static HRESULT Save(const void* pData, const VolumeDescription& description, const std::wstring& fileName)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pData);
+        RETURN_HR_IF(E_INVALIDARG, description.Channels == 0);
+
+        std::ofstream stream(ToNativePath(fileName), std::ios_base::trunc | std::ios_base::binary | std::ios_base::out);
+        RETURN_HR_IF_FALSE(E_FAIL, stream.good());
+
+        // Written again at the end, once the offset of the index is known
+        char paddedHeader[HeaderSize] = {};
+        stream.write(paddedHeader, sizeof(paddedHeader));
+
+        auto nChunks = GetChunkCount(description, ChunkSize);
+        std::vector<IndexEntry> index(nChunks);
+        uint64_t offset = HeaderSize;
+
+        // Waves of chunks are compressed in parallel and written in order, so
+        // that only a wave of them is held at a time
+        auto pVoxels = static_cast<const uint8_t*>(pData);
+        uint64_t chunksPerWave = Concurrency::TaskPool::GetDefault().GetThreadCount() * 4;
+        std::vector<std::vector<uint8_t>> storedChunks(static_cast<size_t>(chunksPerWave));
+        for (uint64_t waveBegin = 0; waveBegin < nChunks; waveBegin += chunksPerWave)
+        {
+            auto waveEnd = (std::min)(waveBegin + chunksPerWave, nChunks);
+            Concurrency::ParallelFor(waveBegin, waveEnd, 1,
+                [&](uint64_t begin, uint64_t end)
+                {
+                    std::vector<uint8_t> voxels, shuffled;
+                    for (auto i = begin; i < end; i++)
+                    {
+                        index[i].Flags = CompressChunk(pVoxels, description, i, &voxels, &shuffled, &storedChunks[i - waveBegin]);
+                    }
+                });
+
+            for (auto i = waveBegin; i < waveEnd; i++)
+            {
+                auto& storedChunk = storedChunks[i - waveBegin];
+                RETURN_HR_IF(E_FAIL, storedChunk.size() > (std::numeric_limits<DWORD>::max)());
+                index[i].Offset = offset;
+                index[i].StoredSize = static_cast<DWORD>(storedChunk.size());
+                stream.write(reinterpret_cast<const char*>(storedChunk.data()), static_cast<std::streamsize>(storedChunk.size()));
+                offset += storedChunk.size();
+            }
+        }
+        stream.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size() * sizeof(IndexEntry)));
+
+        Header header = {};
+        memcpy(header.Magic, Magic, sizeof(Magic));
+        header.Version = Version;
+        header.HeaderSize = HeaderSize;
+        header.Width = description.Width;
+        header.Height = description.Height;
+        header.Depth = description.Depth;
+        header.Channels = description.Channels;
+        header.DataType = static_cast<DWORD>(description.DataType);
+        memcpy(header.Spacing, description.Spacing, sizeof(header.Spacing));
+        memcpy(header.Orientation, description.Orientation, sizeof(header.Orientation));
+        header.ChunkSize = ChunkSize;
+        header.ChunkCount = static_cast<DWORD>(nChunks);
+        header.IndexOffset = offset;
+        memcpy(paddedHeader, &header, sizeof(header));
+
+        stream.seekp(0);
+        stream.write(paddedHeader, sizeof(paddedHeader));
+        stream.close();
+        RETURN_HR_IF(E_FAIL, stream.fail());
+        return S_OK;
+    }
+
+    // Reads the header and the index, the chunks are only read by ReadRegion
+    HRESULT Open(const std::wstring& fileName)
+    {
+        m_chunkSize = 0;
+        m_index.clear();
+        RETURN_IF_FAILED(m_mappedFile.Open(fileName));
+
+        auto pData = m_mappedFile.GetData();
+        auto size = m_mappedFile.GetSize();
+        RETURN_HR_IF(E_FAIL, size < sizeof(Header) || memcmp(pData, Magic, sizeof(Magic)) != 0);
+
+        Header header;
+        memcpy(&header, pData, sizeof(header));
+        RETURN_HR_IF(E_FAIL, header.Version != Version);
+        RETURN_HR_IF(E_FAIL, header.HeaderSize < sizeof(Header));
+        RETURN_HR_IF(E_FAIL, header.ChunkSize == 0 || header.Channels == 0);
+        RETURN_HR_IF(E_FAIL,
+            header.DataType != static_cast<DWORD>(VolumeDataType::Float32) &&
+            header.DataType != static_cast<DWORD>(VolumeDataType::UInt16));
+
+        m_description.Width = header.Width;
+        m_description.Height = header.Height;
+        m_description.Depth = header.Depth;
+        m_description.Channels = header.Channels;
+        m_description.DataType = static_cast<VolumeDataType>(header.DataType);
+        memcpy(m_description.Spacing, header.Spacing, sizeof(header.Spacing));
+        memcpy(m_description.Orientation, header.Orientation, sizeof(header.Orientation));
+
+        RETURN_HR_IF(E_FAIL, header.ChunkCount != GetChunkCount(m_description, header.ChunkSize));
+        RETURN_HR_IF(E_FAIL, header.IndexOffset > size);
+        RETURN_HR_IF(E_FAIL, (size - header.IndexOffset) / sizeof(IndexEntry) < header.ChunkCount);
+
+        std::vector<IndexEntry> index(header.ChunkCount);
+        memcpy(index.data(), pData + header.IndexOffset, index.size() * sizeof(IndexEntry));
+        for (auto& entry : index)
+        {
+            RETURN_HR_IF(E_FAIL, entry.Offset > size || size - entry.Offset < entry.StoredSize);
+        }
+
+        m_index = std::move(index);
+        m_chunkSize = header.ChunkSize;
+        return S_OK;
+    }
+
+    const VolumeDescription& GetDescription() const
+    {
+        return m_description;
+    }
+
+    // The whole volume, as the mosaic of VolumeDescription
+    HRESULT Read(void* pData) const
+    {
+        return ReadRegion(0, 0, 0, m_description.Width, m_description.Height, m_description.Depth, pData);
+    }
+
+    /// <summary>
+    /// Voxels of the box of width x height x depth at (x, y, z), written to
+    /// pData as a mosaic of the box itself. The chunks it touches are
+    /// decompressed in parallel, and no others are read.
+    /// </summary>
+    HRESULT ReadRegion(unsigned x, unsigned y, unsigned z, unsigned width, unsigned height, unsigned depth, void* pData) const
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pData);
+        RETURN_HR_IF(E_FAIL, m_chunkSize == 0);
+        RETURN_HR_IF(E_INVALIDARG, static_cast<uint64_t>(x) + width > m_description.Width);
+        RETURN_HR_IF(E_INVALIDARG, static_cast<uint64_t>(y) + height > m_description.Height);
+        RETURN_HR_IF(E_INVALIDARG, static_cast<uint64_t>(z) + depth > m_description.Depth);
+        if (width == 0 || height == 0 || depth == 0)
+        {
+            return S_OK;
+        }
+
+        Box region = { { x, y, z }, { width, height, depth } };
+        unsigned chunkCounts[3];
+        GetChunkCounts(m_description, m_chunkSize, chunkCounts);
+
+        unsigned firstChunk[3];
+        unsigned regionChunks[3];
+        for (unsigned i = 0; i < 3; i++)
+        {
+            firstChunk[i] = region.Origin[i] / m_chunkSize;
+            regionChunks[i] = (region.Origin[i] + region.Size[i] - 1) / m_chunkSize - firstChunk[i] + 1;
+        }
+
+        auto pOutput = static_cast<uint8_t*>(pData);
+        auto bytesPerVoxel = m_description.GetBytesPerVoxel();
+        uint64_t nRegionChunks = static_cast<uint64_t>(regionChunks[0]) * regionChunks[1] * regionChunks[2];
+        std::atomic<bool> isFailed { false };
+
+        Concurrency::ParallelFor(0, nRegionChunks, 1,
+            [&](uint64_t begin, uint64_t end)
+            {
+                std::vector<uint8_t> shuffled, voxels;
+                for (auto i = begin; i < end && !isFailed.load(); i++)
+                {
+                    uint64_t chunkX = firstChunk[0] + i % regionChunks[0];
+                    uint64_t chunkY = firstChunk[1] + i / regionChunks[0] % regionChunks[1];
+                    uint64_t chunkZ = firstChunk[2] + i / (static_cast<uint64_t>(regionChunks[0]) * regionChunks[1]);
+                    auto chunkIndex = (chunkZ * chunkCounts[1] + chunkY) * chunkCounts[0] + chunkX;
+
+                    if (FAILED(DecompressChunk(chunkIndex, &shuffled, &voxels)))
+                    {
+                        isFailed.store(true);
+                        break;
+                    }
+
+                    auto chunk = GetChunkBox(m_description, m_chunkSize, chunkIndex);
+                    ForEachRow(chunk, region,
+                        [&](size_t chunkOffset, size_t mosaicOffset, size_t count)
+                        {
+                            memcpy(pOutput + mosaicOffset * bytesPerVoxel, voxels.data() + chunkOffset * bytesPerVoxel, count * bytesPerVoxel);
+                        });
+                }
+            });
+
+        RETURN_HR_IF(E_FAIL, isFailed.load());
+        return S_OK;
+    }
+
+private:
+    static constexpr char Magic[8] = { 'D', 'C', 'P', 'C', 'H', 'N', 'K', '\0' };
+    static const DWORD HeaderSize = 128;
+
+    enum ChunkFlags : DWORD
+    {
+        // Without it the shuffled bytes are stored as they are
+        Compressed = 1
+    };
+
+    struct Header
+    {
+        char Magic[8];
+        DWORD Version;
+        DWORD HeaderSize;
+        DWORD Width;
+        DWORD Height;
+        DWORD Depth;
+        DWORD Channels;
+        DWORD DataType;
+        float Spacing[3];
+        float Orientation[6];
+        DWORD ChunkSize;
+        DWORD ChunkCount;
+        uint64_t IndexOffset;
+    };
+    static_assert(sizeof(Header) <= HeaderSize, "The header must fit before the chunks");
+
+    struct IndexEntry
+    {
+        uint64_t Offset;
+        DWORD StoredSize;
+        DWORD Flags;
+    };
+    static_assert(sizeof(IndexEntry) == 16, "Index entries are written as they are laid out");
+
+    struct Box
+    {
+        unsigned Origin[3];
+        unsigned Size[3];
+    };
+
+    static void GetChunkCounts(const VolumeDescription& description, unsigned chunkSize, unsigned counts[3])
+    {
+        counts[0] = (description.Width + chunkSize - 1) / chunkSize;
+        counts[1] = (description.Height + chunkSize - 1) / chunkSize;
+        counts[2] = (description.Depth + chunkSize - 1) / chunkSize;
+    }
+
+    static uint64_t GetChunkCount(const VolumeDescription& description, unsigned chunkSize)
+    {
+        unsigned counts[3];
+        GetChunkCounts(description, chunkSize, counts);
+        return static_cast<uint64_t>(counts[0]) * counts[1] * counts[2];
+    }
+
+    static Box GetChunkBox(const VolumeDescription& description, unsigned chunkSize, uint64_t chunkIndex)
+    {
+        unsigned counts[3];
+        GetChunkCounts(description, chunkSize, counts);
+        const unsigned extents[3] = { description.Width, description.Height, description.Depth };
+
+        uint64_t coordinates[3] =
+        {
+            chunkIndex % counts[0],
+            chunkIndex / counts[0] % counts[1],
+            chunkIndex / (static_cast<uint64_t>(counts[0]) * counts[1])
+        };
+
+        Box box;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            box.Origin[i] = static_cast<unsigned>(coordinates[i]) * chunkSize;
+            box.Size[i] = (std::min)(chunkSize, extents[i] - box.Origin[i]);
+        }
+        return box;
+    }
+
+    // Calls copyRow(chunkOffset, mosaicOffset, count) for every row of voxels
+    // that the chunk and the region share, with the offsets in voxels into the
+    // chunk and into the mosaic of the region
+    template <typename TCopyRow>
+    static void ForEachRow(const Box& chunk, const Box& region, TCopyRow&& copyRow)
+    {
+        unsigned begin[3], end[3];
+        for (unsigned i = 0; i < 3; i++)
+        {
+            begin[i] = (std::max)(chunk.Origin[i], region.Origin[i]);
+            end[i] = (std::min)(chunk.Origin[i] + chunk.Size[i], region.Origin[i] + region.Size[i]);
+            if (begin[i] >= end[i])
+            {
+                return;
+            }
+        }
+
+        for (auto z = begin[2]; z < end[2]; z++)
+        {
+            for (auto y = begin[1]; y < end[1]; y++)
+            {
+                auto chunkOffset =
+                    (static_cast<size_t>(z - chunk.Origin[2]) * chunk.Size[1] + (y - chunk.Origin[1])) * chunk.Size[0] +
+                    (begin[0] - chunk.Origin[0]);
+                auto mosaicOffset =
+                    (static_cast<size_t>(y - region.Origin[1]) * region.Size[2] + (z - region.Origin[2])) * region.Size[0] +
+                    (begin[0] - region.Origin[0]);
+                copyRow(chunkOffset, mosaicOffset, static_cast<size_t>(end[0] - begin[0]));
+            }
+        }
+    }
+
+    static DWORD CompressChunk(
+        const uint8_t* pVolume,
+        const VolumeDescription& description,
+        uint64_t chunkIndex,
+        std::vector<uint8_t>* pVoxels,
+        std::vector<uint8_t>* pShuffled,
+        std::vector<uint8_t>* pStored)
+    {
+        auto chunk = GetChunkBox(description, ChunkSize, chunkIndex);
+        Box volume = { { 0, 0, 0 }, { description.Width, description.Height, description.Depth } };
+        auto bytesPerVoxel = description.GetBytesPerVoxel();
+        size_t chunkBytes = static_cast<size_t>(chunk.Size[0]) * chunk.Size[1] * chunk.Size[2] * bytesPerVoxel;
+
+        pVoxels->resize(chunkBytes);
+        ForEachRow(chunk, volume,
+            [&](size_t chunkOffset, size_t mosaicOffset, size_t count)
+            {
+                memcpy(pVoxels->data() + chunkOffset * bytesPerVoxel, pVolume + mosaicOffset * bytesPerVoxel, count * bytesPerVoxel);
+            });
+
+        auto elementSize = GetDataTypeSize(description.DataType);
+        pShuffled->resize(chunkBytes);
+        Details::ShuffleBytes(pVoxels->data(), chunkBytes / elementSize, elementSize, pShuffled->data());
+
+        Details::LzCodec::Compress(pShuffled->data(), chunkBytes, pStored);
+        if (pStored->size() >= chunkBytes)
+        {
+            pStored->assign(pShuffled->begin(), pShuffled->end());
+            return 0;
+        }
+        return Compressed;
+    }
+
+    HRESULT DecompressChunk(uint64_t chunkIndex, std::vector<uint8_t>* pShuffled, std::vector<uint8_t>* pVoxels) const
+    {
+        auto& entry = m_index[static_cast<size_t>(chunkIndex)];
+        auto chunk = GetChunkBox(m_description, m_chunkSize, chunkIndex);
+        size_t chunkBytes = static_cast<size_t>(chunk.Size[0]) * chunk.Size[1] * chunk.Size[2] * m_description.GetBytesPerVoxel();
+        auto pStored = reinterpret_cast<const uint8_t*>(m_mappedFile.GetData()) + entry.Offset;
+
+        pShuffled->resize(chunkBytes);
+        if ((entry.Flags & Compressed) != 0)
+        {
+            RETURN_IF_FAILED(Details::LzCodec::Decompress(pStored, entry.StoredSize, pShuffled->data(), chunkBytes));
+        }
+        else
+        {
+            RETURN_HR_IF(E_FAIL, entry.StoredSize != chunkBytes);
+            memcpy(pShuffled->data(), pStored, chunkBytes);
+        }
+
+        auto elementSize = GetDataTypeSize(m_description.DataType);
+        pVoxels->resize(chunkBytes);
+        Details::UnshuffleBytes(pShuffled->data(), chunkBytes / elementSize, elementSize, pVoxels->data());
+        return S_OK;
+    }
+
+    Application::Infrastructure::MappedFile m_mappedFile;
+    VolumeDescription m_description;
+    unsigned m_chunkSize = 0;
+    std::vector<IndexEntry> m_index;
+};
+
+} // DCM
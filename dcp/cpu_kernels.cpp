@@ -0,0 +1,702 @@
+#include "precomp.h"
+
+#ifdef DCP_CPU_BACKEND
+
+#include <cmath>
+
+using namespace Application::Infrastructure::Cpu;
+
+//
+// Native ports of Shaders\*.hlsl for the CPU backend.
+// Each kernel is the body of one CSMain thread, RunThreads adapts it to a
+// range of the dispatch.
+//
+
+namespace
+{
+
+// Shaders\add_images.hlsl
+void AddImages(const Bindings& bindings, const ThreadId& id)
+{
+    struct Constants
+    {
+        float Factor;
+        unsigned UNUSED[3];
+    };
+    auto& constants = bindings.GetConstants<Constants>();
+
+    bindings.GetOutput<float>(0)[id.x] =
+        bindings.GetInput<float>(0)[id.x] + (bindings.GetInput<float>(1)[id.x] * constants.Factor);
+}
+
+// Shaders\convert_to_float.hlsl
+void ConvertToFloat(const Bindings& bindings, const ThreadId& id)
+{
+    struct Constants
+    {
+        unsigned Columns;
+        unsigned UNUSED[3];
+    };
+    auto& constants = bindings.GetConstants<Constants>();
+
+    // The shader unpacks two 16 bit pixels from each uint, which on the CPU
+    // is simply the pixel at the same index.
+    unsigned index = id.x * constants.Columns + id.y;
+    bindings.GetOutput<float>(0)[index] = static_cast<float>(bindings.GetInput<unsigned short>(0)[index]);
+}
+
+// Shaders\divide_images.hlsl
+void DivideImages(const Bindings& bindings, const ThreadId& id)
+{
+    struct Constants
+    {
+        float Factor;
+    };
+    auto& constants = bindings.GetConstants<Constants>();
+
+    float epsilon = .000000000000000001f;
+    float in1 = logf(bindings.GetInput<float>(0)[id.x] + epsilon);
+    float in2 = logf(bindings.GetInput<float>(1)[id.x] + epsilon);
+    bindings.GetOutput<float>(0)[id.x] = expf(in1 - in2) * constants.Factor;
+}
+
+// Shaders\multiply_images.hlsl
+void MultiplyImages(const Bindings& bindings, const ThreadId& id)
+{
+    bindings.GetOutput<float>(0)[id.x] = bindings.GetInput<float>(0)[id.x] * bindings.GetInput<float>(1)[id.x];
+}
+
+// Shaders\sqrt_image.hlsl
+void SqrtImage(const Bindings& bindings, const ThreadId& id)
+{
+    auto out = bindings.GetOutput<float>(0);
+    out[id.x] = sqrtf(out[id.x]);
+}
+
+// Shaders\square_image.hlsl
+void SquareImage(const Bindings& bindings, const ThreadId& id)
+{
+    auto out = bindings.GetOutput<float>(0);
+    out[id.x] = out[id.x] * out[id.x];
+}
+
+struct VoxelizeConstants
+{
+    unsigned INPUT_R;
+    unsigned INPUT_C;
+    unsigned INPUT_D;
+    unsigned OUTPUT_R;
+    unsigned OUTPUT_C;
+    unsigned OUTPUT_D;
+    float SPACING_X;
+    float SPACING_Y;
+    float SPACING_Z;
+    float VOXEL_SPACING_X;
+    float VOXEL_SPACING_Y;
+    float VOXEL_SPACING_Z;
+};
+
+// Shaders\voxelize_mean.hlsl specialized with FLOAT_PIXELS, the unsigned short
+// pixels of the unspecialized kernel go through VoxelizeMean16 instead
+template <typename TPixel>
+void VoxelizeMean(const Bindings& bindings, const ThreadId& id)
+{
+    auto& constants = bindings.GetConstants<VoxelizeConstants>();
+
+    // Only the slab of voxels that the slice falls in is dispatched, with one
+    // thread per column and row
+    auto depth = static_cast<unsigned>(floorf(constants.INPUT_D * constants.SPACING_Z / constants.VOXEL_SPACING_Z));
+    if (depth >= constants.OUTPUT_D || id.x >= constants.OUTPUT_C || id.y >= constants.OUTPUT_R)
+    {
+        return;
+    }
+
+    unsigned row = id.y;
+    unsigned column = id.x;
+    unsigned voxel = (row * constants.OUTPUT_C * constants.OUTPUT_D) + (depth * constants.OUTPUT_C) + column;
+
+    auto pixels = bindings.GetInput<TPixel>(0);
+    auto nPixels = bindings.GetInputCount<TPixel>(0);
+
+    float aggregator = 0;
+    float aggregatorSquared = 0;
+    auto inputStartRow    = static_cast<unsigned>(floorf(row * constants.VOXEL_SPACING_Y / constants.SPACING_Y));
+    auto inputEndRow      = static_cast<unsigned>(floorf((row + 1) * constants.VOXEL_SPACING_Y / constants.SPACING_Y));
+    auto inputStartColumn = static_cast<unsigned>(floorf(column * constants.VOXEL_SPACING_X / constants.SPACING_X));
+    auto inputEndColumn   = static_cast<unsigned>(floorf((column + 1) * constants.VOXEL_SPACING_X / constants.SPACING_X));
+
+    for (unsigned r = inputStartRow; r < inputEndRow; r++)
+    {
+        for (unsigned c = inputStartColumn; c < inputEndColumn; c++)
+        {
+            // Out of bounds reads of a structured buffer return 0
+            unsigned index = r * constants.INPUT_C + c;
+            float value = index < nPixels ? static_cast<float>(pixels[index]) : 0.f;
+
+            aggregator += value;
+            aggregatorSquared += (value * value);
+        }
+    }
+
+    auto means = bindings.GetOutput<float>(0);
+    auto counts = bindings.GetOutput<unsigned>(1);
+    auto meansSquared = bindings.GetOutput<float>(2);
+
+    unsigned nCount = (inputEndRow - inputStartRow) * (inputEndColumn - inputStartColumn);
+    means[voxel] = ((counts[voxel] * means[voxel]) + aggregator) / static_cast<float>(counts[voxel] + nCount);
+    if (meansSquared)
+    {
+        meansSquared[voxel] = ((counts[voxel] * meansSquared[voxel]) + aggregatorSquared) / static_cast<float>(counts[voxel] + nCount);
+    }
+    counts[voxel] += nCount;
+}
+
+//
+// Rows of 16 bit pixels are added onto per column sums and sums of squares in
+// exact integers, and the rows of two paired slices onto the sums of their
+// products. The widest instruction set the processor supports is picked the
+// first time a row is added.
+//
+
+typedef void (*AccumulateRowFunction)(const unsigned short* pixels, unsigned count, uint32_t* sums, uint64_t* squares);
+typedef void (*AccumulateProductRowFunction)(const unsigned short* xPixels, const unsigned short* yPixels, unsigned count, uint64_t* products);
+
+void AccumulateRowScalar(const unsigned short* pixels, unsigned count, uint32_t* sums, uint64_t* squares)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        // The square of a 16 bit value still fits in 32 bits
+        uint32_t value = pixels[i];
+        sums[i] += value;
+        squares[i] += value * value;
+    }
+}
+
+void AccumulateProductRowScalar(const unsigned short* xPixels, const unsigned short* yPixels, unsigned count, uint64_t* products)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        products[i] += static_cast<uint32_t>(xPixels[i]) * yPixels[i];
+    }
+}
+
+#ifdef DCP_X86_SIMD
+
+void AccumulateRowSse2(const unsigned short* pixels, unsigned count, uint32_t* sums, uint64_t* squares)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+
+        auto pSums = reinterpret_cast<__m128i*>(sums + i);
+        _mm_storeu_si128(pSums, _mm_add_epi32(_mm_loadu_si128(pSums), _mm_unpacklo_epi16(values, zero)));
+        _mm_storeu_si128(pSums + 1, _mm_add_epi32(_mm_loadu_si128(pSums + 1), _mm_unpackhi_epi16(values, zero)));
+
+        // SSE2 has no 32 bit multiply, interleave the low and high halves of
+        // the 16 bit products instead
+        __m128i productsLow = _mm_mullo_epi16(values, values);
+        __m128i productsHigh = _mm_mulhi_epu16(values, values);
+        __m128i products[2] =
+        {
+            _mm_unpacklo_epi16(productsLow, productsHigh),
+            _mm_unpackhi_epi16(productsLow, productsHigh)
+        };
+
+        auto pSquares = reinterpret_cast<__m128i*>(squares + i);
+        for (unsigned j = 0; j < 2; j++)
+        {
+            _mm_storeu_si128(pSquares, _mm_add_epi64(_mm_loadu_si128(pSquares), _mm_unpacklo_epi32(products[j], zero)));
+            _mm_storeu_si128(pSquares + 1, _mm_add_epi64(_mm_loadu_si128(pSquares + 1), _mm_unpackhi_epi32(products[j], zero)));
+            pSquares += 2;
+        }
+    }
+
+    AccumulateRowScalar(pixels + i, count - i, sums + i, squares + i);
+}
+
+void AccumulateProductRowSse2(const unsigned short* xPixels, const unsigned short* yPixels, unsigned count, uint64_t* products)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i xValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(xPixels + i));
+        __m128i yValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(yPixels + i));
+
+        __m128i productsLow = _mm_mullo_epi16(xValues, yValues);
+        __m128i productsHigh = _mm_mulhi_epu16(xValues, yValues);
+        __m128i widened[2] =
+        {
+            _mm_unpacklo_epi16(productsLow, productsHigh),
+            _mm_unpackhi_epi16(productsLow, productsHigh)
+        };
+
+        auto pProducts = reinterpret_cast<__m128i*>(products + i);
+        for (unsigned j = 0; j < 2; j++)
+        {
+            _mm_storeu_si128(pProducts, _mm_add_epi64(_mm_loadu_si128(pProducts), _mm_unpacklo_epi32(widened[j], zero)));
+            _mm_storeu_si128(pProducts + 1, _mm_add_epi64(_mm_loadu_si128(pProducts + 1), _mm_unpackhi_epi32(widened[j], zero)));
+            pProducts += 2;
+        }
+    }
+
+    AccumulateProductRowScalar(xPixels + i, yPixels + i, count - i, products + i);
+}
+
+DCP_TARGET("avx2")
+void AccumulateRowAvx2(const unsigned short* pixels, unsigned count, uint32_t* sums, uint64_t* squares)
+{
+    unsigned i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+        __m256i widened[2] =
+        {
+            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(values)),
+            _mm256_cvtepu16_epi32(_mm256_extracti128_si256(values, 1))
+        };
+
+        auto pSums = reinterpret_cast<__m256i*>(sums + i);
+        auto pSquares = reinterpret_cast<__m256i*>(squares + i);
+        for (unsigned j = 0; j < 2; j++)
+        {
+            _mm256_storeu_si256(pSums + j, _mm256_add_epi32(_mm256_loadu_si256(pSums + j), widened[j]));
+
+            __m256i products = _mm256_mullo_epi32(widened[j], widened[j]);
+            _mm256_storeu_si256(pSquares, _mm256_add_epi64(_mm256_loadu_si256(pSquares), _mm256_cvtepu32_epi64(_mm256_castsi256_si128(products))));
+            _mm256_storeu_si256(pSquares + 1, _mm256_add_epi64(_mm256_loadu_si256(pSquares + 1), _mm256_cvtepu32_epi64(_mm256_extracti128_si256(products, 1))));
+            pSquares += 2;
+        }
+    }
+
+    AccumulateRowScalar(pixels + i, count - i, sums + i, squares + i);
+}
+
+DCP_TARGET("avx2")
+void AccumulateProductRowAvx2(const unsigned short* xPixels, const unsigned short* yPixels, unsigned count, uint64_t* products)
+{
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i xValues = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(xPixels + i)));
+        __m256i yValues = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(yPixels + i)));
+        __m256i widened = _mm256_mullo_epi32(xValues, yValues);
+
+        auto pProducts = reinterpret_cast<__m256i*>(products + i);
+        _mm256_storeu_si256(pProducts, _mm256_add_epi64(_mm256_loadu_si256(pProducts), _mm256_cvtepu32_epi64(_mm256_castsi256_si128(widened))));
+        _mm256_storeu_si256(pProducts + 1, _mm256_add_epi64(_mm256_loadu_si256(pProducts + 1), _mm256_cvtepu32_epi64(_mm256_extracti128_si256(widened, 1))));
+    }
+
+    AccumulateProductRowScalar(xPixels + i, yPixels + i, count - i, products + i);
+}
+
+// The unmasked AVX-512 conversions, extracts and casts start from an undefined
+// vector in the GCC headers, which -Wmaybe-uninitialized reports. The zero
+// masked forms with every lane kept compute the same and start from zeros.
+const __mmask16 AllLanes32 = 0xFFFF;
+const __mmask8 AllLanes64 = 0xFF;
+
+DCP_TARGET("avx512f")
+void AccumulateRowAvx512(const unsigned short* pixels, unsigned count, uint32_t* sums, uint64_t* squares)
+{
+    unsigned i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512i widened = _mm512_maskz_cvtepu16_epi32(AllLanes32, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i)));
+        _mm512_storeu_si512(sums + i, _mm512_add_epi32(_mm512_loadu_si512(sums + i), widened));
+
+        __m512i products = _mm512_mullo_epi32(widened, widened);
+        _mm512_storeu_si512(squares + i, _mm512_add_epi64(_mm512_loadu_si512(squares + i), _mm512_maskz_cvtepu32_epi64(AllLanes64, _mm512_maskz_extracti64x4_epi64(AllLanes64, products, 0))));
+        _mm512_storeu_si512(squares + i + 8, _mm512_add_epi64(_mm512_loadu_si512(squares + i + 8), _mm512_maskz_cvtepu32_epi64(AllLanes64, _mm512_maskz_extracti64x4_epi64(AllLanes64, products, 1))));
+    }
+
+    AccumulateRowScalar(pixels + i, count - i, sums + i, squares + i);
+}
+
+DCP_TARGET("avx512f")
+void AccumulateProductRowAvx512(const unsigned short* xPixels, const unsigned short* yPixels, unsigned count, uint64_t* products)
+{
+    unsigned i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512i xValues = _mm512_maskz_cvtepu16_epi32(AllLanes32, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(xPixels + i)));
+        __m512i yValues = _mm512_maskz_cvtepu16_epi32(AllLanes32, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(yPixels + i)));
+        __m512i widened = _mm512_mullo_epi32(xValues, yValues);
+
+        _mm512_storeu_si512(products + i, _mm512_add_epi64(_mm512_loadu_si512(products + i), _mm512_maskz_cvtepu32_epi64(AllLanes64, _mm512_maskz_extracti64x4_epi64(AllLanes64, widened, 0))));
+        _mm512_storeu_si512(products + i + 8, _mm512_add_epi64(_mm512_loadu_si512(products + i + 8), _mm512_maskz_cvtepu32_epi64(AllLanes64, _mm512_maskz_extracti64x4_epi64(AllLanes64, widened, 1))));
+    }
+
+    AccumulateProductRowScalar(xPixels + i, yPixels + i, count - i, products + i);
+}
+
+#endif // DCP_X86_SIMD
+
+using Application::Infrastructure::InstructionSet;
+using Application::Infrastructure::GetInstructionSet;
+
+AccumulateRowFunction SelectAccumulateRow()
+{
+    switch (GetInstructionSet())
+    {
+#ifdef DCP_X86_SIMD
+    case InstructionSet::Avx512: return AccumulateRowAvx512;
+    case InstructionSet::Avx2: return AccumulateRowAvx2;
+    case InstructionSet::Sse2: return AccumulateRowSse2;
+#endif
+    default: return AccumulateRowScalar;
+    }
+}
+
+AccumulateProductRowFunction SelectAccumulateProductRow()
+{
+    switch (GetInstructionSet())
+    {
+#ifdef DCP_X86_SIMD
+    case InstructionSet::Avx512: return AccumulateProductRowAvx512;
+    case InstructionSet::Avx2: return AccumulateProductRowAvx2;
+    case InstructionSet::Sse2: return AccumulateProductRowSse2;
+#endif
+    default: return AccumulateProductRowScalar;
+    }
+}
+
+// Exact sums over the pixels of a slice that fall in one voxel. The y sums are
+// only kept for a pair of slices.
+struct VoxelSums
+{
+    uint64_t X;
+    uint64_t XX;
+    uint64_t Y;
+    uint64_t YY;
+    uint64_t XY;
+};
+
+// Column sums of the window under one row of voxels. Every pool thread keeps its
+// own, which grow to the widest window once and are reused by the dispatches of
+// every slice after that.
+struct SlabColumnSums
+{
+    std::vector<uint32_t> Sums;
+    std::vector<uint64_t> Squares;
+    std::vector<uint32_t> YSums;
+    std::vector<uint64_t> YSquares;
+    std::vector<uint64_t> Products;
+};
+
+// Runs over whole rows of the slab at a time, for the unsigned short pixels of
+// Shaders\voxelize_mean.hlsl, Shaders\voxelize_stddev.hlsl and, with TPaired and
+// a second slice in t1, Shaders\voxelize_ssim.hlsl. The dispatch has one thread
+// per column and row of the slab that the slice falls in. The input rows under
+// a row of voxels are first summed per column, then each voxel adds up the
+// columns it covers and hands its exact sums to accumulate.
+template <bool TPaired, typename TAccumulate>
+void ForEachVoxelInSlab16(const Bindings& bindings, uint64_t begin, uint64_t end, unsigned X, TAccumulate&& accumulate)
+{
+    static const AccumulateRowFunction AccumulateRow = SelectAccumulateRow();
+    static const AccumulateProductRowFunction AccumulateProductRow = SelectAccumulateProductRow();
+
+    auto& constants = bindings.GetConstants<VoxelizeConstants>();
+
+    auto depth = static_cast<unsigned>(floorf(constants.INPUT_D * constants.SPACING_Z / constants.VOXEL_SPACING_Z));
+    if (depth >= constants.OUTPUT_D)
+    {
+        return;
+    }
+
+    // Same rounding as the shader, so that every pixel lands in the same voxel
+    auto getInputRow = [&](unsigned row) { return static_cast<unsigned>(floorf(row * constants.VOXEL_SPACING_Y / constants.SPACING_Y)); };
+    auto getInputColumn = [&](unsigned column) { return static_cast<unsigned>(floorf(column * constants.VOXEL_SPACING_X / constants.SPACING_X)); };
+
+    auto pixels = bindings.GetInput<unsigned short>(0);
+    auto nPixels = bindings.GetInputCount<unsigned short>(0);
+    auto yPixels = TPaired ? bindings.GetInput<unsigned short>(1) : nullptr;
+    if (TPaired)
+    {
+        nPixels = (std::min)(nPixels, bindings.GetInputCount<unsigned short>(1));
+    }
+
+    static thread_local SlabColumnSums columnSums;
+    auto& sums = columnSums.Sums;
+    auto& squares = columnSums.Squares;
+    auto& ySums = columnSums.YSums;
+    auto& ySquares = columnSums.YSquares;
+    auto& products = columnSums.Products;
+
+    const unsigned nColumns = (std::min)(X, static_cast<unsigned>(constants.OUTPUT_C));
+    for (auto row = begin / X; row * X < end && row < constants.OUTPUT_R; row++)
+    {
+        auto firstColumn = static_cast<unsigned>((std::max)(begin, row * X) - row * X);
+        auto lastColumn = static_cast<unsigned>((std::min)(end, (row + 1) * X) - row * X);
+        lastColumn = (std::min)(lastColumn, nColumns);
+        if (firstColumn >= lastColumn)
+        {
+            continue;
+        }
+
+        auto rowBegin = row * constants.OUTPUT_C * constants.OUTPUT_D + static_cast<uint64_t>(depth) * constants.OUTPUT_C;
+        auto inputStartRow = getInputRow(static_cast<unsigned>(row));
+        auto inputEndRow = getInputRow(static_cast<unsigned>(row + 1));
+        auto windowStart = getInputColumn(firstColumn);
+        auto windowEnd = getInputColumn(lastColumn);
+        auto windowWidth = windowEnd - windowStart;
+
+        // Columns past the end of the image read on into the next row, like the
+        // flat index of the shader does, and reads past the buffer are 0
+        sums.assign(windowWidth, 0);
+        squares.assign(windowWidth, 0);
+        if (TPaired)
+        {
+            ySums.assign(windowWidth, 0);
+            ySquares.assign(windowWidth, 0);
+            products.assign(windowWidth, 0);
+        }
+        for (auto r = inputStartRow; r < inputEndRow; r++)
+        {
+            auto index = static_cast<uint64_t>(r) * constants.INPUT_C + windowStart;
+            if (index < nPixels)
+            {
+                auto count = static_cast<unsigned>((std::min<uint64_t>)(windowWidth, nPixels - index));
+                AccumulateRow(pixels + index, count, sums.data(), squares.data());
+                if (TPaired)
+                {
+                    AccumulateRow(yPixels + index, count, ySums.data(), ySquares.data());
+                    AccumulateProductRow(pixels + index, yPixels + index, count, products.data());
+                }
+            }
+        }
+
+        for (auto column = firstColumn; column < lastColumn; column++)
+        {
+            auto inputStartColumn = getInputColumn(column);
+            auto inputEndColumn = getInputColumn(column + 1);
+
+            VoxelSums voxelSums {};
+            for (auto c = inputStartColumn; c < inputEndColumn; c++)
+            {
+                voxelSums.X += sums[c - windowStart];
+                voxelSums.XX += squares[c - windowStart];
+                if (TPaired)
+                {
+                    voxelSums.Y += ySums[c - windowStart];
+                    voxelSums.YY += ySquares[c - windowStart];
+                    voxelSums.XY += products[c - windowStart];
+                }
+            }
+
+            unsigned nCount = (inputEndRow - inputStartRow) * (inputEndColumn - inputStartColumn);
+            accumulate(rowBegin + column, nCount, voxelSums);
+        }
+    }
+}
+
+// Shaders\voxelize_mean.hlsl
+void VoxelizeMean16(const Bindings& bindings, uint64_t begin, uint64_t end, unsigned X, unsigned Y)
+{
+    UNREFERENCED_PARAMETER(Y);
+
+    auto means = bindings.GetOutput<float>(0);
+    auto counts = bindings.GetOutput<unsigned>(1);
+    auto meansSquared = bindings.GetOutput<float>(2);
+
+    ForEachVoxelInSlab16<false>(bindings, begin, end, X,
+        [&](uint64_t i, unsigned nCount, const VoxelSums& sums)
+        {
+            auto aggregator = static_cast<float>(sums.X);
+            auto aggregatorSquared = static_cast<float>(sums.XX);
+            means[i] = ((counts[i] * means[i]) + aggregator) / static_cast<float>(counts[i] + nCount);
+            if (meansSquared)
+            {
+                meansSquared[i] = ((counts[i] * meansSquared[i]) + aggregatorSquared) / static_cast<float>(counts[i] + nCount);
+            }
+            counts[i] += nCount;
+        });
+}
+
+// Shaders\voxelize_stddev.hlsl keeps a running mean and M2 in floats, with 16 bit
+// pixels the CPU keeps the exact sums instead, in the same 24 bytes per voxel.
+// A voxel of 2^32 pixels of 0xFFFF still fits in the 64 bit sum of squares.
+struct VoxelMoments
+{
+    uint32_t Count;
+    uint32_t Unused;
+    uint64_t Sum;
+    uint64_t SumOfSquares;
+};
+static_assert(sizeof(VoxelMoments) == 24, "VoxelMoments must match the layout of the shader");
+
+// Shaders\voxelize_stddev.hlsl
+void VoxelizeStdDev16(const Bindings& bindings, uint64_t begin, uint64_t end, unsigned X, unsigned Y)
+{
+    UNREFERENCED_PARAMETER(Y);
+
+    auto moments = bindings.GetOutput<VoxelMoments>(0);
+
+    ForEachVoxelInSlab16<false>(bindings, begin, end, X,
+        [&](uint64_t i, unsigned nCount, const VoxelSums& sums)
+        {
+            moments[i].Count += nCount;
+            moments[i].Sum += sums.X;
+            moments[i].SumOfSquares += sums.XX;
+        });
+}
+
+// Shaders\voxelize_stddev_finalize.hlsl
+void VoxelizeStdDevFinalize(const Bindings& bindings, const ThreadId& id)
+{
+    auto& moments = bindings.GetInput<VoxelMoments>(0)[id.x];
+    auto means = bindings.GetOutput<float>(0);
+    auto stdDevs = bindings.GetOutput<float>(1);
+
+    if (moments.Count == 0)
+    {
+        means[id.x] = 0.f;
+        stdDevs[id.x] = 0.f;
+        return;
+    }
+
+    // The sums are exact, only this last step rounds
+    double mean = static_cast<double>(moments.Sum) / moments.Count;
+    double m2 = static_cast<double>(moments.SumOfSquares) - static_cast<double>(moments.Sum) * mean;
+    means[id.x] = static_cast<float>(mean);
+    stdDevs[id.x] = static_cast<float>(sqrt((std::max)(m2, 0.) / moments.Count));
+}
+
+// Shaders\voxelize_ssim.hlsl keeps running means, M2 and co-moment in floats,
+// the CPU keeps the exact sums of both slices and their products instead
+struct VoxelPairMoments
+{
+    uint32_t Count;
+    uint32_t Unused;
+    uint64_t X;
+    uint64_t Y;
+    uint64_t XX;
+    uint64_t YY;
+    uint64_t XY;
+};
+static_assert(sizeof(VoxelPairMoments) == 48, "VoxelPairMoments must match the layout of the shader");
+
+// Shaders\voxelize_ssim.hlsl
+void VoxelizeSSIM16(const Bindings& bindings, uint64_t begin, uint64_t end, unsigned X, unsigned Y)
+{
+    UNREFERENCED_PARAMETER(Y);
+
+    auto moments = bindings.GetOutput<VoxelPairMoments>(0);
+
+    ForEachVoxelInSlab16<true>(bindings, begin, end, X,
+        [&](uint64_t i, unsigned nCount, const VoxelSums& sums)
+        {
+            moments[i].Count += nCount;
+            moments[i].X += sums.X;
+            moments[i].Y += sums.Y;
+            moments[i].XX += sums.XX;
+            moments[i].YY += sums.YY;
+            moments[i].XY += sums.XY;
+        });
+}
+
+// Shaders\voxelize_ssim_finalize.hlsl
+void VoxelizeSSIMFinalize(const Bindings& bindings, const ThreadId& id)
+{
+    struct Constants
+    {
+        float C1;
+        float C2;
+        unsigned UNUSED[2];
+    };
+    auto& constants = bindings.GetConstants<Constants>();
+
+    auto& moments = bindings.GetInput<VoxelPairMoments>(0)[id.x];
+
+    // Only the SSIM is always bound, the statistics behind it on request
+    float* outputs[6];
+    for (unsigned i = 0; i < 6; i++)
+    {
+        outputs[i] = bindings.GetOutput<float>(i);
+    }
+
+    float values[6] = {};
+    if (moments.Count != 0)
+    {
+        // The sums are exact, only this last step rounds
+        double n = moments.Count;
+        double xMean = moments.X / n;
+        double yMean = moments.Y / n;
+        double xVariance = (std::max)(moments.XX - moments.X * xMean, 0.) / n;
+        double yVariance = (std::max)(moments.YY - moments.Y * yMean, 0.) / n;
+        double covariance = (moments.XY - moments.X * yMean) / n;
+
+        values[0] = static_cast<float>(
+            ((2 * xMean * yMean) + constants.C1) * ((2 * covariance) + constants.C2) /
+            (((xMean * xMean) + (yMean * yMean) + constants.C1) * (xVariance + yVariance + constants.C2)));
+        values[1] = static_cast<float>(xMean);
+        values[2] = static_cast<float>(yMean);
+        values[3] = static_cast<float>(sqrt(xVariance));
+        values[4] = static_cast<float>(sqrt(yVariance));
+        values[5] = static_cast<float>(covariance);
+    }
+
+    for (unsigned i = 0; i < 6; i++)
+    {
+        if (outputs[i])
+        {
+            outputs[i][id.x] = values[i];
+        }
+    }
+}
+
+// Every specialization of a kernel is instantiated here, the specialization is
+// the same set of constants that the shader is compiled with on the GPU
+static const struct
+{
+    const wchar_t* Name;
+    const char* Specialization;
+    KernelFunction Kernel;
+} CpuKernels[] =
+{
+
+{ L"add_images",        "", RunThreads<AddImages> },
+{ L"convert_to_float",  "", RunThreads<ConvertToFloat> },
+{ L"divide_images",     "", RunThreads<DivideImages> },
+{ L"multiply_images",   "", RunThreads<MultiplyImages> },
+{ L"sqrt_image",        "", RunThreads<SqrtImage> },
+{ L"square_image",      "", RunThreads<SquareImage> },
+{ L"voxelize_mean",     "", VoxelizeMean16 },
+{ L"voxelize_mean",     "FLOAT_PIXELS=1;", RunThreads<VoxelizeMean<float>> },
+{ L"voxelize_stddev",   "", VoxelizeStdDev16 },
+{ L"voxelize_stddev_finalize", "", RunThreads<VoxelizeStdDevFinalize> },
+{ L"voxelize_ssim",     "", VoxelizeSSIM16 },
+{ L"voxelize_ssim_finalize", "", RunThreads<VoxelizeSSIMFinalize> }
+
+};
+
+} // namespace
+
+HRESULT Application::Infrastructure::Cpu::FindKernel(
+    const std::wstring& shaderName,
+    const std::string& specialization,
+    KernelFunction* pKernel)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pKernel);
+
+    auto foundIt =
+        std::find_if(
+            std::begin(CpuKernels),
+            std::end(CpuKernels),
+            [&shaderName, &specialization](const auto& entry)
+            {
+                return _wcsicmp(entry.Name, shaderName.c_str()) == 0 && specialization == entry.Specialization;
+            }
+        );
+
+    RETURN_HR_IF(E_INVALIDARG, foundIt == std::end(CpuKernels));
+
+    *pKernel = foundIt->Kernel;
+    return S_OK;
+}
+
+#endif // DCP_CPU_BACKEND
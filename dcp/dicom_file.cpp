@@ -3,40 +3,228 @@
 
 using namespace DCM;
 
+namespace
+{
 
-template <unsigned TBytesRead>
-HRESULT Discard(std::istream& stream)
+// Reads elements from a file stream. Values are appended to the arena owned by
+// the DicomFile.
+class StreamReader
 {
-    stream.ignore(TBytesRead);
-    RETURN_HR_IF_FALSE(E_FAIL, stream.good());
-    return S_OK;
-}
- 
+public:
+    StreamReader(const std::wstring& fileName) :
+        m_stream(ToNativePath(fileName), std::ifstream::binary)
+    {
+    }
+
+    bool IsEnd()
+    {
+        return m_stream.eof();
+    }
 
-template <typename T>
-HRESULT Read(std::istream& stream, _Out_ T* group)
+    size_t GetPosition() const
+    {
+        return m_position;
+    }
+
+    HRESULT Discard(unsigned bytes)
+    {
+        // Large values are seeked over so that they are never read, small ones
+        // are skipped inside the stream buffer to avoid refilling it. Seeking
+        // past the end is caught by the next read.
+        if (bytes >= LargeValueBytes)
+        {
+            m_stream.seekg(bytes, std::ios_base::cur);
+        }
+        else
+        {
+            m_stream.ignore(bytes);
+        }
+        m_position += bytes;
+        RETURN_HR_IF_FALSE(E_FAIL, m_stream.good());
+        return S_OK;
+    }
+
+    template <typename T>
+    HRESULT Read(_Out_ T* value)
+    {
+        RETURN_HR_IF_NULL(E_FAIL, value);
+
+        m_stream.read(reinterpret_cast<char*>(value), sizeof(T));
+        m_position += sizeof(T);
+        RETURN_HR_IF_FALSE(E_FAIL, m_stream.good());
+        return S_OK;
+    }
+
+    HRESULT ReadValue(DWORD length, std::vector<char>* arena, _Out_ size_t* offset, _Out_ size_t* size)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, arena);
+        *offset = arena->size();
+        *size = length;
+
+        arena->resize(*offset + length);
+        if (length != 0)
+        {
+            m_stream.read(&arena->at(*offset), length);
+        }
+        m_position += length;
+        return S_OK;
+    }
+
+private:
+    static const unsigned LargeValueBytes = 16 * 1024;
+
+    std::ifstream m_stream;
+    size_t m_position = 0;
+};
+
+// Walks a memory mapped file. Values are located by their offset in the
+// mapping and never copied.
+class MappedReader
 {
-	RETURN_HR_IF_NULL(E_FAIL, group);
+public:
+    MappedReader(const char* pData, size_t size) :
+        m_begin(pData),
+        m_current(pData),
+        m_end(pData + size)
+    {
+    }
 
-    stream.read(reinterpret_cast<char*>(group), sizeof(T));
-    RETURN_HR_IF_FALSE(E_FAIL, stream.good());
-    return S_OK;
+    bool IsEnd()
+    {
+        return m_current == m_end;
+    }
+
+    size_t GetPosition() const
+    {
+        return static_cast<size_t>(m_current - m_begin);
+    }
+
+    HRESULT Discard(unsigned bytes)
+    {
+        if (Remaining() < bytes)
+        {
+            m_current = m_end;
+            return E_FAIL;
+        }
+        m_current += bytes;
+        return S_OK;
+    }
+
+    template <typename T>
+    HRESULT Read(_Out_ T* value)
+    {
+        RETURN_HR_IF_NULL(E_FAIL, value);
+
+        // Consume the tail on a short read, the same way the stream hits eof
+        if (Remaining() < sizeof(T))
+        {
+            m_current = m_end;
+            return E_FAIL;
+        }
+        memcpy(value, m_current, sizeof(T));
+        m_current += sizeof(T);
+        return S_OK;
+    }
+
+    HRESULT ReadValue(DWORD length, std::vector<char>*, _Out_ size_t* offset, _Out_ size_t* size)
+    {
+        // A truncated value is clamped to the end of the file
+        *offset = GetPosition();
+        *size = (std::min)(static_cast<size_t>(length), Remaining());
+        m_current += *size;
+        return S_OK;
+    }
+
+private:
+    size_t Remaining() const
+    {
+        return static_cast<size_t>(m_end - m_current);
+    }
+
+    const char* m_begin;
+    const char* m_current;
+    const char* m_end;
+};
+
+// Metadata values of a slice add up to a few hundred bytes
+const size_t InitialArenaBytes = 1024;
+
+}
+
+DicomFile::DicomFile(
+    const std::wstring& fileName,
+    const DicomTagFilter& tags,
+    DicomFileMode mode) :
+        DicomFile(fileName, tags, mode, false)
+{
 }
 
 DicomFile::DicomFile(
     const std::wstring& fileName,
-    const std::vector<DicomTag>& tags) :
+    const DicomTagFilter& tags,
+    DicomFileMode mode,
+    bool isLoaded) :
         m_fileName(fileName),
-		m_tags(tags)
+        m_mode(mode),
+        m_tags(&tags),
+        m_hasPixelDataLocation(false),
+        m_Attributes(tags.Count, AttributeSlot { false, false, 0, 0 })
+{
+    if (m_mode == DicomFileMode::Buffered)
+    {
+        m_arena.reserve(InitialArenaBytes);
+    }
+
+    if (!isLoaded)
+    {
+        FAIL_FAST_IF_FAILED(Load());
+    }
+}
+
+DicomFile::DicomFile(
+    const DicomFile& metadataFile,
+    const DicomTagFilter& tags,
+    DicomFileMode mode) :
+        m_fileName(metadataFile.m_fileName),
+        m_mode(mode),
+        m_tags(&tags),
+        m_hasPixelDataLocation(metadataFile.m_hasPixelDataLocation),
+        m_pixelDataLocation(metadataFile.m_pixelDataLocation),
+        m_Attributes(tags.Count, AttributeSlot { false, false, 0, 0 })
+{
+    FAIL_FAST_IF_TRUE(metadataFile.m_mode != DicomFileMode::Buffered);
+
+    // The metadata values are small, copy them rather than keep the metadata
+    // file alive
+    for (unsigned i = 0; i < metadataFile.m_tags->Count; i++)
+    {
+        auto slot = FindSlot(metadataFile.m_tags->Ids[i]);
+        if (slot != nullptr)
+        {
+            *slot = metadataFile.m_Attributes[i];
+        }
+    }
+
+    if (m_mode == DicomFileMode::Buffered)
+    {
+        m_arena.reserve(metadataFile.m_arena.size() + m_pixelDataLocation.Length);
+    }
+    m_arena = metadataFile.m_arena;
+
+    FAIL_FAST_IF_FAILED(LoadPixelData());
+}
+
+DicomFile::AttributeSlot* DicomFile::FindSlot(unsigned id)
 {
-    FAIL_FAST_IF_FAILED(Load());
+    auto index = m_tags->IndexOf(id);
+    return index < 0 ? nullptr : &m_Attributes[index];
 }
 
 _Use_decl_annotations_
 HRESULT DicomFile::TagToId(const DicomTag& tag, unsigned* id)
 {
 	RETURN_HR_IF_NULL(E_FAIL, id);
-	*id = (tag.Group << sizeof(WORD) * 8) + tag.Element;
+	*id = DicomTagId(tag);
 	return S_OK;
 }
 
@@ -44,44 +232,135 @@ _Use_decl_annotations_
 HRESULT DicomFile::GetAttribute(const DicomTag& tag, std::vector<char>* data)
 {
     RETURN_HR_IF_NULL(E_POINTER, data);
-	unsigned id;
-    RETURN_IF_FAILED(TagToId(tag, &id));
-    auto foundIt = m_Attributes.find(id);
-    RETURN_HR_IF(E_FAIL, foundIt == std::end(m_Attributes));
-    *data = m_Attributes[id];
+    AttributeView view;
+    RETURN_IF_FAILED(GetAttributeView(tag, &view));
+    data->assign(std::begin(view), std::end(view));
     return S_OK;
 }
 
 _Use_decl_annotations_
-HRESULT DicomFile::GetAttributeReference(const DicomTag& tag, std::vector<char>** data)
+HRESULT DicomFile::GetAttributeView(const DicomTag& tag, AttributeView* view)
 {
-    RETURN_HR_IF_NULL(E_POINTER, data);
+    RETURN_HR_IF_NULL(E_POINTER, view);
     unsigned id;
     RETURN_IF_FAILED(TagToId(tag, &id));
-    auto foundIt = m_Attributes.find(id);
-    RETURN_HR_IF(E_FAIL, foundIt == std::end(m_Attributes));
-    *data = &m_Attributes[id];
+    auto slot = FindSlot(id);
+    RETURN_HR_IF(E_FAIL, slot == nullptr || !slot->IsSet);
+
+    view->Data = (slot->IsInMapping ? m_mappedFile.GetData() : m_arena.data()) + slot->Offset;
+    view->Size = slot->Size;
     return S_OK;
 }
 
 _Use_decl_annotations_
-HRESULT DicomFile::IsMappedTag(const DicomTag& tag, bool* isMapped)
+HRESULT DicomFile::GetPixelDataLocation(PixelDataLocation* location)
 {
-	RETURN_HR_IF_NULL(E_FAIL, isMapped);
-	*isMapped = false;
-	for (auto attribute : m_tags)
-	{
-		bool groupMatched = attribute.Group == tag.Group;
-		bool elementMatched = attribute.Element == tag.Element;
+    RETURN_HR_IF_NULL(E_POINTER, location);
+    RETURN_HR_IF_FALSE(E_FAIL, m_hasPixelDataLocation);
+    *location = m_pixelDataLocation;
+    return S_OK;
+}
+
+//
+// A metadata record is
+//     uint64_t    PixelData offset
+//     DWORD       PixelData length
+//     DWORD       number of attributes
+// followed by each attribute that was found as
+//     DWORD       tag id
+//     DWORD       value length
+//     char[]      value
+//
+_Use_decl_annotations_
+HRESULT DicomFile::WriteMetadataRecord(std::vector<char>* record) const
+{
+    RETURN_HR_IF_NULL(E_POINTER, record);
+    RETURN_HR_IF(E_NOTIMPL, m_mode != DicomFileMode::Buffered);
+    RETURN_HR_IF_FALSE(E_FAIL, m_hasPixelDataLocation);
+
+    auto append =
+        [record](const void* pData, size_t size)
+        {
+            auto offset = record->size();
+            record->resize(offset + size);
+            if (size != 0)
+            {
+                memcpy(&record->at(offset), pData, size);
+            }
+        };
 
-		*isMapped = groupMatched && elementMatched;
+    DWORD nAttributes = 0;
+    for (auto& slot : m_Attributes)
+    {
+        nAttributes += slot.IsSet ? 1 : 0;
+    }
 
-        if (*isMapped)
+    record->clear();
+    append(&m_pixelDataLocation.Offset, sizeof(uint64_t));
+    append(&m_pixelDataLocation.Length, sizeof(DWORD));
+    append(&nAttributes, sizeof(DWORD));
+    for (unsigned i = 0; i < m_tags->Count; i++)
+    {
+        auto& slot = m_Attributes[i];
+        if (slot.IsSet)
         {
-            break;
+            DWORD id = m_tags->Ids[i];
+            DWORD size = static_cast<DWORD>(slot.Size);
+            append(&id, sizeof(DWORD));
+            append(&size, sizeof(DWORD));
+            append(m_arena.data() + slot.Offset, slot.Size);
         }
-	}
-	return S_OK;
+    }
+    return S_OK;
+}
+
+_Use_decl_annotations_
+HRESULT DicomFile::ReadMetadataRecord(
+    const std::wstring& fileName,
+    const DicomTagFilter& tags,
+    const char* pRecord,
+    size_t recordSize,
+    std::shared_ptr<DicomFile>* pFile)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pFile);
+    RETURN_HR_IF_NULL(E_POINTER, pRecord);
+
+    MappedReader reader(pRecord, recordSize);
+    std::shared_ptr<DicomFile> file(new DicomFile(fileName, tags, DicomFileMode::Buffered, true));
+
+    DWORD nAttributes;
+    RETURN_IF_FAILED(reader.Read(&file->m_pixelDataLocation.Offset));
+    RETURN_IF_FAILED(reader.Read(&file->m_pixelDataLocation.Length));
+    RETURN_IF_FAILED(reader.Read(&nAttributes));
+    file->m_hasPixelDataLocation = true;
+
+    for (DWORD i = 0; i < nAttributes; i++)
+    {
+        DWORD id;
+        DWORD size;
+        RETURN_IF_FAILED(reader.Read(&id));
+        RETURN_IF_FAILED(reader.Read(&size));
+
+        size_t valueOffset;
+        size_t valueSize;
+        RETURN_IF_FAILED(reader.ReadValue(size, nullptr, &valueOffset, &valueSize));
+        RETURN_HR_IF(E_FAIL, valueSize != size);
+
+        // Attributes that are not in the requested tags are skipped
+        auto slot = file->FindSlot(id);
+        if (slot != nullptr)
+        {
+            slot->Offset = file->m_arena.size();
+            slot->Size = valueSize;
+            slot->IsInMapping = false;
+            slot->IsSet = true;
+            file->m_arena.insert(std::end(file->m_arena), pRecord + valueOffset, pRecord + valueOffset + valueSize);
+        }
+    }
+    RETURN_HR_IF_FALSE(E_FAIL, reader.IsEnd());
+
+    *pFile = std::move(file);
+    return S_OK;
 }
 
 #include <sstream>
@@ -89,22 +368,100 @@ HRESULT DicomFile::IsMappedTag(const DicomTag& tag, bool* isMapped)
 #include <stack>
 HRESULT DicomFile::Load()
 {
-    std::ifstream stream(m_fileName, std::ifstream::binary);
+    if (m_mode == DicomFileMode::Mapped)
+    {
+        RETURN_IF_FAILED(m_mappedFile.Open(m_fileName));
+        MappedReader reader(m_mappedFile.GetData(), m_mappedFile.GetSize());
+        return Parse(reader);
+    }
+
+    StreamReader reader(m_fileName);
+    return Parse(reader);
+}
+
+HRESULT DicomFile::LoadPixelData()
+{
+    RETURN_HR_IF_FALSE(E_FAIL, m_hasPixelDataLocation);
+
+    // Encapsulated (compressed) pixel data has an undefined length
+    RETURN_HR_IF(E_NOTIMPL, m_pixelDataLocation.Length == 0xFFFFFFFF);
+
+    auto slot = FindSlot(DicomTagId(Tags::PixelData));
+    RETURN_HR_IF_NULL(E_INVALIDARG, slot);
+
+    if (m_mode == DicomFileMode::Mapped)
+    {
+        RETURN_IF_FAILED(m_mappedFile.Open(m_fileName));
+        RETURN_HR_IF(E_FAIL, m_pixelDataLocation.Offset > m_mappedFile.GetSize());
 
-	FAIL_FAST_IF_FAILED(Discard<128>(stream));
+        auto available = m_mappedFile.GetSize() - static_cast<size_t>(m_pixelDataLocation.Offset);
+        slot->IsInMapping = true;
+        slot->Offset = static_cast<size_t>(m_pixelDataLocation.Offset);
+        slot->Size = (std::min)(static_cast<size_t>(m_pixelDataLocation.Length), available);
+    }
+    else
+    {
+        std::ifstream stream(ToNativePath(m_fileName), std::ifstream::binary);
+        stream.seekg(m_pixelDataLocation.Offset);
+
+        slot->IsInMapping = false;
+        slot->Offset = m_arena.size();
+        slot->Size = m_pixelDataLocation.Length;
+
+        m_arena.resize(slot->Offset + slot->Size);
+        if (slot->Size != 0)
+        {
+            stream.read(&m_arena[slot->Offset], slot->Size);
+        }
+        RETURN_HR_IF(E_FAIL, stream.fail() && !stream.eof());
+    }
+
+    slot->IsSet = true;
+    return S_OK;
+}
+
+template <typename TReader>
+HRESULT DicomFile::Parse(TReader& reader)
+{
+	FAIL_FAST_IF_FAILED(reader.Discard(128));
 
 	DicomPreamble preamble;
-	FAIL_FAST_IF_FAILED(Read(stream, &preamble));
+	FAIL_FAST_IF_FAILED(reader.Read(&preamble));
+
+	// End offsets of the sequences enclosing the current element. Sequences of
+	// undefined length end at their delimitation item instead.
+	const size_t UndefinedSequenceEnd = (std::numeric_limits<size_t>::max)();
+	std::stack<size_t, std::vector<size_t>> sequenceEnds;
+
+	// The walk always goes as far as the PixelData element header so that its
+	// location can be recorded, even if the value itself is not wanted.
+	const unsigned pixelDataId = DicomTagId(Tags::PixelData);
+	auto lastTagId = (std::max)(m_tags->HighestId, pixelDataId);
 
-	std::stack<DWORD> remainingBytesInSequance;
-	while (!stream.eof())
+	while (!reader.IsEnd())
 	{
+		auto elementStart = reader.GetPosition();
+		while (!sequenceEnds.empty() && sequenceEnds.top() <= elementStart)
+		{
+			sequenceEnds.pop();
+		}
+
 		DicomAttribute attribute;
-        if (FAILED(Read(stream, &attribute.Tag)))
+        if (FAILED(reader.Read(&attribute.Tag)))
         {
             continue;
         }
 
+		// Top level elements are stored in ascending tag order, so once the
+		// last tag of interest has been passed nothing else can match.
+		unsigned tagId;
+		RETURN_IF_FAILED(TagToId(attribute.Tag, &tagId));
+		bool isTopLevel = sequenceEnds.empty() && attribute.Tag.Group != 0xFFFE;
+		if (isTopLevel && tagId > lastTagId)
+		{
+			break;
+		}
+
 		if (attribute.Tag.Group == 0xFFFE && attribute.Tag.Element == 0xE0DD || // sequence end marker
 			attribute.Tag.Group == 0xFFFE && attribute.Tag.Element == 0xE000 || // item begin marker
 			attribute.Tag.Group == 0xFFFE && attribute.Tag.Element == 0xE00D)   // item end marker
@@ -115,13 +472,13 @@ HRESULT DicomFile::Load()
 		}
 		else
 		{
-			FAIL_FAST_IF_FAILED(Read(stream, &attribute.ValueRepresentation));
+			FAIL_FAST_IF_FAILED(reader.Read(&attribute.ValueRepresentation));
 		}
 
 		DWORD ValueLength;
 		if (_strnicmp((char*)attribute.ValueRepresentation, "\0\0", 2) == 0)
 		{
-			FAIL_FAST_IF_FAILED(Read(stream, &ValueLength));
+			FAIL_FAST_IF_FAILED(reader.Read(&ValueLength));
 		}
 		else if (_strnicmp((char*)attribute.ValueRepresentation, "OB", 2) == 0 ||
 			_strnicmp((char*)attribute.ValueRepresentation, "OW", 2) == 0 ||
@@ -130,41 +487,63 @@ HRESULT DicomFile::Load()
 			_strnicmp((char*)attribute.ValueRepresentation, "UT", 2) == 0 ||
 			_strnicmp((char*)attribute.ValueRepresentation, "UN", 2) == 0)
 		{
-			Discard<2>(stream);
-			FAIL_FAST_IF_FAILED(Read(stream, &ValueLength));
+			reader.Discard(2);
+			FAIL_FAST_IF_FAILED(reader.Read(&ValueLength));
 		}
 		else
 		{
 			WORD sValueLength;
-			FAIL_FAST_IF_FAILED(Read(stream, &sValueLength));
+			FAIL_FAST_IF_FAILED(reader.Read(&sValueLength));
 			ValueLength = sValueLength;
 		}
 
+		if (isTopLevel && tagId == pixelDataId)
+		{
+			m_pixelDataLocation.Offset = reader.GetPosition();
+			m_pixelDataLocation.Length = ValueLength;
+			m_hasPixelDataLocation = true;
+		}
+
 		if (_strnicmp((char*)attribute.ValueRepresentation, "SQ", 2) == 0 ||    // sequence begin marker
 		    attribute.Tag.Group == 0xFFFE && attribute.Tag.Element == 0xE0DD || // sequence end marker
 			attribute.Tag.Group == 0xFFFE && attribute.Tag.Element == 0xE000 || // item begin marker
 			attribute.Tag.Group == 0xFFFE && attribute.Tag.Element == 0xE00D)   // item end marker
 		{
-			// In theory we should be tracking whick sequence we are a part of
-			// and what ordinal we are at... this may me irrelevant though...
+			// Item contents are walked as if they were top level elements, only
+			// the nesting depth is tracked
+			if (_strnicmp((char*)attribute.ValueRepresentation, "SQ", 2) == 0)
+			{
+				sequenceEnds.push(
+					ValueLength == 0xFFFFFFFF ?
+						UndefinedSequenceEnd :
+						reader.GetPosition() + ValueLength);
+			}
+			else if (attribute.Tag.Element == 0xE0DD &&
+					 !sequenceEnds.empty() &&
+					 sequenceEnds.top() == UndefinedSequenceEnd)
+			{
+				sequenceEnds.pop();
+			}
 			continue;
 		}
 
-        std::vector<char> buffer(ValueLength);
-
-        if (ValueLength != 0)
+		auto slot = FindSlot(tagId);
+		if (slot != nullptr && !slot->IsSet)
+		{
+            RETURN_IF_FAILED(reader.ReadValue(ValueLength, &m_arena, &slot->Offset, &slot->Size));
+            slot->IsInMapping = m_mode == DicomFileMode::Mapped;
+            slot->IsSet = true;
+		}
+        else
         {
-            stream.read(&buffer[0], ValueLength);
+            reader.Discard(ValueLength);
         }
 
-		bool isMapped;
-		unsigned id;
-		if (SUCCEEDED(IsMappedTag(attribute.Tag, &isMapped)) &&
-			SUCCEEDED(TagToId(attribute.Tag, &id)) &&
-			isMapped)
-		{
-            m_Attributes.emplace(id, std::move(buffer));
-		}
+        // Everything wanted has been found
+        if (isTopLevel && tagId >= m_tags->HighestId && m_hasPixelDataLocation)
+        {
+            break;
+        }
 	}
 
 	return S_OK;
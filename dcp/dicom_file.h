@@ -26,21 +26,167 @@ namespace DCM
 
 namespace Tags
 {
-    __declspec(selectany) DicomTag SamplesPerPixel = { 0x0028, 0x0002 };
-    __declspec(selectany) DicomTag BitsAllocated = { 0x0028, 0x0100 };
-    __declspec(selectany) DicomTag Rows = { 0x0028, 0x0010 };
-    __declspec(selectany) DicomTag Columns = { 0x0028, 0x0011 };
-    __declspec(selectany) DicomTag PixelData = { 0x7FE0, 0x0010 };
-    __declspec(selectany) DicomTag SliceThickness = { 0x0018, 0x0050 };
-    __declspec(selectany) DicomTag WindowCenter = { 0x0028, 0x1050 };
-    __declspec(selectany) DicomTag WindowWidth = { 0x0028, 0x1051 };
-    __declspec(selectany) DicomTag PixelSpacing = { 0x0028, 0x0030 };
-    __declspec(selectany) DicomTag ImagePositionPatient = { 0x0020, 0x0032 };
-    __declspec(selectany) DicomTag ImageOrientationPatient = { 0x0020, 0x0037 };
-    __declspec(selectany) DicomTag PatientPosition = { 0x0018, 0x5100 };
-    __declspec(selectany) DicomTag NumberOfSeriesRelatedInstances = { 0x0020, 0x1209 };
-    __declspec(selectany) DicomTag NumberOfStudyRelatedSeries = { 0x0020, 0x1206 };
+    inline constexpr DicomTag TransferSyntaxUID = { 0x0002, 0x0010 };
+    inline constexpr DicomTag SamplesPerPixel = { 0x0028, 0x0002 };
+    inline constexpr DicomTag BitsAllocated = { 0x0028, 0x0100 };
+    inline constexpr DicomTag Rows = { 0x0028, 0x0010 };
+    inline constexpr DicomTag Columns = { 0x0028, 0x0011 };
+    inline constexpr DicomTag PixelData = { 0x7FE0, 0x0010 };
+    inline constexpr DicomTag SliceThickness = { 0x0018, 0x0050 };
+    inline constexpr DicomTag WindowCenter = { 0x0028, 0x1050 };
+    inline constexpr DicomTag WindowWidth = { 0x0028, 0x1051 };
+    inline constexpr DicomTag PixelSpacing = { 0x0028, 0x0030 };
+    inline constexpr DicomTag ImagePositionPatient = { 0x0020, 0x0032 };
+    inline constexpr DicomTag ImageOrientationPatient = { 0x0020, 0x0037 };
+    inline constexpr DicomTag PatientPosition = { 0x0018, 0x5100 };
+    inline constexpr DicomTag NumberOfSeriesRelatedInstances = { 0x0020, 0x1209 };
+    inline constexpr DicomTag NumberOfStudyRelatedSeries = { 0x0020, 0x1206 };
 }
+
+    constexpr unsigned DicomTagId(const DicomTag& tag)
+    {
+        return (static_cast<unsigned>(tag.Group) << 16) | tag.Element;
+    }
+
+    /// <summary>
+    /// Runtime handle to a DicomTagSet. Slots of a DicomFile are indexed by the
+    /// position of their tag in Ids.
+    /// </summary>
+    struct DicomTagFilter
+    {
+        // Sorted ascending
+        const unsigned* Ids;
+        unsigned Count;
+        unsigned HighestId;
+        // Returns the position of id in Ids, or -1 when it is not in the set
+        int (*IndexOf)(unsigned id);
+    };
+
+namespace Details
+{
+    // Spreads the element number and the low bits of the group over 64 bits
+    constexpr uint64_t TagBit(unsigned id)
+    {
+        return 1ull << ((id ^ (id >> 16)) & 63);
+    }
+
+    template <size_t N>
+    constexpr std::array<unsigned, N> SortTagIds(std::array<unsigned, N> ids)
+    {
+        for (size_t i = 1; i < N; i++)
+        {
+            for (size_t j = i; j > 0 && ids[j - 1] > ids[j]; j--)
+            {
+                auto id = ids[j];
+                ids[j] = ids[j - 1];
+                ids[j - 1] = id;
+            }
+        }
+        return ids;
+    }
+
+    template <size_t N>
+    constexpr bool AreTagIdsUnique(const std::array<unsigned, N>& sortedIds)
+    {
+        for (size_t i = 1; i < N; i++)
+        {
+            if (sortedIds[i - 1] == sortedIds[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+    /// <summary>
+    /// Set of tags known at compile time. Most elements of a file are rejected
+    /// by a test against a 64 bit bitmap of the set, and the remaining ones are
+    /// looked up in a sorted table of constant size, so the parser never
+    /// searches a runtime container. The highest tag bounds the parse.
+    /// </summary>
+    template <const DicomTag&... TTags>
+    struct DicomTagSet
+    {
+        static constexpr unsigned Count = sizeof...(TTags);
+        static_assert(Count > 0, "A tag set needs at least one tag");
+
+        static constexpr std::array<unsigned, Count> Ids =
+            Details::SortTagIds(std::array<unsigned, Count> { DicomTagId(TTags)... });
+        static_assert(Details::AreTagIdsUnique(Ids), "Tags of a tag set must be unique");
+
+        static constexpr unsigned HighestId = Ids[Count - 1];
+        static constexpr uint64_t Bitmap = (Details::TagBit(DicomTagId(TTags)) | ...);
+
+        static constexpr int IndexOf(unsigned id)
+        {
+            if ((Bitmap & Details::TagBit(id)) == 0)
+            {
+                return -1;
+            }
+            for (unsigned i = 0; i < Count; i++)
+            {
+                if (Ids[i] == id)
+                {
+                    return static_cast<int>(i);
+                }
+            }
+            return -1;
+        }
+
+        static constexpr bool Contains(const DicomTag& tag)
+        {
+            return IndexOf(DicomTagId(tag)) >= 0;
+        }
+
+        // The set extended by more tags
+        template <const DicomTag&... TMoreTags>
+        using With = DicomTagSet<TTags..., TMoreTags...>;
+
+        static const DicomTagFilter& GetFilter()
+        {
+            static const DicomTagFilter filter = { Ids.data(), Count, HighestId, &IndexOf };
+            return filter;
+        }
+    };
+
+    /// <summary>
+    /// Non owning view over the value of an attribute. The bytes belong to the
+    /// DicomFile that handed out the view and stay valid for its lifetime.
+    /// </summary>
+    struct AttributeView
+    {
+        const char* Data = nullptr;
+        size_t Size = 0;
+
+        const char* data() const { return Data; }
+        size_t size() const { return Size; }
+        bool empty() const { return Size == 0; }
+        const char* begin() const { return Data; }
+        const char* end() const { return Data + Size; }
+
+        template <typename T>
+        const T* As() const { return reinterpret_cast<const T*>(Data); }
+    };
+
+    /// <summary>
+    /// Where the PixelData value of a file starts and how long it is, as found
+    /// while parsing the file.
+    /// </summary>
+    struct PixelDataLocation
+    {
+        uint64_t Offset = 0;
+        DWORD Length = 0;
+    };
+
+    enum class DicomFileMode
+    {
+        // Mapped values are read into memory owned by the DicomFile
+        Buffered,
+        // The file is memory mapped and values are views into the mapping
+        Mapped
+    };
+
 	/// <summary>
 	/// Provides application-specific behavior to supplement the default Application class.
 	/// </summary>
@@ -49,18 +195,26 @@ namespace Tags
 	public:
 		DicomFile(
             const std::wstring& fileName,
-			const std::vector<DicomTag>& tags);
+			const DicomTagFilter& tags,
+            DicomFileMode mode = DicomFileMode::Buffered);
+
+        // Creates the image file for a parsed metadata file. The attributes are
+        // taken from the metadata file and PixelData is read from the recorded
+        // location without walking the file again. The tags must include
+        // PixelData.
+        DicomFile(
+            const DicomFile& metadataFile,
+            const DicomTagFilter& tags,
+            DicomFileMode mode);
 
 		HRESULT GetAttribute(const DicomTag& tag, std::vector<char>* data);
         HRESULT GetAttribute(const DicomTag& tag, _Out_ std::wstring* out)
         {
             RETURN_HR_IF_NULL(E_FAIL, out);
-            std::vector<char> buffer;
-            RETURN_IF_FAILED(GetAttribute(tag, &buffer));
+            AttributeView view;
+            RETURN_IF_FAILED(GetAttributeView(tag, &view));
 
-            std::string bufferAsString(std::begin(buffer), std::end(buffer));
-            out->resize(bufferAsString.size());
-            std::copy(std::begin(bufferAsString), std::end(bufferAsString), std::begin(*out));
+            out->assign(std::begin(view), std::end(view));
             return S_OK;
         }
 
@@ -68,23 +222,28 @@ namespace Tags
         HRESULT GetAttribute(const DicomTag& tag, _Out_ T* out)
         {
             RETURN_HR_IF_NULL(E_FAIL, out);
-            std::vector<char> buffer;
-            RETURN_IF_FAILED(GetAttribute(tag, &buffer));
+            AttributeView view;
+            RETURN_IF_FAILED(GetAttributeView(tag, &view));
 
-            if (buffer.size() == 2)
+            if (view.size() == 2)
             {
-                *out = static_cast<T>(*reinterpret_cast<unsigned short*>(&buffer[0]));
+                unsigned short value;
+                memcpy(&value, view.data(), sizeof(value));
+                *out = static_cast<T>(value);
                 return S_OK;
             }
-            else if (buffer.size() == 4)
+            else if (view.size() == 4)
             {
-                *out = static_cast<T>(*reinterpret_cast<unsigned long*>(&buffer[0]));
+                DWORD value;
+                memcpy(&value, view.data(), sizeof(value));
+                *out = static_cast<T>(value);
                 return S_OK;
             }
             return E_FAIL;
         }
 
-        HRESULT GetAttributeReference(const DicomTag& tag, std::vector<char>** data);
+        // Returns a view over the value without copying it
+        HRESULT GetAttributeView(const DicomTag& tag, _Out_ AttributeView* view);
 
         template <typename TOut>
         HRESULT GetAttributeAs(std::vector<char> buffer, _Out_ TOut* out)
@@ -99,63 +258,61 @@ namespace Tags
             return m_fileName;
         }
 
+        HRESULT GetPixelDataLocation(_Out_ PixelDataLocation* location);
+
+        // Saves the parsed values and the pixel data location of a buffered
+        // file, so that it can be recreated without parsing the file again
+        HRESULT WriteMetadataRecord(_Out_ std::vector<char>* record) const;
+
+        // Recreates a buffered file from a record written by WriteMetadataRecord.
+        // The file itself is not opened.
+        static HRESULT ReadMetadataRecord(
+            const std::wstring& fileName,
+            const DicomTagFilter& tags,
+            const char* pRecord,
+            size_t recordSize,
+            _Out_ std::shared_ptr<DicomFile>* pFile);
+
 	private:
+        DicomFile(
+            const std::wstring& fileName,
+            const DicomTagFilter& tags,
+            DicomFileMode mode,
+            bool isLoaded);
+
 		HRESULT Load();
+        HRESULT LoadPixelData();
+
+        template <typename TReader>
+        HRESULT Parse(TReader& reader);
 
-		HRESULT IsMappedTag(const DicomTag& tag, _Out_ bool* isMapped);
 		HRESULT TagToId(const DicomTag& tag, _Out_ unsigned* id);
 
+        struct AttributeSlot
+        {
+            bool IsSet;
+            // The value is in the mapped file rather than in the arena
+            bool IsInMapping;
+            size_t Offset;
+            size_t Size;
+        };
+
+        // Returns nullptr for tags that were not requested
+        AttributeSlot* FindSlot(unsigned id);
+
         std::wstring m_fileName;
-		std::vector<DicomTag> m_tags;
+        DicomFileMode m_mode;
+        const DicomTagFilter* m_tags;
 
-		std::map<unsigned, std::vector<char>> m_Attributes;
-	};
+        bool m_hasPixelDataLocation;
+        PixelDataLocation m_pixelDataLocation;
 
-    inline HRESULT MakeDicomMetadataFile(const std::wstring& path, std::shared_ptr<DicomFile>* pFile)
-    {
-        RETURN_HR_IF_NULL(E_POINTER, pFile);
-        static const std::vector<DicomTag> tags =
-        {
-            Tags::SamplesPerPixel,
-            Tags::BitsAllocated,
-            Tags::Rows,
-            Tags::Columns,
-            Tags::SliceThickness,
-            Tags::WindowWidth,
-            Tags::WindowCenter,
-            Tags::PixelSpacing,
-            Tags::ImagePositionPatient,
-            Tags::ImageOrientationPatient,
-            Tags::PatientPosition,
-            Tags::NumberOfSeriesRelatedInstances,
-            Tags::NumberOfStudyRelatedSeries
-        };
-        *pFile = std::make_shared<DicomFile>(path, tags);
-        return S_OK;
-    }
+        // One slot per requested tag, in the order of m_tags->Ids
+		std::vector<AttributeSlot> m_Attributes;
 
-    inline HRESULT MakeDicomImageFile(const std::wstring& path, std::shared_ptr<DicomFile>* pFile)
-    {
-        RETURN_HR_IF_NULL(E_POINTER, pFile);
-        static const std::vector<DicomTag> tags =
-        {
-            Tags::SamplesPerPixel,
-            Tags::BitsAllocated,
-            Tags::Rows,
-            Tags::Columns,
-            Tags::PixelData,
-            Tags::SliceThickness,
-            Tags::WindowWidth,
-            Tags::WindowCenter,
-            Tags::PixelSpacing,
-            Tags::ImagePositionPatient,
-            Tags::ImageOrientationPatient,
-            Tags::PatientPosition,
-            Tags::NumberOfSeriesRelatedInstances,
-            Tags::NumberOfStudyRelatedSeries
-        };
-        *pFile = std::make_shared<DicomFile>(path, tags);
-        return S_OK;
-    }
+        // Buffered values, back to back
+        std::vector<char> m_arena;
+        Application::Infrastructure::MappedFile m_mappedFile;
+	};
 
 }
\ No newline at end of file
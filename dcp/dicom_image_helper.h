@@ -23,20 +23,274 @@ enum class ImageProperty
 };
 
 template <ImageProperty TProperty> struct PropertyToTagMapper;
-template <> struct PropertyToTagMapper<ImageProperty::BitsAllocated> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::BitsAllocated>::Tag = Tags::BitsAllocated;
-template <> struct PropertyToTagMapper<ImageProperty::Columns> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::Columns>::Tag = Tags::Columns;
-template <> struct PropertyToTagMapper<ImageProperty::PixelData> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::PixelData>::Tag = Tags::PixelData;
-template <> struct PropertyToTagMapper<ImageProperty::Rows> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::Rows>::Tag = Tags::Rows;
-template <> struct PropertyToTagMapper<ImageProperty::SamplesPerPixel> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::SamplesPerPixel>::Tag = Tags::SamplesPerPixel;
-template <> struct PropertyToTagMapper<ImageProperty::WindowCenter> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::WindowCenter>::Tag = Tags::WindowCenter;
-template <> struct PropertyToTagMapper<ImageProperty::WindowRange> { static const DicomTag Tag; };
-__declspec(selectany) const DicomTag PropertyToTagMapper<ImageProperty::WindowRange>::Tag = Tags::WindowWidth;
+template <> struct PropertyToTagMapper<ImageProperty::BitsAllocated> { static constexpr const DicomTag& Tag = Tags::BitsAllocated; };
+template <> struct PropertyToTagMapper<ImageProperty::Columns> { static constexpr const DicomTag& Tag = Tags::Columns; };
+template <> struct PropertyToTagMapper<ImageProperty::PixelData> { static constexpr const DicomTag& Tag = Tags::PixelData; };
+template <> struct PropertyToTagMapper<ImageProperty::Rows> { static constexpr const DicomTag& Tag = Tags::Rows; };
+template <> struct PropertyToTagMapper<ImageProperty::SamplesPerPixel> { static constexpr const DicomTag& Tag = Tags::SamplesPerPixel; };
+template <> struct PropertyToTagMapper<ImageProperty::WindowCenter> { static constexpr const DicomTag& Tag = Tags::WindowCenter; };
+template <> struct PropertyToTagMapper<ImageProperty::WindowRange> { static constexpr const DicomTag& Tag = Tags::WindowWidth; };
+
+// Tags parsed out of every slice: the ones behind the image properties and the
+// ones used to place the slice in the scene
+using MetadataTags = DicomTagSet<
+    PropertyToTagMapper<ImageProperty::BitsAllocated>::Tag,
+    PropertyToTagMapper<ImageProperty::Columns>::Tag,
+    PropertyToTagMapper<ImageProperty::Rows>::Tag,
+    PropertyToTagMapper<ImageProperty::SamplesPerPixel>::Tag,
+    PropertyToTagMapper<ImageProperty::WindowCenter>::Tag,
+    PropertyToTagMapper<ImageProperty::WindowRange>::Tag,
+    Tags::TransferSyntaxUID,
+    Tags::SliceThickness,
+    Tags::PixelSpacing,
+    Tags::ImagePositionPatient,
+    Tags::ImageOrientationPatient,
+    Tags::PatientPosition,
+    Tags::NumberOfSeriesRelatedInstances,
+    Tags::NumberOfStudyRelatedSeries>;
+
+using ImageTags = MetadataTags::With<PropertyToTagMapper<ImageProperty::PixelData>::Tag>;
+
+namespace Details
+{
+    // Values of a DS or IS attribute are padded with spaces, and some writers
+    // pad them with a NUL instead
+    inline bool IsValuePadding(char c)
+    {
+        return c == ' ' || c == '\0';
+    }
+
+    inline void TrimValue(const char** begin, const char** end)
+    {
+        while (*begin != *end && IsValuePadding(**begin))
+        {
+            (*begin)++;
+        }
+        while (*end != *begin && IsValuePadding(*(*end - 1)))
+        {
+            (*end)--;
+        }
+    }
+}
+
+/// <summary>
+/// Parses a single decimal string (DS) value without allocating. Values with
+/// up to 15 significant digits and a small exponent are converted exactly
+/// with one double multiply or divide, the rest go through strtod on a stack
+/// copy, so the result always matches wcstod.
+/// </summary>
+inline HRESULT ParseDecimalString(const char* begin, const char* end, _Out_ float* value)
+{
+    RETURN_HR_IF_NULL(E_POINTER, value);
+    Details::TrimValue(&begin, &end);
+
+    // DS values are at most 16 characters
+    const size_t MaxValueLength = 64;
+    RETURN_HR_IF(E_INVALIDARG, begin == end || static_cast<size_t>(end - begin) >= MaxValueLength);
+
+    static const double PowersOf10[] =
+    {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    auto current = begin;
+    bool isNegative = false;
+    if (*current == '+' || *current == '-')
+    {
+        isNegative = *current == '-';
+        current++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool hasDigits = false;
+    for (; current != end && *current >= '0' && *current <= '9'; current++)
+    {
+        hasDigits = true;
+        if (mantissa != 0 || *current != '0')
+        {
+            mantissa = mantissa * 10 + (*current - '0');
+            digits++;
+        }
+    }
+    if (current != end && *current == '.')
+    {
+        for (current++; current != end && *current >= '0' && *current <= '9'; current++)
+        {
+            hasDigits = true;
+            if (mantissa != 0 || *current != '0')
+            {
+                mantissa = mantissa * 10 + (*current - '0');
+                digits++;
+            }
+            exponent--;
+        }
+    }
+    RETURN_HR_IF_FALSE(E_INVALIDARG, hasDigits);
+
+    if (current != end && (*current == 'e' || *current == 'E'))
+    {
+        current++;
+        bool isExponentNegative = false;
+        if (current != end && (*current == '+' || *current == '-'))
+        {
+            isExponentNegative = *current == '-';
+            current++;
+        }
+        RETURN_HR_IF(E_INVALIDARG, current == end);
+
+        int explicitExponent = 0;
+        for (; current != end && *current >= '0' && *current <= '9'; current++)
+        {
+            explicitExponent = (std::min)(explicitExponent * 10 + (*current - '0'), 1000);
+        }
+        exponent += isExponentNegative ? -explicitExponent : explicitExponent;
+    }
+    RETURN_HR_IF(E_INVALIDARG, current != end);
+
+    double result;
+    if (digits <= 15 && exponent >= -22 && exponent <= 22)
+    {
+        // The mantissa and the power of 10 are both exact doubles, so the
+        // product or quotient is correctly rounded
+        result = static_cast<double>(mantissa);
+        result = exponent < 0 ? result / PowersOf10[-exponent] : result * PowersOf10[exponent];
+        result = isNegative ? -result : result;
+    }
+    else
+    {
+        char buffer[MaxValueLength];
+        memcpy(buffer, begin, end - begin);
+        buffer[end - begin] = '\0';
+        result = strtod(buffer, nullptr);
+    }
+
+    *value = static_cast<float>(result);
+    return S_OK;
+}
+
+/// <summary>
+/// Parses a single integer string (IS) value without allocating.
+/// </summary>
+inline HRESULT ParseIntegerString(const char* begin, const char* end, _Out_ int* value)
+{
+    RETURN_HR_IF_NULL(E_POINTER, value);
+    Details::TrimValue(&begin, &end);
+
+    auto current = begin;
+    bool isNegative = false;
+    if (current != end && (*current == '+' || *current == '-'))
+    {
+        isNegative = *current == '-';
+        current++;
+    }
+    RETURN_HR_IF(E_INVALIDARG, current == end);
+
+    // IS values are at most 12 characters and fit in 32 bits
+    int64_t result = 0;
+    for (; current != end; current++)
+    {
+        RETURN_HR_IF(E_INVALIDARG, *current < '0' || *current > '9');
+        result = result * 10 + (*current - '0');
+        RETURN_HR_IF(E_INVALIDARG, result > static_cast<int64_t>(INT32_MAX) + 1);
+    }
+    result = isNegative ? -result : result;
+    RETURN_HR_IF(E_INVALIDARG, result > INT32_MAX);
+
+    *value = static_cast<int>(result);
+    return S_OK;
+}
+
+/// <summary>
+/// Parses the backslash separated values of a multi valued DS attribute.
+/// Fails unless there are exactly N values.
+/// </summary>
+template <size_t N>
+HRESULT ParseDecimalStrings(const AttributeView& view, _Out_ float (&values)[N])
+{
+    auto current = view.begin();
+    for (size_t i = 0; i < N; i++)
+    {
+        auto next = std::find(current, view.end(), '\\');
+        RETURN_HR_IF(E_INVALIDARG, (next == view.end()) != (i == N - 1));
+        RETURN_IF_FAILED(ParseDecimalString(current, next, &values[i]));
+        current = next == view.end() ? next : next + 1;
+    }
+    return S_OK;
+}
+
+/// <summary>
+/// Where a slice is in the scene, parsed once from its DS attributes.
+/// </summary>
+struct SliceGeometry
+{
+    // ImagePositionPatient
+    float Position[3];
+    // ImageOrientationPatient, the row then the column direction cosines
+    float Orientation[6];
+
+    // The row and column direction cosines are orthonormal, so their cross
+    // product is the direction in which slices are stacked
+    HRESULT GetNormal(_Out_ float (&normal)[3]) const
+    {
+        normal[0] = Orientation[1] * Orientation[5] - Orientation[2] * Orientation[4];
+        normal[1] = Orientation[2] * Orientation[3] - Orientation[0] * Orientation[5];
+        normal[2] = Orientation[0] * Orientation[4] - Orientation[1] * Orientation[3];
+
+        float normalLength = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        RETURN_HR_IF(E_INVALIDARG, normalLength == 0.f);
+        for (auto& component : normal)
+        {
+            component /= normalLength;
+        }
+        return S_OK;
+    }
+};
+
+inline HRESULT GetSliceGeometry(const std::shared_ptr<DicomFile>& file, _Out_ SliceGeometry* geometry)
+{
+    RETURN_HR_IF_NULL(E_POINTER, file);
+    RETURN_HR_IF_NULL(E_POINTER, geometry);
+
+    AttributeView position;
+    RETURN_IF_FAILED(file->GetAttributeView(Tags::ImagePositionPatient, &position));
+    RETURN_IF_FAILED(ParseDecimalStrings(position, geometry->Position));
+
+    AttributeView orientation;
+    RETURN_IF_FAILED(file->GetAttributeView(Tags::ImageOrientationPatient, &orientation));
+    RETURN_IF_FAILED(ParseDecimalStrings(orientation, geometry->Orientation));
+    return S_OK;
+}
+
+inline HRESULT MakeDicomMetadataFile(const std::wstring& path, std::shared_ptr<DicomFile>* pFile)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pFile);
+    *pFile = std::make_shared<DicomFile>(path, MetadataTags::GetFilter());
+    return S_OK;
+}
+
+inline HRESULT MakeDicomImageFile(
+    const std::wstring& path,
+    std::shared_ptr<DicomFile>* pFile,
+    DicomFileMode mode = DicomFileMode::Mapped)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pFile);
+    *pFile = std::make_shared<DicomFile>(path, ImageTags::GetFilter(), mode);
+    return S_OK;
+}
+
+inline HRESULT MakeDicomImageFile(
+    const std::shared_ptr<DicomFile>& metadataFile,
+    std::shared_ptr<DicomFile>* pFile,
+    DicomFileMode mode = DicomFileMode::Mapped)
+{
+    RETURN_HR_IF_NULL(E_POINTER, metadataFile);
+    RETURN_HR_IF_NULL(E_POINTER, pFile);
+    *pFile = std::make_shared<DicomFile>(*metadataFile, ImageTags::GetFilter(), mode);
+    return S_OK;
+}
 
 template <ImageProperty TProperty> struct Property
 {
@@ -58,26 +312,29 @@ template <> struct Property<ImageProperty::Spacings>
     static std::vector<T> SafeGet(std::shared_ptr<DicomFile> file)
     {
         // Spatial spacing
-        std::wstring pixelSpacing;
-        FAIL_FAST_IF_FAILED(file->GetAttribute(DCM::Tags::PixelSpacing, &pixelSpacing));
-        auto spacings = GetAsFloatVector(pixelSpacing);
+        AttributeView pixelSpacing;
+        FAIL_FAST_IF_FAILED(file->GetAttributeView(DCM::Tags::PixelSpacing, &pixelSpacing));
+        float spacings[2];
+        FAIL_FAST_IF_FAILED(ParseDecimalStrings(pixelSpacing, spacings));
         std::vector<T> outSpacings(3);
         outSpacings[0] = static_cast<T>(spacings[0]);
         outSpacings[1] = static_cast<T>(spacings[1]);
 
-        std::wstring sliceThickness;
-        FAIL_FAST_IF_FAILED(file->GetAttribute(DCM::Tags::SliceThickness, &sliceThickness));
-        outSpacings[2] = static_cast<T>(ParseFloat(sliceThickness));
+        AttributeView sliceThickness;
+        FAIL_FAST_IF_FAILED(file->GetAttributeView(DCM::Tags::SliceThickness, &sliceThickness));
+        float thickness;
+        FAIL_FAST_IF_FAILED(ParseDecimalString(sliceThickness.begin(), sliceThickness.end(), &thickness));
+        outSpacings[2] = static_cast<T>(thickness);
         return outSpacings;
     }
 };
 
 template <> struct Property<ImageProperty::PixelData>
 {
-    static std::vector<char>* SafeGet(std::shared_ptr<DicomFile> file)
+    static AttributeView SafeGet(std::shared_ptr<DicomFile> file)
     {
-        std::vector<char>* value;
-        FAIL_FAST_IF_FAILED(file->GetAttributeReference(Tags::PixelData, &value));
+        AttributeView value;
+        FAIL_FAST_IF_FAILED(file->GetAttributeView(Tags::PixelData, &value));
         return value;
     }
 };
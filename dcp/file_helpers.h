@@ -11,6 +11,12 @@ namespace DCM
 
 enum FileType { Directory, File };
 
+#ifdef _WIN32
+namespace fs = std::experimental::filesystem;
+#else
+namespace fs = std::filesystem;
+#endif
+
 inline HRESULT GetChildren(
     const std::wstring& input,
     std::vector<std::wstring>* children,
@@ -19,20 +25,16 @@ inline HRESULT GetChildren(
     RETURN_HR_IF_NULL(E_POINTER, children);
     children->clear();
 
-    namespace fs = std::experimental::filesystem;
-
     for (auto& file : fs::directory_iterator(input))
     {
-        std::wstring path = file.path();
-        DWORD dwAttrib = GetFileAttributes(path.c_str());
+        std::wstring path = file.path().wstring();
+        bool isDirectory = fs::is_directory(file.status());
 
-        if (type == FileType::Directory &&
-            (dwAttrib & FILE_ATTRIBUTE_DIRECTORY))
+        if (type == FileType::Directory && isDirectory)
         {
             children->push_back(std::move(path));
         }
-        else if (type == FileType::File &&
-                (dwAttrib & FILE_ATTRIBUTE_DIRECTORY) == 0)
+        else if (type == FileType::File && !isDirectory)
         {
             children->push_back(std::move(path));
         }
@@ -41,124 +43,180 @@ inline HRESULT GetChildren(
     return S_OK;
 }
 
-inline HRESULT GetMetadataFiles(std::wstring inputFolder, std::vector<std::shared_ptr<DicomFile>>* outFiles)
+// Headers are parsed on several threads, each of which has at most one file
+// open. This bounds the reads in flight on slow (network) storage.
+const unsigned MaxMetadataFilesInFlight = 16;
+
+// Sidecar written into series folders by SeriesIndex, it is not a slice
+const wchar_t SeriesIndexFileName[] = L".dcp-series-index";
+
+// Returns the slices of a series folder, sorted by name
+inline HRESULT GetSliceFileNames(const std::wstring& inputFolder, std::vector<std::wstring>* fileNames)
+{
+    RETURN_HR_IF_NULL(E_POINTER, fileNames);
+    RETURN_IF_FAILED(GetChildren(inputFolder, fileNames));
+
+    fileNames->erase(
+        std::remove_if(
+            std::begin(*fileNames),
+            std::end(*fileNames),
+            [](const std::wstring& fileName)
+            {
+                return fs::path(fileName).filename().wstring() == SeriesIndexFileName;
+            }),
+        std::end(*fileNames));
+
+    // Directory enumeration order is file system dependent
+    std::sort(std::begin(*fileNames), std::end(*fileNames));
+    return S_OK;
+}
+
+inline HRESULT GetMetadataFiles(
+    const std::vector<std::wstring>& children,
+    std::vector<std::shared_ptr<DicomFile>>* outFiles,
+    unsigned maxFilesInFlight = MaxMetadataFilesInFlight)
 {
     RETURN_HR_IF_NULL(E_POINTER, outFiles);
     outFiles->clear();
 
-    std::vector<std::wstring> children;
-    RETURN_IF_FAILED(GetChildren(inputFolder, &children));
-
+    // Each file is written to its own slot, so the result is in the same order
+    // no matter which thread parsed it
     std::vector<std::shared_ptr<DicomFile>> metadataFiles(children.size());
-    std::transform(std::begin(children), std::end(children), std::begin(metadataFiles),
-        [](const std::wstring& fileName)
+    std::atomic<size_t> nextFile(0);
+    auto parseFiles =
+        [&children, &metadataFiles, &nextFile]()
         {
-            std::shared_ptr<DicomFile> dicomFile;
-            FAIL_FAST_IF_FAILED(MakeDicomMetadataFile(fileName, &dicomFile));
-            return dicomFile;
-        });
+            for (auto i = nextFile++; i < children.size(); i = nextFile++)
+            {
+                FAIL_FAST_IF_FAILED(MakeDicomMetadataFile(children[i], &metadataFiles[i]));
+            }
+        };
+
+    // Parsing is mostly waiting on reads, so this is not limited to the number
+    // of cores
+    auto nThreads = (std::min)(static_cast<size_t>((std::max)(1u, maxFilesInFlight)), children.size());
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nThreads; i++)
+    {
+        threads.emplace_back(parseFiles);
+    }
+    parseFiles();
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
 
-    *outFiles = metadataFiles;
+    *outFiles = std::move(metadataFiles);
 
     return S_OK;
 }
 
-inline float ParseFloat(const std::wstring& str)
+inline HRESULT GetMetadataFiles(
+    const std::wstring& inputFolder,
+    std::vector<std::shared_ptr<DicomFile>>* outFiles,
+    unsigned maxFilesInFlight = MaxMetadataFilesInFlight)
 {
-    wchar_t* stopString;
-    return static_cast<float>(wcstod(str.c_str(), &stopString));
+    std::vector<std::wstring> children;
+    RETURN_IF_FAILED(GetSliceFileNames(inputFolder, &children));
+    return GetMetadataFiles(children, outFiles, maxFilesInFlight);
 }
 
-inline std::vector<float> GetAsFloatVector(const std::wstring& str)
+// Sort the files, together with their geometries, by their order in the scene
+inline HRESULT SortFilesInScene(
+    std::vector<std::shared_ptr<DicomFile>>* outFiles,
+    std::vector<SliceGeometry>* outGeometries)
 {
-    std::wistringstream wisstream(str);
-    std::vector<float> values;
-    std::wstring token;
-    while (std::getline(wisstream, token, L'\\'))
+    RETURN_HR_IF_NULL(E_POINTER, outFiles);
+    RETURN_HR_IF_NULL(E_POINTER, outGeometries);
+    RETURN_HR_IF(E_INVALIDARG, outFiles->empty());
+    RETURN_HR_IF(E_INVALIDARG, outFiles->size() != outGeometries->size());
+    auto& files = *outFiles;
+    auto& geometries = *outGeometries;
+
+    // Ensure all images are oriented in same direction
+    for (auto& geometry : geometries)
     {
-        wchar_t* stopString;
-        values.push_back(static_cast<float>(wcstod(token.c_str(), &stopString)));
+        FAIL_FAST_IF_FALSE(
+            std::equal(
+                std::begin(geometry.Orientation),
+                std::end(geometry.Orientation),
+                std::begin(geometries[0].Orientation)));
     }
-    return values;
-}
 
+    // The depth of a slice in the frame of the first image is its offset
+    // projected onto the normal
+    float normal[3];
+    FAIL_FAST_IF_FAILED(geometries[0].GetNormal(normal));
+
+    struct SortKey
+    {
+        float Depth;
+        unsigned Index;
+    };
+
+    auto& firstPosition = geometries[0].Position;
+    std::vector<SortKey> keys(files.size());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        auto& position = geometries[i].Position;
+        keys[i].Depth =
+            (position[0] - firstPosition[0]) * normal[0] +
+            (position[1] - firstPosition[1]) * normal[1] +
+            (position[2] - firstPosition[2]) * normal[2];
+        keys[i].Index = static_cast<unsigned>(i);
+    }
+
+    // Sort the files by their order in the scene
+    std::sort(std::begin(keys), std::end(keys),
+        [](const SortKey& left, const SortKey& right)
+        {
+            return left.Depth > right.Depth || (left.Depth == right.Depth && left.Index < right.Index);
+        });
+
+    std::vector<std::shared_ptr<DicomFile>> sortedFiles;
+    std::vector<SliceGeometry> sortedGeometries;
+    sortedFiles.reserve(files.size());
+    sortedGeometries.reserve(files.size());
+    for (auto& key : keys)
+    {
+        sortedFiles.push_back(std::move(files[key.Index]));
+        sortedGeometries.push_back(geometries[key.Index]);
+    }
+    files.swap(sortedFiles);
+    geometries.swap(sortedGeometries);
 
+    return S_OK;
+}
 
 // Sort the files by their order in the scene
 inline HRESULT SortFilesInScene(std::vector<std::shared_ptr<DicomFile>>* outFiles)
 {
-    // Get orientation
-    auto firstFile = outFiles->at(0);
-
-    std::wstring firstImageOrientation;
-    firstFile->GetAttribute(Tags::ImageOrientationPatient, &firstImageOrientation);
+    RETURN_HR_IF_NULL(E_POINTER, outFiles);
+    RETURN_HR_IF(E_INVALIDARG, outFiles->empty());
+    auto& files = *outFiles;
 
     // Ensure all images are oriented in same direction
-    auto foundNotMatchingIt =
-        std::find_if(
-            std::begin(*outFiles), std::end(*outFiles),
-            [&firstImageOrientation](auto dicomFile) {
-                std::wstring imageOrientation;
-                dicomFile->GetAttribute(Tags::ImageOrientationPatient, &imageOrientation);
-                return _wcsicmp(imageOrientation.c_str(), firstImageOrientation.c_str()) != 0;
-            });
-    
-    FAIL_FAST_IF_FALSE(foundNotMatchingIt == std::end(*outFiles));
-
-    // Get first images position
-    std::wstring firstImagePosition;
-    firstFile->GetAttribute(Tags::ImagePositionPatient, &firstImagePosition);
-    auto posValues = GetAsFloatVector(firstImagePosition);
-    FAIL_FAST_IF_TRUE(posValues.size() != 3);
+    AttributeView firstImageOrientation;
+    FAIL_FAST_IF_FAILED(files[0]->GetAttributeView(Tags::ImageOrientationPatient, &firstImageOrientation));
+    for (auto& file : files)
+    {
+        AttributeView imageOrientation;
+        FAIL_FAST_IF_FAILED(file->GetAttributeView(Tags::ImageOrientationPatient, &imageOrientation));
+        FAIL_FAST_IF_FALSE(
+            imageOrientation.size() == firstImageOrientation.size() &&
+            memcmp(imageOrientation.data(), firstImageOrientation.data(), imageOrientation.size()) == 0);
+    }
 
-    // Construct image frame of reference to zorder files
-    auto orientationValues = GetAsFloatVector(firstImageOrientation);
-    FAIL_FAST_IF_TRUE(orientationValues.size() != 6);
-    
-    auto xaxis = DirectX::XMVectorSet(
-        orientationValues[0],
-        orientationValues[1],
-        orientationValues[2],
-        0.f);
-    auto yaxis = DirectX::XMVectorSet(
-        orientationValues[3],
-        orientationValues[4],
-        orientationValues[5],
-        0.f);
-    auto zaxis = DirectX::XMVector3Normalize(DirectX::XMVector3Cross(xaxis, yaxis));
-    
-    const DirectX::XMFLOAT4X4 refFrameToWorld4x4(
-        orientationValues[0], orientationValues[1], orientationValues[2], 0,
-        orientationValues[3], orientationValues[4], orientationValues[5], 0,
-        DirectX::XMVectorGetX(zaxis), DirectX::XMVectorGetY(zaxis), DirectX::XMVectorGetZ(zaxis), 0,
-        posValues[0], posValues[1], posValues[2], 1
-    );
-
-    auto refFrameToWorld = DirectX::XMLoadFloat4x4(&refFrameToWorld4x4);
-    DirectX::XMVECTOR determinant;
-    auto worldToRefFrame = DirectX::XMMatrixInverse(&determinant, refFrameToWorld);
-    
-    // Sort the files by their order in the scene
-    std::sort(std::begin(*outFiles), std::end(*outFiles),
-        [&worldToRefFrame](auto left, auto right)
-        {
-            std::wstring leftImagePosition, rightImagePosition;
-            left->GetAttribute(Tags::ImagePositionPatient, &leftImagePosition);
-            auto leftPosValues = GetAsFloatVector(leftImagePosition);
-            FAIL_FAST_IF_TRUE(leftPosValues.size() != 3);
-            auto leftVec = DirectX::XMVectorSet(leftPosValues[0], leftPosValues[1], leftPosValues[2], 1.f);
-            leftVec = DirectX::XMVector4Transform(leftVec, worldToRefFrame);
-
-            right->GetAttribute(Tags::ImagePositionPatient, &rightImagePosition);
-            auto rightPosValues = GetAsFloatVector(rightImagePosition);
-            FAIL_FAST_IF_TRUE(rightPosValues.size() != 3);
-            auto rightVec = DirectX::XMVectorSet(rightPosValues[0], rightPosValues[1], rightPosValues[2], 1.f);
-            rightVec = DirectX::XMVector4Transform(rightVec, worldToRefFrame);
-
-            return DirectX::XMVectorGetZ(leftVec) > DirectX::XMVectorGetZ(rightVec);
-        });
+    // Parse the positions once per file rather than once per comparison
+    std::vector<SliceGeometry> geometries(files.size());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        FAIL_FAST_IF_FAILED(GetSliceGeometry(files[i], &geometries[i]));
+    }
 
-    return S_OK;
+    return SortFilesInScene(outFiles, &geometries);
 }
 
 #ifdef _DEBUG
@@ -178,6 +236,30 @@ HRESULT Log(const wchar_t*, TArgs&&...)
 }
 #endif
 
+inline bool IsVolumeFile(const std::wstring& fileName)
+{
+    return fileName.size() >= 3 && fileName.rfind(L".dd") == fileName.size() - 3;
+}
+
+inline bool IsChunkedVolumeFile(const std::wstring& fileName)
+{
+    return fileName.size() >= 4 && fileName.rfind(L".ddc") == fileName.size() - 4;
+}
+
+// Written chunked and compressed when the name ends in .ddc
+inline HRESULT SaveToFile(
+    const void* pData,
+    const VolumeDescription& description,
+    const wchar_t* pFileName)
+{
+    RETURN_HR_IF_NULL(E_INVALIDARG, pFileName);
+    if (IsChunkedVolumeFile(pFileName))
+    {
+        return ChunkedVolumeFile::Save(pData, description, pFileName);
+    }
+    return VolumeFile::Save(pData, description, pFileName);
+}
+
 inline HRESULT SaveToFile(
     const float* data,
     unsigned width,
@@ -185,22 +267,13 @@ inline HRESULT SaveToFile(
     unsigned bytesPerPixel,
     const wchar_t* pFileName)
 {
-    std::ofstream stream(pFileName, std::ios_base::trunc | std::ios_base::binary | std::ios_base::out);
-
-    stream.write(reinterpret_cast<const char*>(&width), sizeof(unsigned));
-    stream.write(reinterpret_cast<const char*>(&height), sizeof(unsigned));
-    stream.write(reinterpret_cast<const char*>(&bytesPerPixel), sizeof(unsigned));
-    stream.write(reinterpret_cast<const char*>(data), width * height * bytesPerPixel);
-    return S_OK;
+    return SaveToFile(data, VolumeDescription::FromMosaic(width, height, bytesPerPixel), pFileName);
 }
 
-
 inline HRESULT SaveToFile(
     Application::Infrastructure::DeviceResources& resources,
     ID3D11Buffer* pBuffer,
-    unsigned width,
-    unsigned height,
-    unsigned bytesPerPixel,
+    const VolumeDescription& description,
     const wchar_t* pFileName)
 {
     RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
@@ -213,39 +286,39 @@ inline HRESULT SaveToFile(
     D3D11_MAPPED_SUBRESOURCE mappedResource;
     RETURN_IF_FAILED(resources.Map(spCopy.Get(), &mappedResource));
 
-    auto data = reinterpret_cast<float*>(mappedResource.pData);
-    std::ofstream stream(pFileName, std::ios_base::trunc | std::ios_base::binary | std::ios_base::out);
+    auto hr = SaveToFile(mappedResource.pData, description, pFileName);
 
-    stream.write(reinterpret_cast<const char*>(&width), sizeof(unsigned));
-    stream.write(reinterpret_cast<const char*>(&height), sizeof(unsigned));
-    stream.write(reinterpret_cast<const char*>(&bytesPerPixel), sizeof(unsigned));
-    stream.write(reinterpret_cast<const char*>(data), width * height * bytesPerPixel);
+    RETURN_IF_FAILED(resources.Unmap(spCopy.Get()));
+    RETURN_IF_FAILED(hr);
 
     return S_OK;
 }
 
-
 inline HRESULT SaveToFile(
     Application::Infrastructure::DeviceResources& resources,
     ID3D11Buffer* pBuffer,
     unsigned width,
     unsigned height,
     unsigned bytesPerPixel,
-    WICPixelFormatGUID& format,
     const wchar_t* pFileName)
 {
-    RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
-    RETURN_HR_IF_NULL(E_INVALIDARG, pFileName);
+    return SaveToFile(resources, pBuffer, VolumeDescription::FromMosaic(width, height, bytesPerPixel), pFileName);
+}
 
-    // Copy resource
-    Microsoft::WRL::ComPtr<ID3D11Buffer> spCopy;
-    RETURN_IF_FAILED(resources.GetBufferOnCPU(pBuffer, &spCopy));
 
-    D3D11_MAPPED_SUBRESOURCE mappedResource;
-    RETURN_IF_FAILED(resources.Map(spCopy.Get(), &mappedResource));
+inline HRESULT SaveToFile(
+    Application::Infrastructure::DeviceResources& resources,
+    const void* pData,
+    unsigned width,
+    unsigned height,
+    unsigned bytesPerPixel,
+    WICPixelFormatGUID& format,
+    const wchar_t* pFileName)
+{
+    RETURN_HR_IF_NULL(E_INVALIDARG, pData);
+    RETURN_HR_IF_NULL(E_INVALIDARG, pFileName);
 
-    // Set a break point here and put down the expression "p, 1024" in your watch window to see what has been written out by our CS
-    // This is also a common trick to debug CS programs.
+#ifdef _WIN32
     Microsoft::WRL::ComPtr<IWICBitmap> spBitmap;
     RETURN_IF_FAILED(resources.GetWicImagingFactory()->CreateBitmapFromMemory(
         width,
@@ -253,7 +326,7 @@ inline HRESULT SaveToFile(
         format,
         bytesPerPixel * width,
         bytesPerPixel * width * height,
-        reinterpret_cast<BYTE*>(mappedResource.pData),
+        const_cast<BYTE*>(reinterpret_cast<const BYTE*>(pData)),
         &spBitmap));
 
     Microsoft::WRL::ComPtr<IWICBitmapEncoder> spEncoder;
@@ -288,11 +361,53 @@ inline HRESULT SaveToFile(
     RETURN_IF_FAILED(spFrameEncode->Commit());
     RETURN_IF_FAILED(spEncoder->Commit());
 
+#else
+    // Encoding image containers requires WIC, write the raw .dd layout instead.
+    UNREFERENCED_PARAMETER(resources);
+    Log(L"WIC is unavailable, writing %ls as raw data.", pFileName);
+
+    auto description = VolumeDescription::FromMosaic(width, height, bytesPerPixel);
+    if (memcmp(&format, &GUID_WICPixelFormat64bppRGBA, sizeof(format)) == 0)
+    {
+        description.DataType = VolumeDataType::UInt16;
+        description.Channels = 4;
+    }
+    RETURN_IF_FAILED(SaveToFile(pData, description, pFileName));
+#endif
+
+    return S_OK;
+}
+
+inline HRESULT SaveToFile(
+    Application::Infrastructure::DeviceResources& resources,
+    ID3D11Buffer* pBuffer,
+    unsigned width,
+    unsigned height,
+    unsigned bytesPerPixel,
+    WICPixelFormatGUID& format,
+    const wchar_t* pFileName)
+{
+    RETURN_HR_IF_NULL(E_INVALIDARG, pBuffer);
+    RETURN_HR_IF_NULL(E_INVALIDARG, pFileName);
+
+    // Copy resource
+    Microsoft::WRL::ComPtr<ID3D11Buffer> spCopy;
+    RETURN_IF_FAILED(resources.GetBufferOnCPU(pBuffer, &spCopy));
+
+    D3D11_MAPPED_SUBRESOURCE mappedResource;
+    RETURN_IF_FAILED(resources.Map(spCopy.Get(), &mappedResource));
+
+    // Set a break point here and put down the expression "p, 1024" in your watch window to see what has been written out by our CS
+    // This is also a common trick to debug CS programs.
+    auto hr = SaveToFile(resources, mappedResource.pData, width, height, bytesPerPixel, format, pFileName);
+
     RETURN_IF_FAILED(resources.Unmap(spCopy.Get()));
+    RETURN_IF_FAILED(hr);
 
     return S_OK;
 }
 
+#ifdef _WIN32
 inline HRESULT GetWicBitmapFromFilename(
     Application::Infrastructure::DeviceResources& resources,
     const wchar_t* pwzInputFile,
@@ -326,7 +441,9 @@ inline HRESULT GetWicBitmapFromFilename(
     RETURN_IF_FAILED(spConverter.CopyTo(ppSource));
     return S_OK;
 }
+#endif
 
+// Volumes come back as their mosaic, see VolumeDescription
 template <typename T>
 HRESULT GetBufferFromGrayscaleDicomData(
     const wchar_t* pwzInputFile,
@@ -335,20 +452,81 @@ HRESULT GetBufferFromGrayscaleDicomData(
     unsigned* pHeight,
     unsigned* pChannels)
 {
-    unsigned bytesPerPixel;
-    std::ifstream stream(pwzInputFile, std::ios_base::binary);
+    VolumeFile file;
+    RETURN_IF_FAILED(file.Open(pwzInputFile));
 
-    stream.read(reinterpret_cast<char*>(pWidth), sizeof(unsigned));
-    stream.read(reinterpret_cast<char*>(pHeight), sizeof(unsigned));
-    stream.read(reinterpret_cast<char*>(&bytesPerPixel), sizeof(unsigned));
+    const T* pVoxels;
+    RETURN_IF_FAILED(file.GetData(&pVoxels));
 
-    RETURN_HR_IF_FALSE(E_FAIL, bytesPerPixel == sizeof(T));
-    *pChannels = 1;
+    auto& description = file.GetDescription();
+    *pWidth = description.GetMosaicWidth();
+    *pHeight = description.Height;
+    *pChannels = description.Channels;
+    pData->assign(pVoxels, pVoxels + description.GetPayloadSize() / sizeof(T));
+    return S_OK;
+}
 
-    unsigned stride = bytesPerPixel * (*pWidth);
-    unsigned bufferSize = stride * (*pHeight);
-    pData->resize((*pWidth) * (*pHeight));
-    stream.read(reinterpret_cast<char *>(&pData->at(0)), bufferSize);
+template <typename T>
+HRESULT GetBufferFromChunkedVolume(
+    const wchar_t* pwzInputFile,
+    std::vector<T>* pData,
+    unsigned* pWidth,
+    unsigned* pHeight,
+    unsigned* pChannels)
+{
+    ChunkedVolumeFile file;
+    RETURN_IF_FAILED(file.Open(pwzInputFile));
+
+    auto& description = file.GetDescription();
+    RETURN_HR_IF(E_INVALIDARG, description.DataType != VolumeDataTypeOf<T>::Value);
+    pData->resize(static_cast<size_t>(description.GetPayloadSize() / sizeof(T)));
+    RETURN_IF_FAILED(file.Read(pData->data()));
+
+    *pWidth = description.GetMosaicWidth();
+    *pHeight = description.Height;
+    *pChannels = description.Channels;
+    return S_OK;
+}
+
+/// <summary>
+/// Shape and placement to write an image read with GetBufferFromGrayscaleImage
+/// back out with, or a result of the same size. A .dd or .ddc volume keeps its
+/// own, any other image is a single slice.
+/// </summary>
+inline HRESULT GetImageDescription(
+    const std::wstring& fileName,
+    unsigned width,
+    unsigned height,
+    unsigned channels,
+    VolumeDescription* pDescription)
+{
+    RETURN_HR_IF_NULL(E_POINTER, pDescription);
+
+    *pDescription = VolumeDescription::FromMosaic(width, height, sizeof(float) * channels);
+    VolumeFile file;
+    ChunkedVolumeFile chunkedFile;
+    const VolumeDescription* pFileDescription = nullptr;
+    if (IsVolumeFile(fileName))
+    {
+        RETURN_IF_FAILED(file.Open(fileName));
+        pFileDescription = &file.GetDescription();
+    }
+    else if (IsChunkedVolumeFile(fileName))
+    {
+        RETURN_IF_FAILED(chunkedFile.Open(fileName));
+        pFileDescription = &chunkedFile.GetDescription();
+    }
+
+    if (pFileDescription)
+    {
+        auto& description = *pFileDescription;
+        RETURN_HR_IF(E_INVALIDARG, description.GetMosaicWidth() != width || description.Height != height);
+
+        pDescription->Depth = description.Depth;
+        pDescription->Width = description.Width;
+        memcpy(pDescription->Spacing, description.Spacing, sizeof(description.Spacing));
+        memcpy(pDescription->Orientation, description.Orientation, sizeof(description.Orientation));
+    }
     return S_OK;
 }
 
@@ -366,12 +544,16 @@ HRESULT GetBufferFromGrayscaleImage(
     RETURN_HR_IF_NULL(E_FAIL, pHeight);
     RETURN_HR_IF_NULL(E_FAIL, pChannels);
 
-    std::wstring fileName(pwzInputFile);
-    if (fileName.rfind(L".dd") + 3 == fileName.size())
+    if (IsVolumeFile(pwzInputFile))
     {
         return GetBufferFromGrayscaleDicomData(pwzInputFile, pData, pWidth, pHeight, pChannels);
     }
+    if (IsChunkedVolumeFile(pwzInputFile))
+    {
+        return GetBufferFromChunkedVolume(pwzInputFile, pData, pWidth, pHeight, pChannels);
+    }
 
+#ifdef _WIN32
     Microsoft::WRL::ComPtr<IWICBitmapSource> spSource;
     RETURN_IF_FAILED(GetWicBitmapFromFilename(resources, pwzInputFile, &spSource));
     RETURN_IF_FAILED(spSource->GetSize(pWidth, pHeight));
@@ -398,22 +580,11 @@ HRESULT GetBufferFromGrayscaleImage(
     RETURN_IF_FAILED(spSource->CopyPixels(nullptr, stride, bufferSize, reinterpret_cast<unsigned char*>(&pData->at(0))));
 
     return S_OK;
-}
-
-inline HRESULT CreateShader(
-    Application::Infrastructure::DeviceResources& resources,
-    std::wstring shaderFile,
-    ID3D11ComputeShader** ppOutShader)
-{
+#else
+    // Decoding image containers requires WIC
     UNREFERENCED_PARAMETER(resources);
-    wchar_t pwzFileName[MAX_PATH + 1];
-    RETURN_HR_IF(E_FAIL, 0 == GetModuleFileName(NULL, pwzFileName, MAX_PATH + 1));
-    std::wstring shaderPath(pwzFileName);
-    shaderPath.erase(shaderPath.begin() + shaderPath.find_last_of(L'\\') + 1, shaderPath.end());
-    shaderPath += shaderFile;
-
-    RETURN_IF_FAILED(resources.CreateComputeShader(shaderPath.c_str(), "CSMain", ppOutShader));
-    return S_OK;
+    return E_NOTIMPL;
+#endif
 }
 
 
@@ -0,0 +1,484 @@
+//
+// series_index.h
+// Metadata of a series of slices, sorted by their position in the scene.
+//
+
+#pragma once
+
+namespace DCM
+{
+
+struct SeriesIndexEntry
+{
+    std::shared_ptr<DicomFile> File;
+    PixelDataLocation PixelData;
+    std::wstring TransferSyntax;
+};
+
+/// <summary>
+/// Sidecar kept in a series folder so that later runs over the same folder do
+/// not parse any headers. It is a header
+///     char        Magic[8]
+///     DWORD       Version
+///     DWORD       Checksum of the metadata tag ids
+///     DWORD       Number of entries
+/// followed by one entry per slice, in scene order
+///     DWORD       Length of the file name
+///     char[]      File name in UTF-8, without the folder
+///     int64_t     Last write time
+///     uint64_t    File size
+///     float[9]    ImagePositionPatient, ImageOrientationPatient
+///     DWORD       Length of the metadata record
+///     char[]      Metadata record, see DicomFile::WriteMetadataRecord
+/// An entry is only used while the last write time and size of its file are
+/// unchanged. Indexes are kept next to the slices unless an index folder is
+/// set, or indexing is disabled altogether.
+/// </summary>
+class SeriesIndexFile
+{
+public:
+    struct Entry
+    {
+        std::string FileName;
+        int64_t LastWriteTime;
+        uint64_t Size;
+        SliceGeometry Geometry;
+        // Into the mapped index
+        const char* pRecord;
+        size_t RecordSize;
+    };
+
+    static HRESULT GetFileStamp(const std::wstring& path, _Out_ int64_t* lastWriteTime, _Out_ uint64_t* size)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, lastWriteTime);
+        RETURN_HR_IF_NULL(E_POINTER, size);
+
+        std::error_code error;
+        auto writeTime = fs::last_write_time(path, error);
+        RETURN_HR_IF(E_FAIL, static_cast<bool>(error));
+        *size = static_cast<uint64_t>(fs::file_size(path, error));
+        RETURN_HR_IF(E_FAIL, static_cast<bool>(error));
+        *lastWriteTime = static_cast<int64_t>(writeTime.time_since_epoch().count());
+        return S_OK;
+    }
+
+    static std::string GetEntryName(const std::wstring& path)
+    {
+        return fs::path(path).filename().u8string();
+    }
+
+    // Must be called before the first series is loaded. An empty folder
+    // keeps the indexes next to the slices.
+    static void SetIndexFolder(const std::wstring& indexFolder)
+    {
+        GetSettings().IndexFolder = indexFolder;
+    }
+
+    // Must be called before the first series is loaded
+    static void SetIsEnabled(bool isEnabled)
+    {
+        GetSettings().IsEnabled = isEnabled;
+    }
+
+    // A missing or unreadable index is not an error, it is simply empty
+    HRESULT Open(const std::wstring& folder)
+    {
+        m_entries.clear();
+        if (!GetSettings().IsEnabled ||
+            FAILED(m_mappedFile.Open(GetIndexPath(folder))))
+        {
+            return S_OK;
+        }
+
+        std::vector<Entry> entries;
+        if (FAILED(ReadEntries(&entries)))
+        {
+            m_mappedFile.Close();
+            return S_OK;
+        }
+
+        m_entries = std::move(entries);
+        return S_OK;
+    }
+
+    const std::vector<Entry>& GetEntries() const
+    {
+        return m_entries;
+    }
+
+    // In an index folder the index of a series is named after a hash of the
+    // absolute path of the series, so series with the same name do not collide
+    static std::wstring GetIndexPath(const std::wstring& folder)
+    {
+        auto& indexFolder = GetSettings().IndexFolder;
+        if (indexFolder.empty())
+        {
+            return (fs::path(folder) / SeriesIndexFileName).wstring();
+        }
+
+        std::error_code error;
+        auto seriesPath = fs::absolute(folder, error).lexically_normal();
+        if (error)
+        {
+            seriesPath = fs::path(folder).lexically_normal();
+        }
+
+        uint64_t hash = 14695981039346656037ull;
+        for (auto c : seriesPath.u8string())
+        {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+
+        std::wstring hashText(16, L'0');
+        for (size_t i = 0; i < hashText.size(); i++)
+        {
+            hashText[hashText.size() - 1 - i] = L"0123456789abcdef"[(hash >> (4 * i)) & 0xF];
+        }
+
+        auto name = seriesPath.filename().wstring();
+        if (name.empty())
+        {
+            name = seriesPath.parent_path().filename().wstring();
+        }
+        return (fs::path(indexFolder) / (name + L"-" + hashText + SeriesIndexFileName)).wstring();
+    }
+
+    // Writes the index of a folder. Replacing the previous index is atomic,
+    // so concurrent runs over a folder read either index in full.
+    static HRESULT Save(
+        const std::wstring& folder,
+        const std::vector<std::shared_ptr<DicomFile>>& files,
+        const std::vector<SliceGeometry>& geometries)
+    {
+        RETURN_HR_IF(E_INVALIDARG, files.size() != geometries.size());
+        if (!GetSettings().IsEnabled)
+        {
+            return S_OK;
+        }
+
+        std::vector<char> buffer;
+        auto append =
+            [&buffer](const void* pData, size_t size)
+            {
+                auto offset = buffer.size();
+                buffer.resize(offset + size);
+                if (size != 0)
+                {
+                    memcpy(&buffer[offset], pData, size);
+                }
+            };
+
+        DWORD version = Version;
+        DWORD checksum = GetTagsChecksum();
+        DWORD nEntries = static_cast<DWORD>(files.size());
+        append(Magic, sizeof(Magic));
+        append(&version, sizeof(version));
+        append(&checksum, sizeof(checksum));
+        append(&nEntries, sizeof(nEntries));
+
+        std::vector<char> record;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            auto& path = files[i]->SafeGetFilename();
+            int64_t lastWriteTime;
+            uint64_t size;
+            RETURN_IF_FAILED(GetFileStamp(path, &lastWriteTime, &size));
+            RETURN_IF_FAILED(files[i]->WriteMetadataRecord(&record));
+
+            auto name = GetEntryName(path);
+            DWORD nameLength = static_cast<DWORD>(name.size());
+            DWORD recordSize = static_cast<DWORD>(record.size());
+            append(&nameLength, sizeof(nameLength));
+            append(name.data(), name.size());
+            append(&lastWriteTime, sizeof(lastWriteTime));
+            append(&size, sizeof(size));
+            append(geometries[i].Position, sizeof(geometries[i].Position));
+            append(geometries[i].Orientation, sizeof(geometries[i].Orientation));
+            append(&recordSize, sizeof(recordSize));
+            append(record.data(), record.size());
+        }
+
+        std::random_device random;
+        auto indexPath = GetIndexPath(folder);
+        if (!GetSettings().IndexFolder.empty())
+        {
+            std::error_code error;
+            fs::create_directories(GetSettings().IndexFolder, error);
+        }
+        auto temporaryPath = indexPath + L"." + std::to_wstring(random());
+        {
+            std::ofstream stream(ToNativePath(temporaryPath), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+            stream.write(buffer.data(), buffer.size());
+            stream.close();
+            if (stream.fail())
+            {
+                std::error_code error;
+                fs::remove(temporaryPath, error);
+                return E_FAIL;
+            }
+        }
+
+        std::error_code error;
+        fs::rename(temporaryPath, indexPath, error);
+        if (error)
+        {
+            fs::remove(temporaryPath, error);
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+private:
+    static constexpr char Magic[8] = { 'D', 'C', 'P', 'S', 'I', 'D', 'X', '\0' };
+    static const DWORD Version = 1;
+
+    struct Settings
+    {
+        bool IsEnabled = true;
+        std::wstring IndexFolder;
+    };
+
+    static Settings& GetSettings()
+    {
+        static Settings settings;
+        return settings;
+    }
+
+    // Records hold the values of these tags, so an index written for a
+    // different set is stale
+    static DWORD GetTagsChecksum()
+    {
+        auto& tags = MetadataTags::GetFilter();
+        DWORD checksum = 2166136261u;
+        for (unsigned i = 0; i < tags.Count; i++)
+        {
+            checksum = (checksum ^ tags.Ids[i]) * 16777619u;
+        }
+        return checksum;
+    }
+
+    HRESULT ReadEntries(std::vector<Entry>* entries)
+    {
+        Reader reader(m_mappedFile.GetData(), m_mappedFile.GetSize());
+
+        char magic[sizeof(Magic)];
+        DWORD version;
+        DWORD checksum;
+        DWORD nEntries;
+        RETURN_IF_FAILED(reader.Read(magic, sizeof(magic)));
+        RETURN_IF_FAILED(reader.Read(&version, sizeof(version)));
+        RETURN_IF_FAILED(reader.Read(&checksum, sizeof(checksum)));
+        RETURN_IF_FAILED(reader.Read(&nEntries, sizeof(nEntries)));
+        RETURN_HR_IF(E_FAIL, memcmp(magic, Magic, sizeof(Magic)) != 0);
+        RETURN_HR_IF(E_FAIL, version != Version);
+        RETURN_HR_IF(E_FAIL, checksum != GetTagsChecksum());
+
+        entries->resize(nEntries);
+        for (auto& entry : *entries)
+        {
+            DWORD nameLength;
+            RETURN_IF_FAILED(reader.Read(&nameLength, sizeof(nameLength)));
+            const char* pName;
+            RETURN_IF_FAILED(reader.Skip(nameLength, &pName));
+            entry.FileName.assign(pName, nameLength);
+
+            RETURN_IF_FAILED(reader.Read(&entry.LastWriteTime, sizeof(entry.LastWriteTime)));
+            RETURN_IF_FAILED(reader.Read(&entry.Size, sizeof(entry.Size)));
+            RETURN_IF_FAILED(reader.Read(entry.Geometry.Position, sizeof(entry.Geometry.Position)));
+            RETURN_IF_FAILED(reader.Read(entry.Geometry.Orientation, sizeof(entry.Geometry.Orientation)));
+
+            DWORD recordSize;
+            RETURN_IF_FAILED(reader.Read(&recordSize, sizeof(recordSize)));
+            RETURN_IF_FAILED(reader.Skip(recordSize, &entry.pRecord));
+            entry.RecordSize = recordSize;
+        }
+        RETURN_HR_IF_FALSE(E_FAIL, reader.IsEnd());
+        return S_OK;
+    }
+
+    class Reader
+    {
+    public:
+        Reader(const char* pData, size_t size) : m_current(pData), m_end(pData + size) {}
+
+        bool IsEnd() const { return m_current == m_end; }
+
+        HRESULT Read(void* pValue, size_t size)
+        {
+            const char* pData;
+            RETURN_IF_FAILED(Skip(size, &pData));
+            memcpy(pValue, pData, size);
+            return S_OK;
+        }
+
+        HRESULT Skip(size_t size, const char** ppData)
+        {
+            RETURN_HR_IF(E_FAIL, static_cast<size_t>(m_end - m_current) < size);
+            *ppData = m_current;
+            m_current += size;
+            return S_OK;
+        }
+
+    private:
+        const char* m_current;
+        const char* m_end;
+    };
+
+    Application::Infrastructure::MappedFile m_mappedFile;
+    std::vector<Entry> m_entries;
+};
+
+/// <summary>
+/// Built from a single metadata pass over a folder. Besides the sorted slices it
+/// records where each file keeps its pixel data, so the pixel pass is one
+/// positioned read (or a view into a mapping) per file with no tag walking.
+/// The pass is skipped for files that are unchanged since the last run, their
+/// metadata comes from the sidecar SeriesIndexFile instead.
+/// </summary>
+class SeriesIndex
+{
+public:
+    HRESULT Load(const std::wstring& folder)
+    {
+        std::vector<std::wstring> fileNames;
+        RETURN_IF_FAILED(GetSliceFileNames(folder, &fileNames));
+        RETURN_HR_IF(E_FAIL, fileNames.empty());
+
+        SeriesIndexFile indexFile;
+        RETURN_IF_FAILED(indexFile.Open(folder));
+        auto& indexEntries = indexFile.GetEntries();
+
+        std::map<std::string, const SeriesIndexFile::Entry*> indexEntriesByName;
+        for (auto& entry : indexEntries)
+        {
+            indexEntriesByName.emplace(entry.FileName, &entry);
+        }
+
+        // Files with a fresh entry are recreated from it, the others are parsed
+        std::vector<std::shared_ptr<DicomFile>> metadataFiles(fileNames.size());
+        std::vector<SliceGeometry> geometries(fileNames.size());
+        std::vector<size_t> staleFiles;
+        for (size_t i = 0; i < fileNames.size(); i++)
+        {
+            auto foundIt = indexEntriesByName.find(SeriesIndexFile::GetEntryName(fileNames[i]));
+
+            int64_t lastWriteTime;
+            uint64_t size;
+            if (foundIt != std::end(indexEntriesByName) &&
+                SUCCEEDED(SeriesIndexFile::GetFileStamp(fileNames[i], &lastWriteTime, &size)) &&
+                foundIt->second->LastWriteTime == lastWriteTime &&
+                foundIt->second->Size == size &&
+                SUCCEEDED(DicomFile::ReadMetadataRecord(
+                    fileNames[i],
+                    MetadataTags::GetFilter(),
+                    foundIt->second->pRecord,
+                    foundIt->second->RecordSize,
+                    &metadataFiles[i])))
+            {
+                geometries[i] = foundIt->second->Geometry;
+            }
+            else
+            {
+                staleFiles.push_back(i);
+            }
+        }
+
+        if (staleFiles.empty() && indexEntries.size() == fileNames.size())
+        {
+            // The index is in scene order
+            std::map<std::string, size_t> order;
+            for (size_t i = 0; i < indexEntries.size(); i++)
+            {
+                order.emplace(indexEntries[i].FileName, i);
+            }
+
+            std::vector<std::shared_ptr<DicomFile>> sortedFiles(metadataFiles.size());
+            for (auto& file : metadataFiles)
+            {
+                sortedFiles[order.at(SeriesIndexFile::GetEntryName(file->SafeGetFilename()))] = file;
+            }
+            metadataFiles.swap(sortedFiles);
+        }
+        else
+        {
+            std::vector<std::wstring> staleFileNames;
+            for (auto i : staleFiles)
+            {
+                staleFileNames.push_back(fileNames[i]);
+            }
+
+            std::vector<std::shared_ptr<DicomFile>> parsedFiles;
+            RETURN_IF_FAILED(GetMetadataFiles(staleFileNames, &parsedFiles));
+            for (size_t i = 0; i < staleFiles.size(); i++)
+            {
+                metadataFiles[staleFiles[i]] = parsedFiles[i];
+                FAIL_FAST_IF_FAILED(GetSliceGeometry(parsedFiles[i], &geometries[staleFiles[i]]));
+            }
+
+            RETURN_IF_FAILED(SortFilesInScene(&metadataFiles, &geometries));
+
+            // The index is only a cache, the folder may well be read only
+            SeriesIndexFile::Save(folder, metadataFiles, geometries);
+        }
+
+        m_entries.clear();
+        m_entries.reserve(metadataFiles.size());
+        for (auto& file : metadataFiles)
+        {
+            SeriesIndexEntry entry;
+            entry.File = file;
+            RETURN_IF_FAILED(file->GetPixelDataLocation(&entry.PixelData));
+
+            // UI values are padded to even length with a NUL
+            if (SUCCEEDED(file->GetAttribute(Tags::TransferSyntaxUID, &entry.TransferSyntax)))
+            {
+                entry.TransferSyntax.erase(
+                    std::find(std::begin(entry.TransferSyntax), std::end(entry.TransferSyntax), L'\0'),
+                    std::end(entry.TransferSyntax));
+            }
+
+            m_entries.push_back(std::move(entry));
+        }
+
+        return S_OK;
+    }
+
+    unsigned GetCount() const
+    {
+        return static_cast<unsigned>(m_entries.size());
+    }
+
+    const SeriesIndexEntry& GetEntry(unsigned index) const
+    {
+        return m_entries.at(index);
+    }
+
+    const std::shared_ptr<DicomFile>& GetMetadataFile(unsigned index) const
+    {
+        return m_entries.at(index).File;
+    }
+
+    HRESULT LoadImageFile(unsigned index, std::shared_ptr<DicomFile>* pFile) const
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pFile);
+        RETURN_HR_IF(E_INVALIDARG, index >= m_entries.size());
+
+        auto& entry = m_entries[index];
+        RETURN_HR_IF_FALSE(E_NOTIMPL, IsNativeTransferSyntax(entry.TransferSyntax));
+        return MakeDicomImageFile(entry.File, pFile);
+    }
+
+private:
+    static bool IsNativeTransferSyntax(const std::wstring& transferSyntax)
+    {
+        // Files without a meta header are assumed to be explicit little endian
+        // as that is all the parser understands
+        return
+            transferSyntax.empty() ||
+            transferSyntax == L"1.2.840.10008.1.2.1";
+    }
+
+    std::vector<SeriesIndexEntry> m_entries;
+};
+
+} // DCM
@@ -0,0 +1,243 @@
+//
+// slice_loader.h
+// Loads the slices of a series on several threads ahead of their consumer.
+//
+
+#pragma once
+
+namespace DCM
+{
+
+struct LoadedSlice
+{
+    // Position of the slice in the sorted series
+    unsigned Index;
+    std::shared_ptr<DicomFile> File;
+};
+
+enum class SliceOrder
+{
+    // Slices are handed out by increasing index
+    InOrder,
+    // Slices are handed out as soon as they are loaded, for consumers whose
+    // result does not depend on the order of the slices
+    AnyOrder
+};
+
+/// <summary>
+/// Runs a pool of loaders over a SeriesIndex. Each loader claims the next slice,
+/// opens it and reads its pixel data, and passes it on tagged with its index.
+/// Slices that complete ahead of their turn wait in a reorder buffer when the
+/// consumer wants them in order. The slices that are loaded but not yet handed
+/// out are bounded by their size in bytes rather than by their number.
+/// </summary>
+class SliceLoader
+{
+public:
+    static const size_t DefaultMaxBytesInFlight = 64 * 1024 * 1024;
+    static const unsigned MaxLoaders = 8;
+
+    SliceLoader(
+        const SeriesIndex& series,
+        SliceOrder order,
+        size_t maxBytesInFlight = DefaultMaxBytesInFlight,
+        unsigned nLoaders = GetDefaultLoaderCount()) :
+            m_series(series),
+            m_order(order),
+            m_maxBytesInFlight(maxBytesInFlight),
+            m_loadedSlices((std::max)(series.GetCount(), 1u)),
+            m_reorderBuffer(order == SliceOrder::InOrder ? series.GetCount() : 0)
+    {
+        nLoaders = (std::max)(1u, (std::min)(nLoaders, series.GetCount()));
+        m_nRunningLoaders = nLoaders;
+        for (unsigned i = 0; i < nLoaders; i++)
+        {
+            m_loaders.emplace_back([this]() { RunLoader(); });
+        }
+    }
+
+    SliceLoader(const SliceLoader&) = delete;
+    SliceLoader& operator=(const SliceLoader&) = delete;
+
+    ~SliceLoader()
+    {
+        // Unblock loaders that wait for budget the consumer will never release
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isCanceled = true;
+        }
+        m_budgetAvailable.notify_all();
+
+        LoadedSlice slice;
+        while (m_loadedSlices.Dequeue(&slice) == S_OK)
+        {
+        }
+
+        for (auto& loader : m_loaders)
+        {
+            loader.join();
+        }
+    }
+
+    // Returns S_FALSE once every slice has been handed out, or the failure of
+    // the first slice that could not be loaded
+    HRESULT Next(LoadedSlice* pSlice)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pSlice);
+
+        if (m_order == SliceOrder::AnyOrder)
+        {
+            auto hr = m_loadedSlices.Dequeue(pSlice);
+            RETURN_IF_FAILED(hr);
+            if (hr == S_FALSE)
+            {
+                RETURN_IF_FAILED(GetLoadResult());
+                return S_FALSE;
+            }
+        }
+        else
+        {
+            RETURN_HR_IF(S_FALSE, m_nextIndex == m_series.GetCount());
+            while (!m_reorderBuffer[m_nextIndex])
+            {
+                LoadedSlice slice;
+                auto hr = m_loadedSlices.Dequeue(&slice);
+                RETURN_IF_FAILED(hr);
+                if (hr == S_FALSE)
+                {
+                    // The loaders stopped before loading every slice
+                    RETURN_IF_FAILED(GetLoadResult());
+                    return E_FAIL;
+                }
+                m_reorderBuffer[slice.Index] = std::move(slice.File);
+            }
+
+            pSlice->Index = m_nextIndex;
+            pSlice->File = std::move(m_reorderBuffer[m_nextIndex]);
+            m_nextIndex++;
+        }
+
+        // Once handed out the slice belongs to the consumer
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bytesInFlight -= GetSliceBytes(pSlice->Index);
+        }
+        m_budgetAvailable.notify_all();
+        return S_OK;
+    }
+
+    static unsigned GetDefaultLoaderCount()
+    {
+        // Loaders mostly wait on reads, a few more than there are cores keeps a
+        // fast drive busy
+        return (std::min)((std::max)(std::thread::hardware_concurrency(), 2u), MaxLoaders);
+    }
+
+private:
+    size_t GetSliceBytes(unsigned index) const
+    {
+        return m_series.GetEntry(index).PixelData.Length;
+    }
+
+    HRESULT GetLoadResult()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_loadResult;
+    }
+
+    void RunLoader()
+    {
+        for (;;)
+        {
+            // Slices are claimed in order together with their budget, so the
+            // next slice the consumer waits for never waits for budget held by
+            // the slices after it
+            unsigned index;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_budgetAvailable.wait(lock,
+                    [this]()
+                    {
+                        return
+                            m_isCanceled ||
+                            m_nextLoadIndex == m_series.GetCount() ||
+                            m_bytesInFlight == 0 ||
+                            m_bytesInFlight + GetSliceBytes(m_nextLoadIndex) <= m_maxBytesInFlight;
+                    });
+
+                if (m_isCanceled || m_nextLoadIndex == m_series.GetCount())
+                {
+                    break;
+                }
+
+                index = m_nextLoadIndex++;
+                m_bytesInFlight += GetSliceBytes(index);
+            }
+
+            LoadedSlice slice;
+            slice.Index = index;
+            auto hr = m_series.LoadImageFile(index, &slice.File);
+            if (FAILED(hr))
+            {
+                // The other loaders stop at their next slice, and the consumer
+                // gets this failure once the queue is drained
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (SUCCEEDED(m_loadResult))
+                    {
+                        m_loadResult = hr;
+                    }
+                    m_isCanceled = true;
+                }
+                m_budgetAvailable.notify_all();
+                break;
+            }
+            ReadPixelData(slice.File);
+            FAIL_FAST_IF_FAILED(m_loadedSlices.Enqueue(std::move(slice)));
+        }
+
+        if (--m_nRunningLoaders == 0)
+        {
+            m_loadedSlices.Finish();
+        }
+    }
+
+    // The pixel data of a mapped file is only read when it is first touched.
+    // Touch every page here so that the read happens on the loader.
+    static void ReadPixelData(const std::shared_ptr<DicomFile>& file)
+    {
+        const size_t PageSize = 4096;
+
+        AttributeView pixelData;
+        if (SUCCEEDED(file->GetAttributeView(Tags::PixelData, &pixelData)))
+        {
+            volatile char sink = 0;
+            for (size_t offset = 0; offset < pixelData.size(); offset += PageSize)
+            {
+                sink ^= pixelData.data()[offset];
+            }
+        }
+    }
+
+    const SeriesIndex& m_series;
+    const SliceOrder m_order;
+    const size_t m_maxBytesInFlight;
+
+    // Loader side, guarded by m_mutex
+    std::mutex m_mutex;
+    std::condition_variable m_budgetAvailable;
+    unsigned m_nextLoadIndex = 0;
+    size_t m_bytesInFlight = 0;
+    bool m_isCanceled = false;
+    HRESULT m_loadResult = S_OK;
+
+    std::atomic<unsigned> m_nRunningLoaders { 0 };
+    Concurrency::ConcurrentQueue<LoadedSlice> m_loadedSlices;
+    std::vector<std::thread> m_loaders;
+
+    // Consumer side
+    std::vector<std::shared_ptr<DicomFile>> m_reorderBuffer;
+    unsigned m_nextIndex = 0;
+};
+
+} // DCM
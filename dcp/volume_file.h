@@ -0,0 +1,214 @@
+//
+// volume_file.h
+// The .dd files that operations write and read, raw images and volumes of
+// floats along with their shape and placement in the scene.
+//
+
+#pragma once
+
+namespace DCM
+{
+
+enum class VolumeDataType : uint32_t
+{
+    Float32 = 1,
+    UInt16 = 2
+};
+
+template <typename T> struct VolumeDataTypeOf;
+template <> struct VolumeDataTypeOf<float> { static const VolumeDataType Value = VolumeDataType::Float32; };
+template <> struct VolumeDataTypeOf<uint16_t> { static const VolumeDataType Value = VolumeDataType::UInt16; };
+
+inline unsigned GetDataTypeSize(VolumeDataType dataType)
+{
+    return dataType == VolumeDataType::UInt16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+/// <summary>
+/// Shape of a volume and where it is in the scene. Voxels are stored a row at a
+/// time, the row of every slice before the next row, which is the
+/// (Width * Depth) x Height mosaic that operations have always written. A plain
+/// image is a volume with a depth of 1.
+/// </summary>
+struct VolumeDescription
+{
+    unsigned Width = 0;
+    unsigned Height = 0;
+    unsigned Depth = 1;
+    unsigned Channels = 1;
+    VolumeDataType DataType = VolumeDataType::Float32;
+
+    // Millimeters between the voxel centers along x, y and z
+    float Spacing[3] = { 1.f, 1.f, 1.f };
+
+    // ImageOrientationPatient, the row then the column direction cosines
+    float Orientation[6] = { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f };
+
+    static VolumeDescription FromMosaic(unsigned width, unsigned height, unsigned bytesPerPixel)
+    {
+        VolumeDescription description;
+        description.Width = width;
+        description.Height = height;
+        description.DataType = bytesPerPixel % sizeof(float) == 0 ? VolumeDataType::Float32 : VolumeDataType::UInt16;
+        description.Channels = bytesPerPixel / GetDataTypeSize(description.DataType);
+        return description;
+    }
+
+    unsigned GetMosaicWidth() const
+    {
+        return Width * Depth;
+    }
+
+    unsigned GetBytesPerVoxel() const
+    {
+        return Channels * GetDataTypeSize(DataType);
+    }
+
+    uint64_t GetPayloadSize() const
+    {
+        return static_cast<uint64_t>(Width) * Height * Depth * GetBytesPerVoxel();
+    }
+};
+
+/// <summary>
+/// A .dd file, mapped so that its voxels are read in place. Version 2 is a
+/// header
+///     char        Magic[8]
+///     DWORD       Version
+///     DWORD       Header size, the offset of the voxels
+///     DWORD       Width, height, depth and channels
+///     DWORD       VolumeDataType
+///     float[9]    Spacing, orientation
+///     uint64_t    Size of the voxels in bytes
+/// padded with zeros to a multiple of PayloadAlignment, followed by the voxels.
+/// Version 1 files are a header of the width, height and bytes per pixel of
+/// the mosaic followed by its floats, and are still read.
+/// </summary>
+class VolumeFile
+{
+public:
+    static const DWORD Version = 2;
+    static const size_t PayloadAlignment = 64;
+
+    static HRESULT Save(const void* pData, const VolumeDescription& description, const std::wstring& fileName)
+    {
+        RETURN_HR_IF_NULL(E_POINTER, pData);
+        RETURN_HR_IF(E_INVALIDARG, description.Channels == 0);
+
+        Header header = {};
+        memcpy(header.Magic, Magic, sizeof(Magic));
+        header.Version = Version;
+        header.HeaderSize = HeaderSize;
+        header.Width = description.Width;
+        header.Height = description.Height;
+        header.Depth = description.Depth;
+        header.Channels = description.Channels;
+        header.DataType = static_cast<DWORD>(description.DataType);
+        memcpy(header.Spacing, description.Spacing, sizeof(header.Spacing));
+        memcpy(header.Orientation, description.Orientation, sizeof(header.Orientation));
+        header.PayloadSize = description.GetPayloadSize();
+
+        char paddedHeader[HeaderSize] = {};
+        memcpy(paddedHeader, &header, sizeof(header));
+
+        std::ofstream stream(ToNativePath(fileName), std::ios_base::trunc | std::ios_base::binary | std::ios_base::out);
+        stream.write(paddedHeader, sizeof(paddedHeader));
+        stream.write(reinterpret_cast<const char*>(pData), static_cast<std::streamsize>(header.PayloadSize));
+        stream.close();
+        RETURN_HR_IF(E_FAIL, stream.fail());
+        return S_OK;
+    }
+
+    HRESULT Open(const std::wstring& fileName)
+    {
+        m_pPayload = nullptr;
+        RETURN_IF_FAILED(m_mappedFile.Open(fileName));
+
+        auto pData = m_mappedFile.GetData();
+        auto size = m_mappedFile.GetSize();
+        RETURN_HR_IF(E_FAIL, size < sizeof(unsigned) * 3);
+
+        if (size >= sizeof(Header) && memcmp(pData, Magic, sizeof(Magic)) == 0)
+        {
+            Header header;
+            memcpy(&header, pData, sizeof(header));
+            RETURN_HR_IF(E_FAIL, header.Version != Version);
+            RETURN_HR_IF(E_FAIL, header.HeaderSize < sizeof(Header) || header.HeaderSize % PayloadAlignment != 0);
+            RETURN_HR_IF(E_FAIL,
+                header.DataType != static_cast<DWORD>(VolumeDataType::Float32) &&
+                header.DataType != static_cast<DWORD>(VolumeDataType::UInt16));
+
+            m_version = header.Version;
+            m_description.Width = header.Width;
+            m_description.Height = header.Height;
+            m_description.Depth = header.Depth;
+            m_description.Channels = header.Channels;
+            m_description.DataType = static_cast<VolumeDataType>(header.DataType);
+            memcpy(m_description.Spacing, header.Spacing, sizeof(header.Spacing));
+            memcpy(m_description.Orientation, header.Orientation, sizeof(header.Orientation));
+            RETURN_HR_IF(E_FAIL, header.PayloadSize != m_description.GetPayloadSize());
+            RETURN_HR_IF(E_FAIL, header.HeaderSize > size);
+            RETURN_HR_IF(E_FAIL, size - header.HeaderSize < header.PayloadSize);
+            m_pPayload = pData + header.HeaderSize;
+            return S_OK;
+        }
+
+        unsigned legacyHeader[3];
+        memcpy(legacyHeader, pData, sizeof(legacyHeader));
+        RETURN_HR_IF(E_FAIL, legacyHeader[2] == 0 || legacyHeader[2] % sizeof(uint16_t) != 0);
+
+        m_version = 1;
+        m_description = VolumeDescription::FromMosaic(legacyHeader[0], legacyHeader[1], legacyHeader[2]);
+        RETURN_HR_IF(E_FAIL, size - sizeof(legacyHeader) < m_description.GetPayloadSize());
+        m_pPayload = pData + sizeof(legacyHeader);
+        return S_OK;
+    }
+
+    DWORD GetVersion() const
+    {
+        return m_version;
+    }
+
+    const VolumeDescription& GetDescription() const
+    {
+        return m_description;
+    }
+
+    // Voxels in place in the mapping, valid for as long as this object is
+    template <typename T>
+    HRESULT GetData(const T** ppData) const
+    {
+        RETURN_HR_IF_NULL(E_POINTER, ppData);
+        RETURN_HR_IF_NULL(E_FAIL, m_pPayload);
+        RETURN_HR_IF(E_INVALIDARG, m_description.DataType != VolumeDataTypeOf<T>::Value);
+        *ppData = reinterpret_cast<const T*>(m_pPayload);
+        return S_OK;
+    }
+
+private:
+    static constexpr char Magic[8] = { 'D', 'C', 'P', 'V', 'O', 'L', '\0', '\0' };
+    static const DWORD HeaderSize = 128;
+
+    struct Header
+    {
+        char Magic[8];
+        DWORD Version;
+        DWORD HeaderSize;
+        DWORD Width;
+        DWORD Height;
+        DWORD Depth;
+        DWORD Channels;
+        DWORD DataType;
+        float Spacing[3];
+        float Orientation[6];
+        uint64_t PayloadSize;
+    };
+    static_assert(sizeof(Header) <= HeaderSize, "The header must fit before the payload");
+
+    Application::Infrastructure::MappedFile m_mappedFile;
+    VolumeDescription m_description;
+    DWORD m_version = 0;
+    const char* m_pPayload = nullptr;
+};
+
+} // DCM
@@ -278,6 +278,8 @@ $allGFactor = @();
             }   
     }
 
+# Version 1 gfactor.dd files from an earlier run are reused unless -Force,
+# and only version 2 files record their depth
 $depth = $VoxelSize * 12 / 10;
 
 $allGFactor | Group-Object -Property { $_.Name.Substring(0,3) } | ForEach-Object {